@@ -1,4 +1,5 @@
 #include "fs.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -219,7 +220,7 @@ void test_read_after_partial_write_failure()
     free(fill_data);
 
     // Now attempt a write that should fail due to insufficient space
-    int large_size = 20 * BLOCK_SIZE; // 80KB - should fail
+    int large_size = MAX_BLOCKS * BLOCK_SIZE; // Larger than the whole disk - should fail
     char *large_data = malloc(large_size);
     for (int i = 0; i < large_size; i++)
     {
@@ -1305,6 +1306,29 @@ void format_twice_without_unmount()
     unlink("test_mounted.img");
 }
 
+void format_after_write_failure()
+{
+    printf(YELLOW "Format after a failed format - Format /dev/full, where every write fails, then a real image" RESET "\n");
+
+    if (fs_format("/dev/full") != -1)
+    {
+        printf(RED "Format after a failed format - Failed (writes to /dev/full should fail)" RESET "\n");
+        exit(-1);
+    }
+
+    // The failed format must not leave the image looking open
+    if (fs_format("test_after_failure.img") != 0 || fs_mount("test_after_failure.img") != 0)
+    {
+        printf(RED "Format after a failed format - Failed (could not format or mount afterwards)" RESET "\n");
+        unlink("test_after_failure.img");
+        exit(-1);
+    }
+
+    printf(GREEN "Format after a failed format - Success" RESET "\n");
+    fs_unmount();
+    unlink("test_after_failure.img");
+}
+
 // fs_format() Edge Cases
 
 void fs_format_tests()
@@ -1345,6 +1369,7 @@ void fs_format_tests()
     printf(GREEN "Path with special characters - Use paths like \"test/../../disk.img\" - Success" RESET "\n");
 
     format_twice_without_unmount();
+    format_after_write_failure();
 
     // format_in_readOnly_path();
 
@@ -1463,8 +1488,8 @@ void test_fs_write()
     // Test 4: Write maximum file size - 48KB
     test_write_amount_of_bytes(MAX_DIRECT_BLOCKS * BLOCK_SIZE, "Write maximum file size - 48KB");
 
-    // Test 5: Write maximum file size + 1 - 48KB +1 byte
-    test_write_expected_failure(MAX_DIRECT_BLOCKS * BLOCK_SIZE + 1, -3, "Write maximum file size + 1 - 48KB + 1 byte");
+    // Test 5: Write maximum direct size + 1 - 48KB +1 byte, the rest goes through the indirect block
+    test_write_amount_of_bytes(MAX_DIRECT_BLOCKS * BLOCK_SIZE + 1, "Write maximum direct size + 1 - 48KB + 1 byte");
 
     // Test 6: Attempting to write files when the disk is full
     test_write_when_disk_full();
@@ -1519,10 +1544,283 @@ void test_fs_read()
     printf(GREEN " FS_READ() Tests Passed" RESET "\n\n");
 }
 
+// Test FS_PWRITE():
+
+// Reads the whole file and compares it with 'expected'
+void check_file_contents(const char *filename, const char *expected, int size, const char *test_name)
+{
+    char *read_buffer = malloc(size + 1);
+    int bytes_read = fs_read(filename, read_buffer, size + 1);
+
+    if (bytes_read != size || memcmp(read_buffer, expected, size) != 0)
+    {
+        printf(RED "%s - File contents do not match (read %d of %d bytes)" RESET "\n", test_name, bytes_read, size);
+        free(read_buffer);
+        exit(-1);
+    }
+    free(read_buffer);
+}
+
+void test_pwrite_in_place()
+{
+    printf(YELLOW "Overwrite one byte in the middle of a 48KB file - Test" RESET "\n");
+
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *expected = malloc(size);
+    memset(expected, 'P', size);
+    fs_create("pwrite_in_place");
+    fs_write("pwrite_in_place", expected, size);
+
+    fs_stats before, after;
+    fs_get_stats(&before);
+    if (fs_pwrite("pwrite_in_place", 5 * BLOCK_SIZE + 17, "x", 1) != 0)
+    {
+        printf(RED "Overwrite one byte in the middle of a 48KB file - pwrite failed" RESET "\n");
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    expected[5 * BLOCK_SIZE + 17] = 'x';
+
+    // One data request and no metadata change
+    if (after.data_io_calls - before.data_io_calls != 1 || after.metadata_syncs != before.metadata_syncs)
+    {
+        printf(RED "Overwrite one byte in the middle of a 48KB file - Touched more than one block" RESET "\n");
+        exit(-1);
+    }
+    check_file_contents("pwrite_in_place", expected, size, "Overwrite one byte in the middle of a 48KB file");
+
+    // A write spanning a block boundary
+    memset(expected + BLOCK_SIZE - 3, 'y', 6);
+    fs_pwrite("pwrite_in_place", BLOCK_SIZE - 3, "yyyyyy", 6);
+    check_file_contents("pwrite_in_place", expected, size, "Overwrite one byte in the middle of a 48KB file");
+
+    free(expected);
+    fs_delete("pwrite_in_place");
+    printf(GREEN "Overwrite one byte in the middle of a 48KB file - Success" RESET "\n");
+}
+
+void test_pwrite_extends_with_zeros()
+{
+    printf(YELLOW "Write past the end of a file - Gap reads back as zeros - Test" RESET "\n");
+
+    // Dirty some blocks first so a missing zero fill would show up
+    char *junk = malloc(3 * BLOCK_SIZE);
+    memset(junk, 'J', 3 * BLOCK_SIZE);
+    fs_create("pwrite_junk");
+    fs_write("pwrite_junk", junk, 3 * BLOCK_SIZE);
+    fs_delete("pwrite_junk");
+    free(junk);
+
+    char expected[2 * BLOCK_SIZE + 10];
+    memset(expected, 0, sizeof(expected));
+    memcpy(expected, "head", 4);
+    memcpy(expected + 2 * BLOCK_SIZE + 5, "tail!", 5);
+
+    fs_create("pwrite_grow");
+    fs_write("pwrite_grow", "head", 4);
+    if (fs_pwrite("pwrite_grow", 2 * BLOCK_SIZE + 5, "tail!", 5) != 0)
+    {
+        printf(RED "Write past the end of a file - pwrite failed" RESET "\n");
+        exit(-1);
+    }
+    check_file_contents("pwrite_grow", expected, sizeof(expected), "Write past the end of a file");
+
+    // Writes that would exceed the maximum file size are rejected; past 2GB is
+    // allowed, but this image runs out of space first
+    if (fs_pwrite("pwrite_grow", LLONG_MAX, "z", 1) != -3)
+    {
+        printf(RED "Write past the end of a file - Write past the maximum size was accepted" RESET "\n");
+        exit(-1);
+    }
+    if (fs_pwrite("pwrite_grow", INT_MAX, "z", 1) != -2)
+    {
+        printf(RED "Write past the end of a file - Write beyond the image did not run out of space" RESET "\n");
+        exit(-1);
+    }
+    if (fs_pwrite("pwrite_grow", -1, "z", 1) != -3 || fs_pwrite("no_such_file", 0, "z", 1) != -1)
+    {
+        printf(RED "Write past the end of a file - Bad arguments were accepted" RESET "\n");
+        exit(-1);
+    }
+    check_file_contents("pwrite_grow", expected, sizeof(expected), "Write past the end of a file");
+
+    fs_delete("pwrite_grow");
+    printf(GREEN "Write past the end of a file - Gap reads back as zeros - Success" RESET "\n");
+}
+
+void test_fs_pwrite()
+{
+    printf(YELLOW " FS_PWRITE() tests:" RESET "\n\n");
+    fs_format("test_file_system_pwrite.img");
+    fs_mount("test_file_system_pwrite.img");
+
+    // Test 1: Overwrite bytes inside an existing file
+    test_pwrite_in_place();
+
+    // Test 2: Extend a file past its end
+    test_pwrite_extends_with_zeros();
+
+    fs_unmount();
+    unlink("test_file_system_pwrite.img");
+    printf(GREEN " FS_PWRITE() Tests Passed" RESET "\n\n");
+}
+
+// Test FS_APPEND():
+
+void test_append_records()
+{
+    printf(YELLOW "Append 100-byte records past the direct blocks - Test" RESET "\n");
+
+    int size = (MAX_DIRECT_BLOCKS + 2) * BLOCK_SIZE; // Ends in the indirect block
+    char *expected = malloc(size);
+    char record[100];
+    int length = 0;
+
+    fs_create("append_log");
+    while (length + (int)sizeof(record) <= size)
+    {
+        memset(record, 'a' + (length / sizeof(record)) % 26, sizeof(record));
+        if (fs_append("append_log", record, sizeof(record)) != 0)
+        {
+            printf(RED "Append 100-byte records past the direct blocks - Append failed at %d bytes" RESET "\n", length);
+            exit(-1);
+        }
+        memcpy(expected + length, record, sizeof(record));
+        length += sizeof(record);
+    }
+    check_file_contents("append_log", expected, length, "Append 100-byte records past the direct blocks");
+
+    if (fs_append("append_log", record, 0) != 0 || fs_append("no_such_file", record, 1) != -1)
+    {
+        printf(RED "Append 100-byte records past the direct blocks - Unexpected result for edge cases" RESET "\n");
+        exit(-1);
+    }
+    check_file_contents("append_log", expected, length, "Append 100-byte records past the direct blocks");
+
+    free(expected);
+    fs_delete("append_log");
+    printf(GREEN "Append 100-byte records past the direct blocks - Success" RESET "\n");
+}
+
+void test_fs_append()
+{
+    printf(YELLOW " FS_APPEND() tests:" RESET "\n\n");
+    fs_format("test_file_system_append.img");
+    fs_mount("test_file_system_append.img");
+
+    // Test 1: Grow a file record by record into the indirect block
+    test_append_records();
+
+    fs_unmount();
+    unlink("test_file_system_append.img");
+    printf(GREEN " FS_APPEND() Tests Passed" RESET "\n\n");
+}
+
+// Test FS_PREAD():
+
+void test_pread_tail_of_large_file()
+{
+    printf(YELLOW "Read the last 100 bytes of a 48KB file - Test" RESET "\n");
+
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *data = malloc(size);
+    for (int i = 0; i < size; i++)
+    {
+        data[i] = (char)(i % 251);
+    }
+    fs_create("pread_large");
+    fs_write("pread_large", data, size);
+
+    char read_buffer[200];
+    fs_stats before, after;
+    fs_set_cache_size(0); // Count the requests that reach the image
+    fs_get_stats(&before);
+    int bytes_read = fs_pread("pread_large", read_buffer, size - 100, 200);
+    fs_get_stats(&after);
+    fs_set_cache_size(256);
+
+    if (bytes_read != 100 || memcmp(read_buffer, data + size - 100, 100) != 0)
+    {
+        printf(RED "Read the last 100 bytes of a 48KB file - Expected 100 matching bytes, read %d" RESET "\n", bytes_read);
+        exit(-1);
+    }
+    if (after.data_io_calls - before.data_io_calls != 1)
+    {
+        printf(RED "Read the last 100 bytes of a 48KB file - Read more than the last block" RESET "\n");
+        exit(-1);
+    }
+
+    // A range crossing a block boundary
+    bytes_read = fs_pread("pread_large", read_buffer, 3 * BLOCK_SIZE - 50, 150);
+    if (bytes_read != 150 || memcmp(read_buffer, data + 3 * BLOCK_SIZE - 50, 150) != 0)
+    {
+        printf(RED "Read the last 100 bytes of a 48KB file - Cross-block read mismatch" RESET "\n");
+        exit(-1);
+    }
+
+    free(data);
+    fs_delete("pread_large");
+    printf(GREEN "Read the last 100 bytes of a 48KB file - Success" RESET "\n");
+}
+
+void test_pread_edge_cases()
+{
+    printf(YELLOW "Read at and past the end of file, bad arguments - Test" RESET "\n");
+
+    char read_buffer[16];
+    fs_create("pread_small");
+    fs_write("pread_small", "0123456789", 10);
+
+    if (fs_pread("pread_small", read_buffer, 10, 5) != 0 || fs_pread("pread_small", read_buffer, 1000, 5) != 0)
+    {
+        printf(RED "Read at and past the end of file - Expected 0 bytes" RESET "\n");
+        exit(-1);
+    }
+    if (fs_pread("pread_small", read_buffer, 7, 0) != 0)
+    {
+        printf(RED "Read at and past the end of file - Expected 0 bytes for size 0" RESET "\n");
+        exit(-1);
+    }
+    if (fs_pread("pread_small", read_buffer, 7, 16) != 3 || memcmp(read_buffer, "789", 3) != 0)
+    {
+        printf(RED "Read at and past the end of file - Short read mismatch" RESET "\n");
+        exit(-1);
+    }
+    if (fs_pread("pread_small", NULL, 0, 5) != -3 || fs_pread("pread_small", read_buffer, -1, 5) != -3 ||
+        fs_pread("no_such_file", read_buffer, 0, 5) != -1)
+    {
+        printf(RED "Read at and past the end of file - Bad arguments were accepted" RESET "\n");
+        exit(-1);
+    }
+
+    fs_delete("pread_small");
+    printf(GREEN "Read at and past the end of file, bad arguments - Success" RESET "\n");
+}
+
+void test_fs_pread()
+{
+    printf(YELLOW " FS_PREAD() tests:" RESET "\n\n");
+    fs_format("test_file_system_pread.img");
+    fs_mount("test_file_system_pread.img");
+
+    // Test 1: Read a small range from the end of a large file
+    test_pread_tail_of_large_file();
+
+    // Test 2: Offsets at or past the end, zero sizes and invalid arguments
+    test_pread_edge_cases();
+
+    fs_unmount();
+    unlink("test_file_system_pread.img");
+    printf(GREEN " FS_PREAD() Tests Passed" RESET "\n\n");
+}
+
 void main()
 {
     fs_format_tests();
     fs_create_tests();
     test_fs_write();
     test_fs_read();
+    test_fs_pwrite();
+    test_fs_append();
+    test_fs_pread();
 }
@@ -1,5 +1,14 @@
 #include "fs.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #define RED "\033[0;31m"
 #define GREEN "\033[0;32m"
@@ -181,6 +190,317 @@ void mount_with_invalid_metadata()
     // add more invalid metadata tests as needed
 }
 
+void mount_mmap_zero_copy()
+{
+    // Mount with mmap - Data written through the mapping persists and zero-copy reads see it
+    printf(YELLOW "Mount with mmap - Write, zero-copy read, remount normally - Testing" RESET "\n");
+    const char *path = "test_imgs/mmap.img";
+    fs_format(path);
+
+    int size = 3 * BLOCK_SIZE + 100;
+    char *data = malloc(size);
+    for (int i = 0; i < size; i++)
+        data[i] = (char)(i % 251);
+
+    if (fs_mount_mmap(path) != 0)
+    {
+        printf(RED "Mount with mmap - Mount failed" RESET "\n");
+        exit(-1);
+    }
+    if (fs_create("mapped.bin") != 0 || fs_write("mapped.bin", data, size) != 0)
+    {
+        printf(RED "Mount with mmap - Create/write failed" RESET "\n");
+        exit(-1);
+    }
+
+    fs_segment segments[MAX_DIRECT_BLOCKS];
+    int count = fs_read_zerocopy("mapped.bin", segments, MAX_DIRECT_BLOCKS);
+    int offset = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (memcmp(segments[i].data, data + offset, segments[i].length) != 0)
+        {
+            printf(RED "Mount with mmap - Zero-copy segment %d mismatch" RESET "\n", i);
+            exit(-1);
+        }
+        offset += segments[i].length;
+    }
+    if (count < 1 || offset != size)
+    {
+        printf(RED "Mount with mmap - Zero-copy covered %d of %d bytes" RESET "\n", offset, size);
+        exit(-1);
+    }
+
+    // With room for a single segment only the start of the file comes back
+    if (fs_read_zerocopy("mapped.bin", segments, 1) != 1 || fs_read_zerocopy("missing.bin", segments, 1) != -1)
+    {
+        printf(RED "Mount with mmap - Zero-copy edge cases failed" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+
+    // Zero-copy needs the mapping, but the file must be readable by a normal mount
+    char *read_buf = malloc(size);
+    fs_mount(path);
+    if (fs_read_zerocopy("mapped.bin", segments, MAX_DIRECT_BLOCKS) != -3 ||
+        fs_read("mapped.bin", read_buf, size) != size || memcmp(read_buf, data, size) != 0)
+    {
+        printf(RED "Mount with mmap - Data not readable after normal remount" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+
+    // An image shorter than the full filesystem cannot be mapped
+    truncate(path, BLOCK_SIZE * 64);
+    if (fs_mount_mmap(path) != -1)
+    {
+        printf(RED "Mount with mmap - Truncated image was mapped" RESET "\n");
+        exit(-1);
+    }
+
+    free(data);
+    free(read_buf);
+    printf(GREEN "Mount with mmap - Success" RESET "\n");
+}
+
+void mount_custom_geometry()
+{
+    // Mount with custom geometry - Images from fs_format_ex with other block sizes and inode counts
+    printf(YELLOW "Mount with custom geometry - Large blocks, many inodes, small blocks - Testing" RESET "\n");
+    const char *bulk_path = "test_imgs/geometry_64k.img";
+    const char *small_path = "test_imgs/geometry_512.img";
+
+    // 2048 x 64KB blocks (128MB, sparse) with room for 1000 files
+    int big_size = 3 * 1024 * 1024 + 123;
+    char *big = malloc(big_size);
+    char *read_buf = malloc(big_size);
+    for (int i = 0; i < big_size; i++)
+        big[i] = (char)(i % 247);
+
+    if (fs_format_ex(bulk_path, 2048, 65536, 1000) != 0 || fs_mount(bulk_path) != 0)
+    {
+        printf(RED "Mount with custom geometry - 64KB image format/mount failed" RESET "\n");
+        exit(-1);
+    }
+    char name[MAX_FILENAME + 1];
+    for (int i = 0; i < 300; i++)
+    {
+        snprintf(name, sizeof(name), "small_%d", i);
+        if (fs_create(name) != 0 || fs_write(name, name, strlen(name)) != 0)
+        {
+            printf(RED "Mount with custom geometry - Create %d of 300 failed" RESET "\n", i);
+            exit(-1);
+        }
+    }
+    if (fs_create("big.bin") != 0 || fs_write("big.bin", big, big_size) != 0)
+    {
+        printf(RED "Mount with custom geometry - 3MB write failed" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+
+    char(*names)[MAX_FILENAME] = malloc(1000 * sizeof(*names));
+    if (fs_mount(bulk_path) != 0 || fs_list(names, 1000) != 301 || fs_read("big.bin", read_buf, big_size) != big_size ||
+        memcmp(read_buf, big, big_size) != 0 || fs_read("small_299", read_buf, big_size) != 9 ||
+        memcmp(read_buf, "small_299", 9) != 0)
+    {
+        printf(RED "Mount with custom geometry - 64KB image contents lost on remount" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+    free(names);
+
+    // 4096 x 512-byte blocks (2MB) with 64 inodes; block pointers only hold 128 entries
+    if (fs_format_ex(small_path, 4096, 512, 64) != 0 || fs_mount_mmap(small_path) != 0)
+    {
+        printf(RED "Mount with custom geometry - 512-byte image format/mount failed" RESET "\n");
+        exit(-1);
+    }
+    fs_set_extent_mapping(0);
+    int small_size = 20000; // 12 direct blocks, then 28 through the indirect block
+    if (fs_create("pointers.bin") != 0 || fs_write("pointers.bin", big, small_size) != 0)
+    {
+        printf(RED "Mount with custom geometry - 512-byte image write failed" RESET "\n");
+        exit(-1);
+    }
+    fs_set_extent_mapping(1);
+    for (int i = 1; i < 64; i++)
+    {
+        snprintf(name, sizeof(name), "tiny_%d", i);
+        if (fs_create(name) != 0)
+        {
+            printf(RED "Mount with custom geometry - Create %d of 64 failed" RESET "\n", i);
+            exit(-1);
+        }
+    }
+    if (fs_create("one_too_many") != -2)
+    {
+        printf(RED "Mount with custom geometry - Inode table larger than formatted" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+
+    if (fs_mount(small_path) != 0 || fs_read("pointers.bin", read_buf, big_size) != small_size ||
+        memcmp(read_buf, big, small_size) != 0)
+    {
+        printf(RED "Mount with custom geometry - 512-byte image contents lost on remount" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+
+    // Block sizes that are not a power of two, more than 2^30 blocks, no inodes,
+    // and no room left for data are all rejected
+    if (fs_format_ex(small_path, 2560, 1000, 256) != -1 || fs_format_ex(small_path, (1 << 30) + 1, 512, 64) != -1 ||
+        fs_format_ex(small_path, 2560, 4096, 0) != -1 || fs_format_ex(small_path, 20, 4096, 256) != -1)
+    {
+        printf(RED "Mount with custom geometry - Invalid geometry accepted" RESET "\n");
+        exit(-1);
+    }
+
+    // A superblock without the magic, or from another layout version, is refused
+    superblock sb;
+    fs_format_ex(small_path, 4096, 512, 64);
+    FILE *image = fopen(small_path, "r+b");
+    fread(&sb, sizeof(sb), 1, image);
+    superblock foreign = sb;
+    foreign.magic = 0;
+    rewind(image);
+    fwrite(&foreign, sizeof(foreign), 1, image);
+    fflush(image);
+    int no_magic = fs_mount(small_path);
+    foreign.magic = FS_MAGIC;
+    foreign.version = FS_VERSION + 1;
+    rewind(image);
+    fwrite(&foreign, sizeof(foreign), 1, image);
+    fflush(image);
+    int newer = fs_mount(small_path);
+    rewind(image);
+    fwrite(&sb, sizeof(sb), 1, image);
+    fclose(image);
+    if (no_magic != -1 || newer != -1 || fs_mount(small_path) != 0)
+    {
+        printf(RED "Mount with custom geometry - Superblock magic or version not checked" RESET "\n");
+        exit(-1);
+    }
+    fs_unmount();
+
+    free(big);
+    free(read_buf);
+    remove(bulk_path);
+    printf(GREEN "Mount with custom geometry - Success" RESET "\n");
+}
+
+void *format_tenant_image(void *arg)
+{
+    // Formats test_imgs/context_new_<arg>.img; returns NULL on success
+    char path[64];
+    int i = (int)(long)arg;
+    snprintf(path, sizeof(path), "test_imgs/context_new_%d.img", i);
+    return (void *)(long)(fs_format_ex(path, 4096 + i * 1024, (i % 2) ? 1024 : 4096, 32 + i * 32) != 0);
+}
+
+void mount_many_contexts()
+{
+    // Mount in separate contexts - Several images open at once beside the default one
+    printf(YELLOW "Mount in separate contexts - Eight images and the default context at once - Testing" RESET "\n");
+    const char *default_path = "test_imgs/context_default.img";
+    char path[64], name[MAX_FILENAME + 1], read_buf[64];
+    fs_ctx *contexts[8];
+
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(path, sizeof(path), "test_imgs/context_%d.img", i);
+        fs_format_ex(path, 2560 + i * 64, (i % 2) ? 512 : 4096, 64);
+    }
+    fs_format(default_path);
+    fs_mount(default_path);
+    fs_create("shared_name");
+    fs_write("shared_name", "default", 7);
+
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(path, sizeof(path), "test_imgs/context_%d.img", i);
+        contexts[i] = fs_mount_ctx(path);
+        snprintf(name, sizeof(name), "tenant %d", i);
+        if (contexts[i] == NULL || fs_create_ctx(contexts[i], "shared_name") != 0 ||
+            fs_write_ctx(contexts[i], "shared_name", name, strlen(name)) != 0 || fs_create_ctx(contexts[i], name) != 0)
+        {
+            printf(RED "Mount in separate contexts - Context %d mount/write failed" RESET "\n", i);
+            exit(-1);
+        }
+    }
+
+    // Each image sees only its own files; the default context is untouched
+    char names[8][MAX_FILENAME];
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "tenant %d", i);
+        int length = fs_read_ctx(contexts[i], "shared_name", read_buf, sizeof(read_buf));
+        if (length != (int)strlen(name) || memcmp(read_buf, name, length) != 0 || fs_list_ctx(contexts[i], names, 8) != 2)
+        {
+            printf(RED "Mount in separate contexts - Context %d sees another image" RESET "\n", i);
+            exit(-1);
+        }
+    }
+    if (fs_read("shared_name", read_buf, sizeof(read_buf)) != 7 || memcmp(read_buf, "default", 7) != 0 ||
+        fs_list(names, 8) != 1 || fs_create_ctx(NULL, "x") != -3 || fs_mount_ctx("test_imgs/missing.img") != NULL)
+    {
+        printf(RED "Mount in separate contexts - Default context disturbed" RESET "\n");
+        exit(-1);
+    }
+
+    // New tenant images are formatted at the same time while others stay mounted, but a mounted one is refused
+    pthread_t formatters[4];
+    for (int i = 0; i < 4; i++)
+    {
+        pthread_create(&formatters[i], NULL, format_tenant_image, (void *)(long)i);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        void *result;
+        pthread_join(formatters[i], &result);
+        snprintf(path, sizeof(path), "test_imgs/context_new_%d.img", i);
+        fs_ctx *fresh = fs_mount_ctx(path);
+        if (result != NULL || fresh == NULL || fs_list_ctx(fresh, names, 8) != 0 ||
+            fs_create_ctx(fresh, "shared_name") != 0)
+        {
+            printf(RED "Mount in separate contexts - Image %d not formatted beside the mounted ones" RESET "\n", i);
+            exit(-1);
+        }
+        fs_unmount_ctx(fresh);
+    }
+    if (fs_format("test_imgs/context_1.img") != -1 || fs_format(default_path) != -1 ||
+        fs_read("shared_name", read_buf, sizeof(read_buf)) != 7 || fs_list_ctx(contexts[1], names, 8) != 2)
+    {
+        printf(RED "Mount in separate contexts - Formatted an image while mounted" RESET "\n");
+        exit(-1);
+    }
+
+    // Unmounting a context writes it back and leaves the others mounted
+    for (int i = 0; i < 8; i += 2)
+    {
+        fs_unmount_ctx(contexts[i]);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(path, sizeof(path), "test_imgs/context_%d.img", i);
+        snprintf(name, sizeof(name), "tenant %d", i);
+        if (i % 2 == 0)
+        {
+            contexts[i] = fs_mount_ctx(path);
+        }
+        int length = fs_read_ctx(contexts[i], "shared_name", read_buf, sizeof(read_buf));
+        if (length != (int)strlen(name) || memcmp(read_buf, name, length) != 0)
+        {
+            printf(RED "Mount in separate contexts - Context %d lost its data" RESET "\n", i);
+            exit(-1);
+        }
+        fs_unmount_ctx(contexts[i]);
+    }
+    fs_unmount();
+    printf(GREEN "Mount in separate contexts - Success" RESET "\n");
+}
+
 void fs_mount_tests()
 {
     mount_non_existent_file();     // Test mounting a non-existent file
@@ -189,6 +509,9 @@ void fs_mount_tests()
     mount_empty_file();            // Test mounting an empty file
     mount_file_with_larger_size(); // Test mounting a file with wrong size
     mount_with_invalid_metadata(); // Test mounting with invalid metadata
+    mount_mmap_zero_copy();        // Test mmap mount and zero-copy reads
+    mount_custom_geometry();       // Test images formatted with fs_format_ex
+    mount_many_contexts();         // Test several images mounted in separate contexts
 }
 
 /**
@@ -609,8 +932,9 @@ void write_after_failed_write()
         exit(-1);
     }
 
-    // Simulate a failed write due to insufficient space
-    if (fs_write(filename, data, BLOCK_SIZE * 13) == 0)
+    // Simulate a failed write due to insufficient space (more than the whole disk,
+    // rejected before any data is read)
+    if (fs_write(filename, data, BLOCK_SIZE * MAX_BLOCKS) == 0)
     {
         printf(RED "Write with insufficient space unexpectedly succeeded\n" RESET);
         exit(-1);
@@ -1008,6 +1332,106 @@ void test_unmount_followed_by_remount()
     printf(GREEN "Success\n" RESET);
 }
 
+// Runs ops in a child process that exits without unmounting, like a crash would
+void run_then_crash(const char *path, void (*ops)())
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (fs_mount(path) != 0)
+        {
+            _exit(1);
+        }
+        ops();
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf(RED "Crashing child failed before the crash point\n" RESET);
+        exit(-1);
+    }
+}
+
+void journal_ops_committed()
+{
+    char filename[32];
+    char data[64];
+
+    // Enough operations to wrap the journal and force checkpoints along the way
+    for (int i = 0; i < 600; i++)
+    {
+        snprintf(filename, sizeof(filename), "j_%d", i % 40);
+        snprintf(data, sizeof(data), "journal entry %d", i);
+        if (i < 40)
+        {
+            fs_create(filename);
+        }
+        fs_write(filename, data, strlen(data) + 1);
+    }
+    fs_delete("j_0");
+}
+
+void journal_ops_grouped()
+{
+    // Three operations inside a group of four are never committed
+    fs_set_commit_interval(4);
+    fs_create("uncommitted_a");
+    fs_create("uncommitted_b");
+    fs_write("uncommitted_a", "lost", 5);
+}
+
+// Unmount with unsynced changes – the journal must bring the metadata back after a crash
+void test_journal_replay_after_crash()
+{
+    printf(YELLOW "Test: Journal replay after crash\n" RESET);
+    const char *path = "test_imgs/journal_crash.img";
+    char filename[32];
+    char expected[64];
+
+    fs_format(path);
+    run_then_crash(path, journal_ops_committed);
+
+    if (fs_mount(path) != 0)
+    {
+        printf(RED "Failed to mount after crash\n" RESET);
+        exit(-1);
+    }
+
+    for (int i = 1; i < 40; i++)
+    {
+        // The last write to j_i was iteration 560 + i
+        snprintf(filename, sizeof(filename), "j_%d", i);
+        snprintf(expected, sizeof(expected), "journal entry %d", 560 + i);
+        check_file_contents(filename, expected);
+    }
+    if (fs_create("j_0") != 0)
+    {
+        printf(RED "Committed delete of j_0 was lost\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+
+    run_then_crash(path, journal_ops_grouped);
+
+    if (fs_mount(path) != 0)
+    {
+        printf(RED "Failed to mount after crash inside a commit group\n" RESET);
+        exit(-1);
+    }
+    if (fs_create("uncommitted_a") != 0 || fs_create("uncommitted_b") != 0)
+    {
+        printf(RED "Uncommitted operations became visible after crash\n" RESET);
+        exit(-1);
+    }
+    check_file_contents("j_1", "journal entry 561");
+    fs_unmount();
+
+    printf(GREEN "Success\n" RESET);
+}
+
 void fs_unmount_tests()
 {
     test_unmount_without_mount();             // Test unmount without mount
@@ -1020,6 +1444,7 @@ void fs_unmount_tests()
     test_unmount_full_inode_table();          // Test unmount with full inode table
     test_unmount_during_open_file();          // Test unmount during open file handle (simulated)
     test_unmount_followed_by_remount();       // Test unmount followed by remount
+    test_journal_replay_after_crash();        // Test journal replay after a crash
     printf(GREEN "fs_unmount tests completed successfully." RESET "\n");
 }
 
@@ -1246,6 +1671,1776 @@ void test_maximum_stress()
     fs_unmount();
     printf(GREEN "Maximum stress - Success (created %d, deleted %d, refilled %d)\n" RESET, created, created / 2, refill);
 }
+void test_name_lookup_after_churn()
+{
+    printf(YELLOW "Test: Name lookup after create/delete churn\n" RESET);
+
+    const char *path = "test_imgs/name_churn.img";
+    fs_format(path);
+    fs_mount(path);
+
+    char filename[64];
+    char buffer[16];
+
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        snprintf(filename, sizeof(filename), "churn_%d", i);
+        if (fs_create(filename) != 0)
+        {
+            printf(RED "Failed to create %s\n" RESET, filename);
+            exit(-1);
+        }
+    }
+
+    // Delete every other file so the surviving names sit behind holes in their probe chains
+    for (int i = 0; i < MAX_FILES; i += 2)
+    {
+        snprintf(filename, sizeof(filename), "churn_%d", i);
+        if (fs_delete(filename) != 0)
+        {
+            printf(RED "Failed to delete %s\n" RESET, filename);
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        snprintf(filename, sizeof(filename), "churn_%d", i);
+        int expected = (i % 2 == 0) ? -1 : 0;
+        if (fs_read(filename, buffer, sizeof(buffer)) != expected)
+        {
+            printf(RED "Lookup of %s returned the wrong result\n" RESET, filename);
+            exit(-1);
+        }
+    }
+
+    // The index must survive a remount, where it is rebuilt from the inode table
+    fs_unmount();
+    fs_mount(path);
+
+    for (int i = 1; i < MAX_FILES; i += 2)
+    {
+        snprintf(filename, sizeof(filename), "churn_%d", i);
+        if (fs_create(filename) != -1)
+        {
+            printf(RED "Duplicate %s was not detected after remount\n" RESET, filename);
+            exit(-1);
+        }
+    }
+
+    fs_unmount();
+    printf(GREEN "Name lookup after create/delete churn - Success\n" RESET);
+}
+
+void test_metadata_writeback_is_partial()
+{
+    printf(YELLOW "Test: Metadata writeback only rewrites changed ranges\n" RESET);
+
+    const char *path = "test_imgs/partial_sync.img";
+    fs_format(path);
+    fs_mount(path);
+
+    const char *data = "twenty bytes of data";
+    if (fs_create("small.txt") != 0 || fs_write("small.txt", data, strlen(data) + 1) != 0)
+    {
+        printf(RED "Failed to create/write small.txt\n" RESET);
+        exit(-1);
+    }
+
+    fs_stats stats;
+    fs_get_stats(&stats);
+    if (stats.metadata_syncs != 2)
+    {
+        printf(RED "Expected 2 metadata syncs, got %lld\n" RESET, stats.metadata_syncs);
+        exit(-1);
+    }
+
+    // A full rewrite would cost the superblock plus the whole bitmap and inode table per sync
+    long long full_sync = sizeof(superblock) + BLOCK_SIZE + (long long)sizeof(inode) * MAX_FILES;
+    if (stats.metadata_bytes_written >= full_sync)
+    {
+        printf(RED "Two syncs wrote %lld bytes, a single full rewrite is %lld\n" RESET, stats.metadata_bytes_written, full_sync);
+        exit(-1);
+    }
+
+    // Deleting must persist too, even though only a few bytes are written
+    if (fs_create("gone.txt") != 0 || fs_delete("gone.txt") != 0)
+    {
+        printf(RED "Failed to create/delete gone.txt\n" RESET);
+        exit(-1);
+    }
+
+    fs_unmount();
+    fs_mount(path);
+
+    check_file_contents("small.txt", data);
+    if (fs_create("gone.txt") != 0)
+    {
+        printf(RED "Deleted file still present after remount\n" RESET);
+        exit(-1);
+    }
+
+    fs_unmount();
+    printf(GREEN "Metadata writeback only rewrites changed ranges - Success\n" RESET);
+}
+
+void test_contiguous_file_single_request()
+{
+    printf(YELLOW "Test: Contiguous 48KB file moves in one request\n" RESET);
+
+    const char *path = "test_imgs/vectored.img";
+    fs_format(path);
+    fs_mount(path);
+
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *data = malloc(size);
+    char *read_buf = malloc(size);
+    for (int i = 0; i < size; i++)
+        data[i] = (char)(i * 7);
+
+    fs_stats before, after;
+    fs_create("vector.bin");
+    fs_get_stats(&before);
+    if (fs_write("vector.bin", data, size) != 0)
+    {
+        printf(RED "Write failed\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+
+    // A fresh image hands out consecutive blocks, so the whole file is one run
+    if (after.data_io_calls - before.data_io_calls != 1)
+    {
+        printf(RED "Write used %lld requests, expected 1\n" RESET, after.data_io_calls - before.data_io_calls);
+        exit(-1);
+    }
+
+    before = after;
+    if (fs_read("vector.bin", read_buf, size) != size || memcmp(read_buf, data, size) != 0)
+    {
+        printf(RED "Read back mismatch\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (after.data_io_calls - before.data_io_calls != 1)
+    {
+        printf(RED "Read used %lld requests, expected 1\n" RESET, after.data_io_calls - before.data_io_calls);
+        exit(-1);
+    }
+
+    free(data);
+    free(read_buf);
+    fs_unmount();
+    printf(GREEN "Contiguous 48KB file moves in one request - Success\n" RESET);
+}
+
+void test_block_cache_hits_and_invalidation()
+{
+    printf(YELLOW "Test: Block cache serves repeat reads and drops stale blocks\n" RESET);
+
+    const char *path = "test_imgs/cache.img";
+    fs_format(path);
+    fs_mount(path);
+
+    char first[2 * BLOCK_SIZE + 100];
+    char second[2 * BLOCK_SIZE + 100];
+    char read_buf[sizeof(first)];
+    memset(first, 'x', sizeof(first));
+    memset(second, 'y', sizeof(second));
+
+    fs_stats before, after;
+    fs_create("cached.bin");
+    fs_write("cached.bin", first, sizeof(first));
+    fs_read("cached.bin", read_buf, sizeof(read_buf)); // Fills the cache
+
+    fs_get_stats(&before);
+    if (fs_read("cached.bin", read_buf, sizeof(read_buf)) != sizeof(read_buf) ||
+        memcmp(read_buf, first, sizeof(first)) != 0)
+    {
+        printf(RED "Cached read returned wrong data\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (after.cache_hits - before.cache_hits != 3 || after.data_io_calls != before.data_io_calls)
+    {
+        printf(RED "Repeat read was not served from the cache\n" RESET);
+        exit(-1);
+    }
+
+    // A rewrite must not be answered with the old contents
+    fs_write("cached.bin", second, sizeof(second));
+    if (fs_read("cached.bin", read_buf, sizeof(read_buf)) != sizeof(read_buf) ||
+        memcmp(read_buf, second, sizeof(second)) != 0)
+    {
+        printf(RED "Read after rewrite returned stale data\n" RESET);
+        exit(-1);
+    }
+
+    // Nor may a deleted file's blocks leak into a new file that reuses them
+    fs_delete("cached.bin");
+    fs_create("reused.bin");
+    fs_write("reused.bin", first, BLOCK_SIZE);
+    fs_create("other.bin");
+    fs_write("other.bin", first, sizeof(first));
+    if (fs_read("other.bin", read_buf, sizeof(read_buf)) != sizeof(read_buf) ||
+        memcmp(read_buf, first, sizeof(first)) != 0)
+    {
+        printf(RED "Read after delete returned stale data\n" RESET);
+        exit(-1);
+    }
+
+    // With a one-block cache, reads still work while blocks are evicted
+    fs_set_cache_size(1);
+    for (int i = 0; i < 3; i++)
+    {
+        if (fs_read("other.bin", read_buf, sizeof(read_buf)) != sizeof(read_buf) ||
+            memcmp(read_buf, first, sizeof(first)) != 0)
+        {
+            printf(RED "Read with a tiny cache returned wrong data\n" RESET);
+            exit(-1);
+        }
+    }
+    fs_set_cache_size(256);
+
+    fs_unmount();
+    printf(GREEN "Block cache serves repeat reads and drops stale blocks - Success\n" RESET);
+}
+
+void test_large_file_indirect_blocks()
+{
+    printf(YELLOW "Test: Files beyond 48KB through indirect and double indirect blocks\n" RESET);
+
+    const char *path = "test_imgs/indirect.img";
+    fs_format(path);
+    fs_mount(path);
+    fs_set_extent_mapping(0); // Extents would map this contiguous file without pointer blocks
+
+    // 1280 blocks: 12 direct, 1024 through the indirect block, the rest double indirect
+    int size = 1280 * BLOCK_SIZE;
+    char *data = malloc(size);
+    char *read_buf = malloc(size);
+    for (int i = 0; i < size; i++)
+        data[i] = (char)((i / BLOCK_SIZE) * 31 + i);
+
+    fs_create("big.bin");
+    if (fs_write("big.bin", data, size) != 0)
+    {
+        printf(RED "5MB write failed\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    fs_mount(path);
+
+    // A sequential read loads each pointer block once
+    fs_stats stats;
+    if (fs_read("big.bin", read_buf, size) != size || memcmp(read_buf, data, size) != 0)
+    {
+        printf(RED "5MB read back mismatch\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&stats);
+    if (stats.pointer_block_reads != 3)
+    {
+        printf(RED "Sequential read loaded %lld pointer blocks, expected 3\n" RESET, stats.pointer_block_reads);
+        exit(-1);
+    }
+
+    // In-place update across the indirect / double indirect boundary, and an append
+    int boundary = (MAX_DIRECT_BLOCKS + BLOCK_SIZE / (int)sizeof(int)) * BLOCK_SIZE;
+    memset(data + boundary - 10, 'b', 20);
+    fs_pwrite("big.bin", boundary - 10, data + boundary - 10, 20);
+    data = realloc(data, size + 100);
+    read_buf = realloc(read_buf, size + 100);
+    memset(data + size, 'e', 100);
+    fs_append("big.bin", data + size, 100);
+    if (fs_pread("big.bin", read_buf, boundary - 50, 100) != 100 || memcmp(read_buf, data + boundary - 50, 100) != 0 ||
+        fs_read("big.bin", read_buf, size + 100) != size + 100 || memcmp(read_buf, data, size + 100) != 0)
+    {
+        printf(RED "Read back mismatch after pwrite/append\n" RESET);
+        exit(-1);
+    }
+
+    // A write larger than the free space fails and leaves the file intact
+    char *huge = calloc(MAX_BLOCKS, BLOCK_SIZE);
+    if (fs_write("big.bin", huge, MAX_BLOCKS * BLOCK_SIZE) != -2 ||
+        fs_read("big.bin", read_buf, size + 100) != size + 100 || memcmp(read_buf, data, size + 100) != 0)
+    {
+        printf(RED "Oversized write was not rolled back\n" RESET);
+        exit(-1);
+    }
+
+    // Deleting releases every data and pointer block: a file of most of the disk fits again
+    fs_delete("big.bin");
+    fs_create("huge.bin");
+    int huge_size = 2500 * BLOCK_SIZE;
+    if (fs_write("huge.bin", huge, huge_size) != 0 || fs_read("huge.bin", read_buf, 100) != 100)
+    {
+        printf(RED "Blocks of the deleted large file were not freed\n" RESET);
+        exit(-1);
+    }
+
+    free(huge);
+    free(data);
+    free(read_buf);
+    fs_set_extent_mapping(1);
+    fs_unmount();
+    printf(GREEN "Files beyond 48KB through indirect and double indirect blocks - Success\n" RESET);
+}
+
+// Fills every free block with filler files (largest first) and returns how many were created
+int fill_image(const char *data)
+{
+    char name[MAX_FILENAME];
+    int files = 0;
+
+    for (int blocks = 1024; blocks >= 1; blocks /= 2)
+    {
+        while (1)
+        {
+            snprintf(name, sizeof(name), "filler_%03d", files);
+            if (fs_create(name) != 0)
+            {
+                return files;
+            }
+            if (fs_write(name, data, blocks * BLOCK_SIZE) != 0)
+            {
+                fs_delete(name);
+                break;
+            }
+            files++;
+        }
+    }
+    return files;
+}
+
+void test_extent_mapped_files()
+{
+    printf(YELLOW "Test: Extent-mapped files and conversion to block pointers\n" RESET);
+
+    const char *path = "test_imgs/extents.img";
+    fs_format(path);
+    fs_mount(path);
+
+    // A contiguous 4.3MB file is a single extent: no pointer blocks, few large requests
+    int size = 1100 * BLOCK_SIZE;
+    char *data = malloc(size);
+    char *read_buf = malloc(size);
+    for (int i = 0; i < size; i++)
+        data[i] = (char)((i / BLOCK_SIZE) * 7 + i);
+
+    fs_create("extent.bin");
+    fs_write("extent.bin", data, size / 2);
+    fs_append("extent.bin", data + size / 2, size - size / 2); // Continues the same run
+    fs_unmount();
+    fs_mount(path);
+    fs_set_cache_size(0);
+
+    fs_stats stats;
+    if (fs_read("extent.bin", read_buf, size) != size || memcmp(read_buf, data, size) != 0)
+    {
+        printf(RED "Extent file read back mismatch\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&stats);
+    if (stats.pointer_block_reads != 0 || stats.data_io_calls > 5)
+    {
+        printf(RED "Extent file read used %lld pointer blocks and %lld requests\n" RESET, stats.pointer_block_reads,
+               stats.data_io_calls);
+        exit(-1);
+    }
+    fs_set_cache_size(256);
+    fs_delete("extent.bin");
+
+    // Leave only one-block holes between kept files so a new file needs more than 6 extents
+    char name[MAX_FILENAME];
+    for (int i = 0; i < 20; i++)
+    {
+        snprintf(name, sizeof(name), "piece_%02d", i);
+        fs_create(name);
+        fs_write(name, data, BLOCK_SIZE);
+    }
+    fill_image(data);
+    for (int i = 0; i < 20; i += 2)
+    {
+        snprintf(name, sizeof(name), "piece_%02d", i);
+        fs_delete(name);
+    }
+    fs_unmount();
+    fs_mount(path); // Freed blocks are committed
+
+    fs_create("scattered.bin");
+    int scattered = 8 * BLOCK_SIZE;
+    if (fs_write("scattered.bin", data, 4 * BLOCK_SIZE) != 0 ||
+        fs_append("scattered.bin", data + 4 * BLOCK_SIZE, scattered - 4 * BLOCK_SIZE) != 0)
+    {
+        printf(RED "Scattered file write failed\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    fs_mount(path);
+    if (fs_read("scattered.bin", read_buf, size) != scattered || memcmp(read_buf, data, scattered) != 0)
+    {
+        printf(RED "Scattered file read back mismatch\n" RESET);
+        exit(-1);
+    }
+    for (int i = 1; i < 20; i += 2)
+    {
+        snprintf(name, sizeof(name), "piece_%02d", i);
+        if (fs_read(name, read_buf, BLOCK_SIZE) != BLOCK_SIZE || memcmp(read_buf, data, BLOCK_SIZE) != 0)
+        {
+            printf(RED "Neighbouring file damaged\n" RESET);
+            exit(-1);
+        }
+    }
+
+    free(data);
+    free(read_buf);
+    fs_unmount();
+    printf(GREEN "Extent-mapped files and conversion to block pointers - Success\n" RESET);
+}
+
+// Reads a file with the block cache off and returns how many data requests it took
+long long read_requests(const char *filename, char *buffer, int size)
+{
+    fs_stats before, after;
+    fs_set_cache_size(0);
+    fs_get_stats(&before);
+    if (fs_read(filename, buffer, size) != size)
+    {
+        printf(RED "Short read of %s\n" RESET, filename);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    fs_set_cache_size(256);
+    return after.data_io_calls - before.data_io_calls;
+}
+
+void test_best_fit_allocation()
+{
+    printf(YELLOW "Test: Multi-block writes take the smallest free run that fits\n" RESET);
+
+    const char *path = "test_imgs/best_fit.img";
+    fs_format(path);
+    fs_mount(path);
+
+    char *data = calloc(1024, BLOCK_SIZE);
+    char *read_buf = malloc(8 * BLOCK_SIZE);
+
+    // Holes of 3, 8 and 5 blocks on an otherwise full image
+    const char *names[] = {"keep_a", "hole_3", "keep_b", "hole_8", "keep_c", "hole_5"};
+    const int blocks[] = {1, 3, 1, 8, 1, 5};
+    for (int i = 0; i < 6; i++)
+    {
+        fs_create(names[i]);
+        fs_write(names[i], data, blocks[i] * BLOCK_SIZE);
+    }
+    fill_image(data);
+    fs_delete("hole_3");
+    fs_delete("hole_8");
+    fs_delete("hole_5");
+    fs_unmount();
+    fs_mount(path); // Commits the frees
+
+    // Next-fit would split the 5-block file over the 3- and 8-block holes
+    const char *files[] = {"five", "eight", "three"};
+    const int sizes[] = {5, 8, 3};
+    for (int i = 0; i < 3; i++)
+    {
+        fs_create(files[i]);
+        if (fs_write(files[i], data, sizes[i] * BLOCK_SIZE) != 0)
+        {
+            printf(RED "Write of %s failed\n" RESET, files[i]);
+            exit(-1);
+        }
+        if (read_requests(files[i], read_buf, sizes[i] * BLOCK_SIZE) != 1)
+        {
+            printf(RED "%s is not contiguous\n" RESET, files[i]);
+            exit(-1);
+        }
+    }
+
+    free(data);
+    free(read_buf);
+    fs_unmount();
+    printf(GREEN "Multi-block writes take the smallest free run that fits - Success\n" RESET);
+}
+
+#define BITMAP_TEST_FILE (3 * 1024 * 1024) // 6144 blocks of 512 bytes, more than one bitmap block tracks
+char bitmap_test_data[BITMAP_TEST_FILE];
+
+void bitmap_ops_far_apart()
+{
+    // Allocates past the first bitmap block and frees in the second, then crashes
+    fs_create("far");
+    fs_write("far", bitmap_test_data, BITMAP_TEST_FILE);
+    fs_delete("near");
+}
+
+void test_multi_block_bitmap()
+{
+    printf(YELLOW "Test: Bitmap spanning many blocks and 64-bit offsets\n" RESET);
+    const char *path = "test_imgs/bitmap_span.img";
+    char *read_buf = malloc(BITMAP_TEST_FILE);
+    for (int i = 0; i < BITMAP_TEST_FILE; i++)
+        bitmap_test_data[i] = (char)(i % 239);
+
+    // 100000 blocks of 512 bytes need a 25-block bitmap
+    if (fs_format_ex(path, 100000, 512, 128) != 0 || fs_mount(path) != 0)
+    {
+        printf(RED "Bitmap spanning many blocks - Format/mount failed\n" RESET);
+        exit(-1);
+    }
+    if (fs_create("near") != 0 || fs_write("near", bitmap_test_data, BITMAP_TEST_FILE) != 0 || fs_create("keep") != 0 ||
+        fs_write("keep", bitmap_test_data, BITMAP_TEST_FILE) != 0)
+    {
+        printf(RED "Bitmap spanning many blocks - Writes failed\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+
+    // The journal must bring back changes in several bitmap blocks at once
+    run_then_crash(path, bitmap_ops_far_apart);
+    if (fs_mount(path) != 0 || fs_read("near", read_buf, 10) != -1 ||
+        fs_read("far", read_buf, BITMAP_TEST_FILE) != BITMAP_TEST_FILE ||
+        memcmp(read_buf, bitmap_test_data, BITMAP_TEST_FILE) != 0 ||
+        fs_read("keep", read_buf, BITMAP_TEST_FILE) != BITMAP_TEST_FILE ||
+        memcmp(read_buf, bitmap_test_data, BITMAP_TEST_FILE) != 0)
+    {
+        printf(RED "Bitmap spanning many blocks - Metadata lost after crash\n" RESET);
+        exit(-1);
+    }
+
+    // Freed blocks in every bitmap block are reusable: 16 such files fill 98% of the image
+    char name[32];
+    int written = 0;
+    fs_delete("far");
+    fs_delete("keep");
+    for (int i = 0; i < 16; i++)
+    {
+        snprintf(name, sizeof(name), "fill_%d", i);
+        if (fs_create(name) == 0 && fs_write(name, bitmap_test_data, BITMAP_TEST_FILE) == 0)
+        {
+            written++;
+        }
+    }
+    if (written != 16)
+    {
+        printf(RED "Bitmap spanning many blocks - Only %d of 16 files fit\n" RESET, written);
+        exit(-1);
+    }
+
+    // Offsets are 64-bit: far past 4GB reads nothing, and only the file size limit rejects writes
+    if (fs_pread("fill_0", read_buf, 5LL << 32, 10) != 0 || fs_pwrite("fill_0", 5LL << 32, "x", 1) != -2 ||
+        fs_pwrite("fill_0", LLONG_MAX - 1, "x", 1) != -3)
+    {
+        printf(RED "Bitmap spanning many blocks - 64-bit offsets mishandled\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+
+    free(read_buf);
+    printf(GREEN "Bitmap spanning many blocks and 64-bit offsets - Success\n" RESET);
+}
+
+#define SUMMARY_TEST_BLOCKS 12000 // Spans several 4096-block summary groups
+#define SUMMARY_TEST_REQUESTS ((SUMMARY_TEST_BLOCKS + 255) / 256) // Contiguous reads move up to 256 blocks per request
+#define SUMMARY_REUSE_BLOCKS 8192 // Leaves room in the freed run for the pointer blocks
+
+void test_free_space_summary()
+{
+    printf(YELLOW "Test: Free-space summary finds space behind full regions\n" RESET);
+    const char *path = "test_imgs/free_summary.img";
+    char *data = calloc(SUMMARY_TEST_BLOCKS, 512);
+    char *read_buf = malloc(SUMMARY_TEST_BLOCKS * 512);
+    for (int i = 0; i < SUMMARY_TEST_BLOCKS * 512; i++)
+        data[i] = (char)(i % 233);
+
+    // 20000 blocks of 512 bytes: five 4096-block groups, the last one partial
+    if (fs_format_ex(path, 20000, 512, 64) != 0 || fs_mount(path) != 0)
+    {
+        printf(RED "Free-space summary - Format/mount failed\n" RESET);
+        exit(-1);
+    }
+    fs_create("span");
+    if (fs_write("span", data, SUMMARY_TEST_BLOCKS * 512) != 0 ||
+        read_requests("span", read_buf, SUMMARY_TEST_BLOCKS * 512) != SUMMARY_TEST_REQUESTS)
+    {
+        printf(RED "Free-space summary - Run across free groups not found\n" RESET);
+        exit(-1);
+    }
+
+    // Fill the rest, ending with single blocks
+    char name[32];
+    int files = 0;
+    for (int blocks = 4096; blocks >= 1; blocks /= 2)
+    {
+        while (files < 60)
+        {
+            snprintf(name, sizeof(name), "fill_%d", files);
+            fs_create(name);
+            if (fs_write(name, data, blocks * 512) != 0)
+            {
+                fs_delete(name);
+                break;
+            }
+            files++;
+        }
+    }
+    fs_create("extra");
+    if (fs_write("extra", data, 512) != -2)
+    {
+        printf(RED "Free-space summary - Full image accepted a write\n" RESET);
+        exit(-1);
+    }
+
+    // A freed block deep in the full image; the write that needs it commits the free
+    snprintf(name, sizeof(name), "fill_%d", files - 1);
+    fs_delete(name);
+    if (fs_write("extra", data, 512) != 0)
+    {
+        printf(RED "Free-space summary - Single free block not found\n" RESET);
+        exit(-1);
+    }
+
+    // The run left by a large file is reused whole
+    fs_delete("span");
+    fs_create("again");
+    if (fs_write("again", data, SUMMARY_REUSE_BLOCKS * 512) != 0 ||
+        read_requests("again", read_buf, SUMMARY_REUSE_BLOCKS * 512) != SUMMARY_REUSE_BLOCKS / 256 ||
+        memcmp(read_buf, data, SUMMARY_REUSE_BLOCKS * 512) != 0)
+    {
+        printf(RED "Free-space summary - Committed frees not reused\n" RESET);
+        exit(-1);
+    }
+
+    // The summary rebuilt at mount agrees
+    fs_unmount();
+    fs_mount(path);
+    fs_create("more");
+    if (fs_write("more", data, SUMMARY_TEST_BLOCKS * 512) != -2 || fs_write("more", data, 512) != 0 ||
+        fs_read("again", read_buf, SUMMARY_REUSE_BLOCKS * 512) != SUMMARY_REUSE_BLOCKS * 512 ||
+        memcmp(read_buf, data, SUMMARY_REUSE_BLOCKS * 512) != 0)
+    {
+        printf(RED "Free-space summary - Wrong after remount\n" RESET);
+        exit(-1);
+    }
+
+    free(data);
+    free(read_buf);
+    fs_unmount();
+    printf(GREEN "Free-space summary finds space behind full regions - Success\n" RESET);
+}
+
+#define THREAD_TEST_FILES 4
+#define THREAD_TEST_SIZE (20 * 1024) // Five blocks per version of a file
+#define THREAD_TEST_ROUNDS 300
+
+int thread_test_failed = 0;
+
+void *thread_test_writer(void *arg)
+{
+    // Rewrites one file with whole versions: every byte of version v is v
+    int file = (int)(long)arg;
+    char name[32], data[THREAD_TEST_SIZE];
+    snprintf(name, sizeof(name), "threaded_%d", file);
+    for (int round = 1; round <= THREAD_TEST_ROUNDS; round++)
+    {
+        memset(data, round % 128, sizeof(data));
+        if (fs_write(name, data, (round % 2) ? THREAD_TEST_SIZE : THREAD_TEST_SIZE / 2) != 0)
+        {
+            thread_test_failed = 1;
+        }
+    }
+    return NULL;
+}
+
+void *thread_test_reader(void *arg)
+{
+    // Reads every file; a read must see one whole version, never a mix
+    char name[32], data[THREAD_TEST_SIZE];
+    for (int round = 0; round < THREAD_TEST_ROUNDS; round++)
+    {
+        int file = ((int)(long)arg + round) % THREAD_TEST_FILES;
+        snprintf(name, sizeof(name), "threaded_%d", file);
+        int length = (round % 3) ? fs_read(name, data, sizeof(data)) : fs_pread(name, data, 4096, sizeof(data));
+        if (length < 0)
+        {
+            thread_test_failed = 1;
+        }
+        for (int i = 1; i < length; i++)
+        {
+            if (data[i] != data[0])
+            {
+                thread_test_failed = 1;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_parallel_reads_and_writes()
+{
+    printf(YELLOW "Test: Parallel readers and writers see whole file versions\n" RESET);
+    const char *path = "test_imgs/threads.img";
+    fs_format(path);
+    fs_mount(path);
+    fs_set_cache_size(16); // Small, so readers also insert and evict
+    fs_set_commit_interval(8);
+
+    char name[32], data[THREAD_TEST_SIZE];
+    memset(data, 0, sizeof(data));
+    for (int i = 0; i < THREAD_TEST_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "threaded_%d", i);
+        fs_create(name);
+        fs_write(name, data, sizeof(data));
+    }
+
+    // A writer per file, readers over all of them, and names churning beside them
+    pthread_t threads[2 * THREAD_TEST_FILES];
+    for (int i = 0; i < THREAD_TEST_FILES; i++)
+    {
+        pthread_create(&threads[i], NULL, thread_test_writer, (void *)(long)i);
+        pthread_create(&threads[THREAD_TEST_FILES + i], NULL, thread_test_reader, (void *)(long)i);
+    }
+    for (int round = 0; round < THREAD_TEST_ROUNDS; round++)
+    {
+        snprintf(name, sizeof(name), "churn_%d", round % 8);
+        if (fs_create(name) != 0 || fs_append(name, data, 100) != 0 || fs_delete(name) != 0)
+        {
+            thread_test_failed = 1;
+        }
+    }
+    for (int i = 0; i < 2 * THREAD_TEST_FILES; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (thread_test_failed)
+    {
+        printf(RED "Parallel readers and writers - Torn read or failed call\n" RESET);
+        exit(-1);
+    }
+
+    // Every file ends at its last version, also after a remount
+    fs_unmount();
+    fs_mount(path);
+    for (int i = 0; i < THREAD_TEST_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "threaded_%d", i);
+        int expected = (THREAD_TEST_ROUNDS % 2) ? THREAD_TEST_SIZE : THREAD_TEST_SIZE / 2;
+        if (fs_read(name, data, sizeof(data)) != expected || data[0] != THREAD_TEST_ROUNDS % 128 ||
+            data[expected - 1] != THREAD_TEST_ROUNDS % 128)
+        {
+            printf(RED "Parallel readers and writers - %s lost its last version\n" RESET, name);
+            exit(-1);
+        }
+    }
+    fs_unmount();
+    printf(GREEN "Parallel readers and writers see whole file versions - Success\n" RESET);
+}
+
+#define RACE_TEST_OLD (16 * 4096)        // Past the direct blocks, so lookups go through the pointer-block cache
+#define RACE_TEST_NEW (20 * 4096 + 100)
+#define RACE_TEST_ROUNDS 200
+#define RACE_TEST_READERS 3
+#define RACE_TEST_RESIZES 64
+#define RACE_TEST_RESIZE_BLOCKS 256 // 1 MB of slots per resize
+
+int race_test_done = 0;
+int race_test_failed = 0;
+
+void *race_test_reader(void *arg)
+{
+    // Each result must be the old contents, the new ones, or a file missing or empty between a delete and the rewrite
+    static __thread char data[RACE_TEST_NEW];
+    int reader = (int)(long)arg;
+    for (int round = 0; !__atomic_load_n(&race_test_done, __ATOMIC_ACQUIRE); round++)
+    {
+        int length = ((round + reader) % 2) ? fs_read("raced", data, sizeof(data)) : fs_pread("raced", data, 0, sizeof(data));
+        char expected = (length == RACE_TEST_OLD) ? 'o' : 'n';
+        if (length != -1 && length != 0 && length != RACE_TEST_OLD && length != RACE_TEST_NEW)
+        {
+            race_test_failed = 1;
+            continue;
+        }
+        for (int i = 0; i < length; i++)
+        {
+            if (data[i] != expected)
+            {
+                race_test_failed = 1;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_reads_race_writes_and_deletes()
+{
+    printf(YELLOW "Test: Reads racing writes and deletes see old or new contents\n" RESET);
+    const char *path = "test_imgs/race.img";
+    fs_format(path);
+    fs_mount(path);
+    fs_set_extent_mapping(0); // Pointer blocks, so both caches are looked up
+    fs_set_cache_size(8);     // Fewer slots than a file has blocks, so slots are refilled under the readers
+
+    char *old_data = malloc(RACE_TEST_OLD);
+    char *new_data = malloc(RACE_TEST_NEW);
+    memset(old_data, 'o', RACE_TEST_OLD);
+    memset(new_data, 'n', RACE_TEST_NEW);
+    fs_create("raced");
+    fs_write("raced", old_data, RACE_TEST_OLD);
+
+    pthread_t readers[RACE_TEST_READERS];
+    for (int i = 0; i < RACE_TEST_READERS; i++)
+    {
+        pthread_create(&readers[i], NULL, race_test_reader, (void *)(long)i);
+    }
+    for (int round = 0; round < RACE_TEST_ROUNDS; round++)
+    {
+        // Rewrites, deletes and the cache being resized, all under the readers
+        int ok = (fs_write("raced", new_data, RACE_TEST_NEW) == 0 && fs_write("raced", old_data, RACE_TEST_OLD) == 0);
+        if (round % 4 == 0)
+        {
+            ok = ok && fs_delete("raced") == 0 && fs_create("raced") == 0 && fs_write("raced", new_data, RACE_TEST_NEW) == 0;
+        }
+        if (round % 16 == 0)
+        {
+            ok = ok && fs_set_cache_size(8 + round % 32) == 0;
+        }
+        if (!ok)
+        {
+            race_test_failed = 1;
+        }
+    }
+    __atomic_store_n(&race_test_done, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < RACE_TEST_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    // With no reader left, resizing frees the arrays it swaps out instead of keeping them
+    fs_set_cache_size(RACE_TEST_RESIZE_BLOCKS);
+    struct mallinfo2 heap = mallinfo2();
+    size_t before = heap.uordblks + heap.hblkhd;
+    for (int round = 0; round < RACE_TEST_RESIZES; round++)
+    {
+        fs_set_cache_size(RACE_TEST_RESIZE_BLOCKS + round % 2);
+    }
+    heap = mallinfo2();
+    if (heap.uordblks + heap.hblkhd > before + 2 * RACE_TEST_RESIZE_BLOCKS * BLOCK_SIZE)
+    {
+        printf(RED "fs_set_cache_size - %zu bytes kept after %d resizes\n" RESET, heap.uordblks + heap.hblkhd - before,
+               RACE_TEST_RESIZES);
+        exit(-1);
+    }
+
+    fs_set_extent_mapping(1);
+    free(old_data);
+    free(new_data);
+    fs_unmount();
+    if (race_test_failed)
+    {
+        printf(RED "Reads racing writes and deletes - Read a mix of versions or a call failed\n" RESET);
+        exit(-1);
+    }
+    printf(GREEN "Reads racing writes and deletes see old or new contents - Success\n" RESET);
+}
+
+#define RING_TEST_BLOCKS 12
+
+void test_io_uring_batches()
+{
+    printf(YELLOW "Test: io_uring batches fragmented transfers and checkpoints\n" RESET);
+    const char *path = "test_imgs/io_uring.img";
+    char block[BLOCK_SIZE];
+    char *data = malloc(RING_TEST_BLOCKS * BLOCK_SIZE);
+    char *read_buf = malloc(RING_TEST_BLOCKS * BLOCK_SIZE);
+    fs_format(path);
+    fs_mount(path);
+    fs_set_cache_size(0); // Every read goes to the image
+
+    // Alternating appends leave "fragmented" with no two adjacent blocks
+    fs_create("fragmented");
+    fs_create("spacer");
+    for (int i = 0; i < RING_TEST_BLOCKS; i++)
+    {
+        memset(block, 'a' + i, BLOCK_SIZE);
+        fs_append("fragmented", block, BLOCK_SIZE);
+        fs_append("spacer", block, BLOCK_SIZE);
+    }
+    for (int i = 0; i < RING_TEST_BLOCKS * BLOCK_SIZE; i++)
+        data[i] = (char)(i % 251);
+
+    fs_stats before, after;
+    fs_set_io_uring(1);
+    fs_get_stats(&before);
+    if (fs_pwrite("fragmented", 0, data, RING_TEST_BLOCKS * BLOCK_SIZE) != 0 ||
+        fs_read("fragmented", read_buf, RING_TEST_BLOCKS * BLOCK_SIZE) != RING_TEST_BLOCKS * BLOCK_SIZE ||
+        memcmp(read_buf, data, RING_TEST_BLOCKS * BLOCK_SIZE) != 0)
+    {
+        printf(RED "io_uring - Fragmented write or read back failed\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (after.data_io_calls - before.data_io_calls != 2 * RING_TEST_BLOCKS)
+    {
+        printf(RED "io_uring - Expected %d transfers, got %lld\n" RESET, 2 * RING_TEST_BLOCKS,
+               after.data_io_calls - before.data_io_calls);
+        exit(-1);
+    }
+    if (after.ring_submissions - before.ring_submissions == 0)
+    {
+        printf(YELLOW "io_uring unavailable, checked the preadv/pwritev fallback\n" RESET);
+    }
+    else if (after.ring_submissions - before.ring_submissions != 2)
+    {
+        printf(RED "io_uring - Expected one submission per call, got %lld\n" RESET,
+               after.ring_submissions - before.ring_submissions);
+        exit(-1);
+    }
+
+    // Enough operations to fill the journal, so checkpoints write home through the ring
+    for (int i = 0; i < 2000 && after.checkpoints == before.checkpoints; i++)
+    {
+        memset(block, i, BLOCK_SIZE);
+        fs_pwrite("spacer", (long long)(i % RING_TEST_BLOCKS) * BLOCK_SIZE, block, BLOCK_SIZE);
+        fs_delete("churn");
+        fs_create("churn");
+        fs_get_stats(&after);
+    }
+    if (after.checkpoints == before.checkpoints)
+    {
+        printf(RED "io_uring - No checkpoint happened\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+
+    // The syscall path reads back what the ring wrote
+    fs_mount(path);
+    fs_set_cache_size(0);
+    if (fs_read("fragmented", read_buf, RING_TEST_BLOCKS * BLOCK_SIZE) != RING_TEST_BLOCKS * BLOCK_SIZE ||
+        memcmp(read_buf, data, RING_TEST_BLOCKS * BLOCK_SIZE) != 0 || fs_set_io_uring(2) != -1)
+    {
+        printf(RED "io_uring - Data lost after remount\n" RESET);
+        exit(-1);
+    }
+    fs_set_cache_size(256);
+    fs_unmount();
+    free(data);
+    free(read_buf);
+    printf(GREEN "io_uring batches fragmented transfers and checkpoints - Success\n" RESET);
+}
+
+#define ASYNC_TEST_FILES 8
+
+typedef struct
+{
+    int calls;
+    int result;
+} async_test_slot;
+
+void async_test_done(void *cookie, int result)
+{
+    async_test_slot *slot = cookie;
+    slot->calls++;
+    slot->result = result;
+}
+
+#define ASYNC_TEST_CONTEXTS (2 * ASYNC_TEST_FILES)
+
+// Threads of this process, from /proc
+int count_threads()
+{
+    DIR *tasks = opendir("/proc/self/task");
+    int count = 0;
+    for (struct dirent *entry = readdir(tasks); entry != NULL; entry = readdir(tasks))
+    {
+        count += entry->d_name[0] != '.';
+    }
+    closedir(tasks);
+    return count;
+}
+
+// Waits on the completion descriptor like an event loop and collects callbacks until 'expected' have run
+int wait_for_completions(int expected)
+{
+    struct pollfd pfd = {.fd = fs_completion_fd(), .events = POLLIN};
+    int collected = 0;
+    while (collected < expected)
+    {
+        if (poll(&pfd, 1, 5000) != 1)
+        {
+            return collected; // Timed out
+        }
+        collected += fs_poll_completions(2); // A few at a time, so the descriptor must stay readable
+    }
+    return collected;
+}
+
+void test_async_requests()
+{
+    printf(YELLOW "Test: Asynchronous reads and writes complete through the eventfd\n" RESET);
+    const char *path = "test_imgs/async.img";
+    char data[ASYNC_TEST_FILES][3000];
+    char read_buf[ASYNC_TEST_FILES][3000];
+    async_test_slot slots[ASYNC_TEST_FILES];
+    char name[MAX_FILENAME];
+    fs_format(path);
+    fs_mount(path);
+
+    if (fs_read_async("a", read_buf[0], 10, NULL, NULL) != -3 ||
+        fs_write_async(NULL, data[0], 10, async_test_done, &slots[0]) != -3 || fs_poll_completions(-1) != -1 ||
+        fs_poll_completions(8) != 0)
+    {
+        printf(RED "Asynchronous requests - Invalid calls not rejected\n" RESET);
+        exit(-1);
+    }
+
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < ASYNC_TEST_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "async_%d", i);
+        fs_create(name);
+        memset(data[i], 'A' + i, sizeof(data[i]));
+        if (fs_write_async(name, data[i], sizeof(data[i]), async_test_done, &slots[i]) != 0)
+        {
+            printf(RED "Asynchronous requests - Write not queued\n" RESET);
+            exit(-1);
+        }
+    }
+    if (wait_for_completions(ASYNC_TEST_FILES) != ASYNC_TEST_FILES)
+    {
+        printf(RED "Asynchronous requests - Writes did not complete\n" RESET);
+        exit(-1);
+    }
+
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < ASYNC_TEST_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "async_%d", i);
+        fs_read_async(name, read_buf[i], sizeof(read_buf[i]), async_test_done, &slots[i]);
+    }
+    if (wait_for_completions(ASYNC_TEST_FILES) != ASYNC_TEST_FILES)
+    {
+        printf(RED "Asynchronous requests - Reads did not complete\n" RESET);
+        exit(-1);
+    }
+    for (int i = 0; i < ASYNC_TEST_FILES; i++)
+    {
+        if (slots[i].calls != 1 || slots[i].result != (int)sizeof(read_buf[i]) ||
+            memcmp(read_buf[i], data[i], sizeof(data[i])) != 0)
+        {
+            printf(RED "Asynchronous requests - Request %d completed wrongly\n" RESET, i);
+            exit(-1);
+        }
+    }
+
+    // Errors arrive through the callback; fs_unmount finishes and delivers what was never collected
+    memset(slots, 0, sizeof(slots));
+    fs_read_async("missing", read_buf[0], 10, async_test_done, &slots[0]);
+    for (int i = 1; i < ASYNC_TEST_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "async_%d", i);
+        fs_write_async(name, data[0], sizeof(data[0]), async_test_done, &slots[i]);
+    }
+    fs_unmount();
+    for (int i = 0; i < ASYNC_TEST_FILES; i++)
+    {
+        if (slots[i].calls != 1 || slots[i].result != (i == 0 ? -1 : 0))
+        {
+            printf(RED "Asynchronous requests - Request %d not delivered at unmount\n" RESET, i);
+            exit(-1);
+        }
+    }
+
+    fs_mount(path);
+    if (fs_read("async_7", read_buf[0], sizeof(read_buf[0])) != (int)sizeof(read_buf[0]) || read_buf[0][0] != 'A')
+    {
+        printf(RED "Asynchronous requests - Write lost at unmount\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+
+    // Many contexts share the workers already running, and each unmount waits for its own requests only
+    fs_ctx *contexts[ASYNC_TEST_CONTEXTS];
+    int threads = count_threads();
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < ASYNC_TEST_CONTEXTS; i++)
+    {
+        snprintf(name, sizeof(name), "test_imgs/async_%d.img", i);
+        fs_format(name);
+        contexts[i] = fs_mount_ctx(name);
+        fs_create_ctx(contexts[i], "shared");
+        if (fs_write_async_ctx(contexts[i], "shared", data[i % ASYNC_TEST_FILES], sizeof(data[0]), async_test_done,
+                               &slots[i % ASYNC_TEST_FILES]) != 0)
+        {
+            printf(RED "Asynchronous requests - Write on context %d not queued\n" RESET, i);
+            exit(-1);
+        }
+    }
+    if (count_threads() != threads)
+    {
+        printf(RED "Asynchronous requests - Contexts started %d threads of their own\n" RESET, count_threads() - threads);
+        exit(-1);
+    }
+    for (int i = 0; i < ASYNC_TEST_CONTEXTS; i++)
+    {
+        fs_unmount_ctx(contexts[i]);
+    }
+    for (int i = 0; i < ASYNC_TEST_FILES; i++)
+    {
+        if (slots[i].calls != ASYNC_TEST_CONTEXTS / ASYNC_TEST_FILES || slots[i].result != 0)
+        {
+            printf(RED "Asynchronous requests - Shared workers lost a request\n" RESET);
+            exit(-1);
+        }
+    }
+    printf(GREEN "Asynchronous reads and writes complete through the eventfd - Success\n" RESET);
+}
+
+#define BATCH_TEST_FILES 10
+
+// Number of files currently listed
+int count_files()
+{
+    char names[MAX_FILES][MAX_FILENAME];
+    return fs_list(names, MAX_FILES);
+}
+
+void test_batch_operations()
+{
+    printf(YELLOW "Test: fs_batch applies many operations with one sync, or none\n" RESET);
+    const char *path = "test_imgs/batch.img";
+    char names[BATCH_TEST_FILES][MAX_FILENAME];
+    static char data[BATCH_TEST_FILES][3 * BLOCK_SIZE];
+    char read_buf[3 * BLOCK_SIZE];
+    fs_op ops[2 * BATCH_TEST_FILES + 4];
+    fs_format(path);
+    fs_mount(path);
+    fs_create("old");
+    fs_write("old", "previous", 8);
+
+    // Ten creates and writes plus a delete: one journal commit, and the fresh
+    // blocks of all ten files are consecutive, so one data request
+    int n = 0;
+    for (int i = 0; i < BATCH_TEST_FILES; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "batch_%d", i);
+        memset(data[i], 'a' + i, sizeof(data[i]));
+        ops[n++] = (fs_op){.type = FS_OP_CREATE, .filename = names[i]};
+        ops[n++] = (fs_op){.type = FS_OP_WRITE, .filename = names[i], .data = data[i], .size = sizeof(data[i])};
+    }
+    ops[n++] = (fs_op){.type = FS_OP_DELETE, .filename = "old"};
+
+    fs_stats before, after;
+    fs_get_stats(&before);
+    if (fs_batch(ops, n) != 0)
+    {
+        printf(RED "fs_batch - Valid batch failed\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (after.journal_commits - before.journal_commits != 1 || after.metadata_syncs - before.metadata_syncs != 1 ||
+        after.data_io_calls - before.data_io_calls != 1)
+    {
+        printf(RED "fs_batch - %lld commits, %lld syncs, %lld data requests; expected 1 each\n" RESET,
+               after.journal_commits - before.journal_commits, after.metadata_syncs - before.metadata_syncs,
+               after.data_io_calls - before.data_io_calls);
+        exit(-1);
+    }
+    for (int i = 0; i < BATCH_TEST_FILES; i++)
+    {
+        if (fs_read(names[i], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) ||
+            memcmp(read_buf, data[i], sizeof(read_buf)) != 0)
+        {
+            printf(RED "fs_batch - %s has wrong contents\n" RESET, names[i]);
+            exit(-1);
+        }
+    }
+    if (fs_read("old", read_buf, sizeof(read_buf)) != -1 || count_files() != BATCH_TEST_FILES)
+    {
+        printf(RED "fs_batch - Delete not applied\n" RESET);
+        exit(-1);
+    }
+
+    // A failing operation anywhere leaves everything as it was
+    ops[0] = (fs_op){.type = FS_OP_CREATE, .filename = "fresh"};
+    ops[1] = (fs_op){.type = FS_OP_WRITE, .filename = "fresh", .data = data[0], .size = sizeof(data[0])};
+    ops[2] = (fs_op){.type = FS_OP_DELETE, .filename = names[1]};
+    ops[3] = (fs_op){.type = FS_OP_WRITE, .filename = names[1], .data = data[0], .size = 10};
+    fs_get_stats(&before);
+    if (fs_batch(ops, 4) != -1 || ops[3].result != -1 || ops[0].result != 0 || fs_read("fresh", read_buf, 10) != -1 ||
+        count_files() != BATCH_TEST_FILES)
+    {
+        printf(RED "fs_batch - Write to a file deleted earlier in the batch not rejected cleanly\n" RESET);
+        exit(-1);
+    }
+
+    // So does running out of space, and the blocks come back
+    static char big[MAX_BLOCKS * BLOCK_SIZE / 2];
+    ops[0] = (fs_op){.type = FS_OP_WRITE, .filename = names[2], .data = big, .size = sizeof(big)};
+    ops[1] = (fs_op){.type = FS_OP_WRITE, .filename = names[3], .data = big, .size = sizeof(big)};
+    if (fs_batch(ops, 2) != -2 || ops[1].result != -2 || fs_batch(ops, 1) != 0 ||
+        fs_read(names[2], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) || read_buf[0] != 0)
+    {
+        printf(RED "fs_batch - Out-of-space batch not rejected cleanly\n" RESET);
+        exit(-1);
+    }
+
+    // A write that fits only in the blocks an earlier delete frees succeeds, as the
+    // same calls one by one would
+    ops[0] = (fs_op){.type = FS_OP_DELETE, .filename = names[2]};
+    ops[1] = (fs_op){.type = FS_OP_WRITE, .filename = names[3], .data = big, .size = sizeof(big)};
+    ops[2] = (fs_op){.type = FS_OP_CREATE, .filename = names[2]};
+    if (fs_batch(ops, 3) != 0 || ops[1].result != 0 || fs_read(names[2], read_buf, sizeof(read_buf)) != 0 ||
+        fs_read(names[3], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) || read_buf[0] != 0)
+    {
+        printf(RED "fs_batch - Write into blocks freed earlier in the batch refused\n" RESET);
+        exit(-1);
+    }
+
+    // Later operations see earlier ones: the name ends up as an empty file
+    ops[0] = (fs_op){.type = FS_OP_CREATE, .filename = "cycled"};
+    ops[1] = (fs_op){.type = FS_OP_WRITE, .filename = "cycled", .data = data[0], .size = 100};
+    ops[2] = (fs_op){.type = FS_OP_DELETE, .filename = "cycled"};
+    ops[3] = (fs_op){.type = FS_OP_CREATE, .filename = "cycled"};
+    if (fs_batch(ops, 4) != 0 || fs_batch(ops, 0) != 0 || fs_batch(NULL, 1) != -3)
+    {
+        printf(RED "fs_batch - Dependent operations failed\n" RESET);
+        exit(-1);
+    }
+
+    fs_unmount();
+    fs_mount(path);
+    if (fs_read("cycled", read_buf, sizeof(read_buf)) != 0 || count_files() != BATCH_TEST_FILES + 1 ||
+        fs_read(names[9], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) || read_buf[0] != 'j')
+    {
+        printf(RED "fs_batch - Batches not persisted\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    printf(GREEN "fs_batch applies many operations with one sync, or none - Success\n" RESET);
+}
+
+#define TXN_TEST_FILES 8
+
+void *txn_test_other_thread(void *arg)
+{
+    // Another thread's transaction is neither joined, ended nor waited for, and
+    // the counters stay readable
+    (void)arg;
+    fs_stats stats;
+    fs_get_stats(&stats);
+    long refused = (fs_txn_begin() == -1 && fs_txn_commit() == -1 && fs_txn_abort() == -1);
+    return (void *)refused;
+}
+
+void test_transactions()
+{
+    printf(YELLOW "Test: Transactions commit once and abort back to the start\n" RESET);
+    const char *path = "test_imgs/txn.img";
+    char names[TXN_TEST_FILES][MAX_FILENAME];
+    static char data[2 * BLOCK_SIZE];
+    char read_buf[2 * BLOCK_SIZE];
+    fs_format(path);
+    fs_mount(path);
+    fs_create("kept");
+    fs_write("kept", "original", 8);
+    fs_create("doomed");
+    fs_write("doomed", "still here", 10);
+
+    // Many calls, one journal commit at the end and none before it
+    fs_stats before, during, after;
+    fs_get_stats(&before);
+    if (fs_txn_begin() != 0 || fs_txn_begin() != -1)
+    {
+        printf(RED "fs_txn_begin - Could not start exactly one transaction\n" RESET);
+        exit(-1);
+    }
+    for (int i = 0; i < TXN_TEST_FILES; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "txn_%d", i);
+        memset(data, 'a' + i, sizeof(data));
+        if (fs_create(names[i]) != 0 || fs_write(names[i], data, sizeof(data)) != 0)
+        {
+            printf(RED "fs_txn_begin - Calls inside the transaction failed\n" RESET);
+            exit(-1);
+        }
+    }
+    fs_delete("doomed");
+    pthread_t other;
+    void *refused = NULL;
+    pthread_create(&other, NULL, txn_test_other_thread, NULL);
+    pthread_join(other, &refused);
+    if (!refused)
+    {
+        printf(RED "fs_txn_begin - Another thread could use the open transaction\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&during);
+    if (fs_txn_commit() != 0 || fs_txn_commit() != -1)
+    {
+        printf(RED "fs_txn_commit - Commit failed\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (during.journal_commits != before.journal_commits || after.journal_commits - before.journal_commits != 1)
+    {
+        printf(RED "fs_txn_commit - %lld commits during the transaction and %lld at its end; expected 0 and 1\n" RESET,
+               during.journal_commits - before.journal_commits, after.journal_commits - during.journal_commits);
+        exit(-1);
+    }
+
+    // An abort undoes creates, rewrites, appends and deletes, and frees the space
+    static char big[MAX_BLOCKS * BLOCK_SIZE * 3 / 4];
+    memset(big, 'z', sizeof(big));
+    fs_txn_begin();
+    fs_create("fresh");
+    fs_write("fresh", big, sizeof(big));
+    fs_write("kept", "rewritten entirely", 18);
+    fs_append(names[0], "tail", 4);
+    fs_delete(names[1]);
+    fs_create(names[1]); // Same name, different inode and no data
+    if (fs_read("fresh", read_buf, 10) != 10 || fs_txn_abort() != 0 || fs_txn_abort() != -1)
+    {
+        printf(RED "fs_txn_abort - Abort failed\n" RESET);
+        exit(-1);
+    }
+    memset(data, 'b', sizeof(data));
+    if (fs_read("fresh", read_buf, 10) != -1 || fs_read("kept", read_buf, sizeof(read_buf)) != 8 ||
+        memcmp(read_buf, "original", 8) != 0 || fs_read(names[0], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) ||
+        fs_read(names[1], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) || memcmp(read_buf, data, sizeof(data)) != 0 ||
+        count_files() != TXN_TEST_FILES + 1)
+    {
+        printf(RED "fs_txn_abort - Files not restored\n" RESET);
+        exit(-1);
+    }
+    if (fs_create("fresh") != 0 || fs_write("fresh", big, sizeof(big)) != 0)
+    {
+        printf(RED "fs_txn_abort - Space allocated in the transaction not freed\n" RESET);
+        exit(-1);
+    }
+
+    // Unmounting aborts an open transaction; committed ones survive a remount
+    fs_txn_begin();
+    fs_delete("kept");
+    fs_unmount();
+    fs_mount(path);
+    if (fs_read("kept", read_buf, sizeof(read_buf)) != 8 || fs_read(names[7], read_buf, sizeof(read_buf)) != (int)sizeof(read_buf) ||
+        read_buf[0] != 'h' || fs_read("doomed", read_buf, sizeof(read_buf)) != -1 || count_files() != TXN_TEST_FILES + 2)
+    {
+        printf(RED "fs_txn_abort - Wrong files after remount\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    if (fs_txn_begin() != -1)
+    {
+        printf(RED "fs_txn_begin - Started without a mounted image\n" RESET);
+        exit(-1);
+    }
+    printf(GREEN "Transactions commit once and abort back to the start - Success\n" RESET);
+}
+
+// fs.c is linked into this program, so its flushes and writes come through these
+// replacements for the libc calls, which note their order while tracing is on:
+// D for a data write (pwritev), J for a journal record, W for another pwrite and F for a flush.
+// They can also fail writes of one kind, as a full or failing disk would.
+char io_trace[64];
+int io_trace_length = -1; // -1 while not tracing
+char fail_writes;         // 'J' fails journal records, 'S' fails writes at offset 0 (the superblock)
+int failed_writes;        // Writes failed on purpose so far
+
+void trace_io(char event)
+{
+    if (io_trace_length >= 0 && io_trace_length < (int)sizeof(io_trace) - 1)
+    {
+        io_trace[io_trace_length++] = event;
+        io_trace[io_trace_length] = '\0';
+    }
+}
+
+int fdatasync(int fd)
+{
+    trace_io('F');
+    return syscall(SYS_fdatasync, fd);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    // Journal transactions start with the header magic, "JRNL" stored little-endian
+    char event = (count >= 4 && memcmp(buf, "LNRJ", 4) == 0) ? 'J' : 'W';
+    trace_io(event);
+    if ((fail_writes == 'J' && event == 'J') || (fail_writes == 'S' && offset == 0))
+    {
+        failed_writes++;
+        errno = EIO;
+        return -1;
+    }
+    return syscall(SYS_pwrite64, fd, buf, count, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    trace_io('D');
+    return syscall(SYS_pwritev, fd, iov, iovcnt, offset, 0);
+}
+
+void durability_ops_lazy()
+{
+    // Only what fs_sync covered is committed when the process dies
+    fs_set_durability(FS_DURABILITY_LAZY, 0, 0);
+    fs_create("synced");
+    fs_write("synced", "kept", 4);
+    fs_sync();
+    fs_create("unsynced");
+    fs_write("synced", "lost", 4);
+}
+
+int durability_set;    // Set once set_durability_elsewhere returns
+int durability_result; // What fs_set_durability returned there
+
+void *set_durability_elsewhere(void *arg)
+{
+    (void)arg;
+    durability_result = fs_set_durability(FS_DURABILITY_STRICT, 0, 0);
+    __atomic_store_n(&durability_set, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void test_durability_modes()
+{
+    printf(YELLOW "Test: Durability modes commit and flush when they promise to\n" RESET);
+    const char *path = "test_imgs/durability.img";
+    char name[MAX_FILENAME];
+    char read_buf[16];
+    fs_stats before, after;
+    fs_format(path);
+    fs_mount(path);
+
+    // Default: a commit per call, nothing flushed
+    fs_get_stats(&before);
+    fs_create("plain");
+    fs_write("plain", "data", 4);
+    fs_get_stats(&after);
+    if (after.journal_commits - before.journal_commits != 2 || after.flushes != before.flushes)
+    {
+        printf(RED "fs_set_durability - Default mode flushed or skipped commits\n" RESET);
+        exit(-1);
+    }
+
+    // Strict: every changing call flushed, in-place overwrites too
+    fs_set_durability(FS_DURABILITY_STRICT, 0, 0);
+    fs_get_stats(&before);
+    fs_create("strict");
+    fs_write("strict", "data", 4);
+    fs_pwrite("strict", 0, "DATA", 4);
+    fs_get_stats(&after);
+    // Five flushes: data before the create's commit (left by the default-mode write above)
+    // and after it, data and record of the write, then the in-place data
+    if (after.journal_commits - before.journal_commits != 2 || after.flushes - before.flushes != 5)
+    {
+        printf(RED "fs_set_durability - Strict mode made %lld commits and %lld flushes; expected 2 and 5\n" RESET,
+               after.journal_commits - before.journal_commits, after.flushes - before.flushes);
+        exit(-1);
+    }
+
+    // The data must be stable before the journal record that points to it, and the record after it
+    io_trace_length = 0;
+    fs_write("strict", "DATA", 4);
+    io_trace_length = -1;
+    if (strcmp(io_trace, "DFJF") != 0)
+    {
+        printf(RED "fs_set_durability - Strict write went to the image as %s; expected DFJF\n" RESET, io_trace);
+        exit(-1);
+    }
+
+    // Periodic by count: eight calls, two flushed commits
+    fs_set_durability(FS_DURABILITY_PERIODIC, 4, 0);
+    fs_get_stats(&before);
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "periodic_%d", i);
+        fs_create(name);
+    }
+    fs_get_stats(&after);
+    if (after.journal_commits - before.journal_commits != 2 || after.flushes - before.flushes != 2)
+    {
+        printf(RED "fs_set_durability - Periodic mode did not commit every 4 calls\n" RESET);
+        exit(-1);
+    }
+
+    // Periodic by time: the background thread commits what is waiting
+    fs_set_durability(FS_DURABILITY_PERIODIC, 0, 10);
+    fs_get_stats(&before);
+    fs_create("timed");
+    fs_get_stats(&after);
+    int waited = 0;
+    while (after.journal_commits == before.journal_commits && waited < 2000)
+    {
+        usleep(10000);
+        waited += 10;
+        fs_get_stats(&after);
+    }
+    if (after.journal_commits - before.journal_commits != 1 || after.flushes == before.flushes)
+    {
+        printf(RED "fs_set_durability - Periodic timer never committed\n" RESET);
+        exit(-1);
+    }
+
+    // Lazy: nothing until fs_sync, and the mode survives a remount
+    fs_set_durability(FS_DURABILITY_LAZY, 0, 0);
+    fs_unmount();
+    fs_mount(path);
+    fs_get_stats(&before);
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "periodic_%d", i);
+        fs_delete(name);
+    }
+    fs_get_stats(&after);
+    if (after.journal_commits != before.journal_commits || fs_sync() != 0)
+    {
+        printf(RED "fs_set_durability - Lazy mode committed before fs_sync\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (after.journal_commits - before.journal_commits != 1 || after.flushes - before.flushes != 1)
+    {
+        printf(RED "fs_sync - Expected one commit and one flush\n" RESET);
+        exit(-1);
+    }
+    fs_create("lazy_data");
+    fs_write("lazy_data", "ordered", 7);
+    io_trace_length = 0;
+    fs_sync();
+    io_trace_length = -1;
+    if (strcmp(io_trace, "FJF") != 0)
+    {
+        printf(RED "fs_sync - Went to the image as %s; expected FJF\n" RESET, io_trace);
+        exit(-1);
+    }
+    if (fs_set_durability(FS_DURABILITY_PERIODIC, 0, 0) != -1 || fs_set_durability(4, 0, 0) != -1)
+    {
+        printf(RED "fs_set_durability - Invalid settings accepted\n" RESET);
+        exit(-1);
+    }
+
+    // Another thread's open transaction makes it fail at once instead of waiting for the end
+    pthread_t setter;
+    fs_txn_begin();
+    pthread_create(&setter, NULL, set_durability_elsewhere, NULL);
+    for (int waited = 0; waited < 2000 && !__atomic_load_n(&durability_set, __ATOMIC_ACQUIRE); waited += 10)
+    {
+        usleep(10000);
+    }
+    int returned = __atomic_load_n(&durability_set, __ATOMIC_ACQUIRE);
+    fs_txn_commit();
+    pthread_join(setter, NULL);
+    if (!returned || durability_result != -1)
+    {
+        printf(RED "fs_set_durability - Waited for another thread's transaction\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+
+    // A crash in lazy mode loses exactly what came after the last fs_sync
+    run_then_crash(path, durability_ops_lazy);
+    fs_mount(path);
+    if (fs_read("synced", read_buf, sizeof(read_buf)) != 4 || memcmp(read_buf, "kept", 4) != 0 ||
+        fs_read("unsynced", read_buf, sizeof(read_buf)) != -1 || fs_read("strict", read_buf, sizeof(read_buf)) != 4 ||
+        memcmp(read_buf, "DATA", 4) != 0)
+    {
+        printf(RED "fs_sync - Wrong files after a crash in lazy mode\n" RESET);
+        exit(-1);
+    }
+
+    // Unmounting inside a transaction while the flusher waits for it
+    fs_set_durability(FS_DURABILITY_PERIODIC, 0, 10);
+    fs_txn_begin();
+    fs_create("in_txn");
+    usleep(100000);
+    fs_unmount();
+    fs_mount(path);
+    if (fs_read("in_txn", read_buf, sizeof(read_buf)) != -1)
+    {
+        printf(RED "fs_unmount - Transaction left open was committed\n" RESET);
+        exit(-1);
+    }
+    fs_set_durability(FS_DURABILITY_NONE, 0, 0);
+    fs_unmount();
+    if (fs_sync() != -1)
+    {
+        printf(RED "fs_sync - Succeeded without a mounted image\n" RESET);
+        exit(-1);
+    }
+
+    // A context mounted lazy is lazy from its first call
+    fs_ctx *lazy = fs_mount_ex_ctx(path, 0, FS_DURABILITY_LAZY, 0, 0);
+    if (lazy == NULL || fs_mount_ex_ctx(path, 0, FS_DURABILITY_PERIODIC, 0, 0) != NULL ||
+        fs_mount_ex_ctx(path, 2, FS_DURABILITY_NONE, 0, 0) != NULL)
+    {
+        printf(RED "fs_mount_ex_ctx - Valid settings refused or invalid ones accepted\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats_ctx(lazy, &before);
+    fs_create_ctx(lazy, "lazy_ctx");
+    fs_write_ctx(lazy, "lazy_ctx", "data", 4);
+    fs_get_stats_ctx(lazy, &after);
+    if (after.journal_commits != before.journal_commits || fs_sync_ctx(lazy) != 0)
+    {
+        printf(RED "fs_mount_ex_ctx - Lazy context committed before fs_sync_ctx\n" RESET);
+        exit(-1);
+    }
+    fs_get_stats_ctx(lazy, &after);
+    if (after.journal_commits - before.journal_commits != 1)
+    {
+        printf(RED "fs_sync_ctx - Expected one commit\n" RESET);
+        exit(-1);
+    }
+    fs_unmount_ctx(lazy);
+    printf(GREEN "Durability modes commit and flush when they promise to - Success\n" RESET);
+}
+
+void checkpoint_ops_failing()
+{
+    // Commits until a checkpoint fails and leaves the journal short of room, then
+    // dies in the next commit, after its checkpoint and before its record lands
+    char buffer[64] = {0};
+    fs_create("committed");
+    fail_writes = 'S';
+    failed_writes = 0;
+    for (int i = 1; i < 100000 && failed_writes == 0; i++)
+    {
+        fs_write("committed", buffer, 1 + i % (int)sizeof(buffer));
+    }
+    fail_writes = 'J';
+    fs_create("unjournaled");
+}
+
+void test_checkpoint_before_commit()
+{
+    printf(YELLOW "Test: A commit short of journal room checkpoints only committed state\n" RESET);
+    const char *path = "test_imgs/checkpoint_before_commit.img";
+    char read_buf[64];
+    fs_format(path);
+    run_then_crash(path, checkpoint_ops_failing);
+    if (fs_mount(path) != 0 || fs_read("committed", read_buf, sizeof(read_buf)) <= 0)
+    {
+        printf(RED "journal_commit - Committed file lost after the crash\n" RESET);
+        exit(-1);
+    }
+    if (fs_read("unjournaled", read_buf, sizeof(read_buf)) != -1)
+    {
+        printf(RED "journal_commit - A file never committed reached the image\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    printf(GREEN "A commit short of journal room checkpoints only committed state - Success\n" RESET);
+}
+
+#define LARGE_TXN_FILES 16000
+
+void test_large_transactions()
+{
+    printf(YELLOW "Test: Large transactions stay within the journal budget\n" RESET);
+    const char *path = "test_imgs/large_txn.img";
+    static char big[11000 * 512];
+    char name[MAX_FILENAME];
+    fs_stats before, after;
+    if (fs_format_ex(path, 32768, 512, 65536) != 0 || fs_mount(path) != 0)
+    {
+        printf(RED "fs_format_ex - Could not create an image with 65536 inodes\n" RESET);
+        exit(-1);
+    }
+
+    // Lazy mode defers commits, but not past the journal budget
+    fs_set_durability(FS_DURABILITY_LAZY, 0, 0);
+    fs_get_stats(&before);
+    for (int i = 0; i < LARGE_TXN_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "lazy_%d", i);
+        fs_create(name);
+    }
+    fs_get_stats(&after);
+    if (after.journal_commits == before.journal_commits || fs_sync() != 0)
+    {
+        printf(RED "fs_set_durability - %d creates in lazy mode never committed\n" RESET, LARGE_TXN_FILES);
+        exit(-1);
+    }
+    fs_set_durability(FS_DURABILITY_NONE, 0, 0);
+
+    // A transaction bigger than the journal still commits once and survives a remount
+    fs_get_stats(&before);
+    fs_txn_begin();
+    for (int i = 0; i < LARGE_TXN_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "txn_%d", i);
+        if (fs_create(name) != 0)
+        {
+            printf(RED "fs_txn_begin - Create %d inside the transaction failed\n" RESET, i);
+            exit(-1);
+        }
+    }
+    if (fs_txn_commit() != 0)
+    {
+        printf(RED "fs_txn_commit - Could not commit %d creates\n" RESET, LARGE_TXN_FILES);
+        exit(-1);
+    }
+    fs_get_stats(&after);
+    if (after.journal_commits - before.journal_commits != 1)
+    {
+        printf(RED "fs_txn_commit - %lld commits for one transaction\n" RESET, after.journal_commits - before.journal_commits);
+        exit(-1);
+    }
+
+    // The data blocks that held the transaction are free again
+    memset(big, 'q', sizeof(big));
+    if (fs_create("big") != 0 || fs_write("big", big, sizeof(big)) != 0)
+    {
+        printf(RED "fs_txn_commit - Blocks used for the transaction were not released\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    fs_mount(path);
+    if (fs_read("big", big, 512) != 512 || big[0] != 'q' || fs_read("txn_0", big, 1) != 0 ||
+        fs_read("txn_15999", big, 1) != 0 || fs_read("lazy_15999", big, 1) != 0 || fs_create("txn_7777") == 0)
+    {
+        printf(RED "fs_txn_commit - Files missing after remount\n" RESET);
+        exit(-1);
+    }
+
+    // A spilled transaction whose journal record fails to land gives back its spill
+    // blocks, so the retry can spill again
+    fs_delete("big"); // Room for the spill beside the inode table
+    fs_txn_begin();
+    for (int i = 0; i < LARGE_TXN_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "retry_%d", i);
+        fs_create(name);
+    }
+    fail_writes = 'J';
+    failed_writes = 0;
+    int committed = fs_txn_commit();
+    fail_writes = 0;
+    if (committed != -3 || failed_writes == 0 || fs_sync() != 0)
+    {
+        printf(RED "fs_sync - Spilled transaction not retried after a failed journal write\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    fs_mount(path);
+    if (fs_read("retry_0", big, 1) != 0 || fs_read("retry_15999", big, 1) != 0)
+    {
+        printf(RED "fs_sync - Retried transaction missing after remount\n" RESET);
+        exit(-1);
+    }
+    fs_unmount();
+    printf(GREEN "Large transactions stay within the journal budget - Success\n" RESET);
+}
+
 void robustness_tests()
 {
     test_inode_consistency_api_only();         // Test inode consistency via API
@@ -1253,6 +3448,24 @@ void robustness_tests()
     test_cross_boundary_write();               // Test cross-boundary write
     test_power_failure_simulation();           // Test power failure simulation (manual)
     test_maximum_stress();                     // Test maximum stress (fill, delete, refill)
+    test_name_lookup_after_churn();            // Test name lookups after create/delete churn
+    test_metadata_writeback_is_partial();      // Test that syncs only write changed metadata
+    test_contiguous_file_single_request();     // Test vectored I/O coalesces contiguous blocks
+    test_block_cache_hits_and_invalidation();  // Test the data block cache
+    test_large_file_indirect_blocks();         // Test indirect and double indirect blocks
+    test_extent_mapped_files();                // Test extents and their conversion
+    test_best_fit_allocation();                // Test the best-fit run allocator
+    test_multi_block_bitmap();                 // Test multi-block bitmaps and 64-bit offsets
+    test_free_space_summary();                 // Test the summary over full and free regions
+    test_parallel_reads_and_writes();          // Test concurrent fs_read and fs_write from threads
+    test_reads_race_writes_and_deletes();      // Test reads racing rewrites, deletes and cache resizes
+    test_io_uring_batches();                   // Test batched transfers through io_uring
+    test_async_requests();                     // Test fs_read_async, fs_write_async and the eventfd
+    test_batch_operations();                   // Test all-or-nothing fs_batch
+    test_transactions();                       // Test fs_txn_begin, fs_txn_commit and fs_txn_abort
+    test_durability_modes();                   // Test fs_set_durability and fs_sync
+    test_large_transactions();                 // Test journal-bounded commits and spilled transactions
+    test_checkpoint_before_commit();           // Test the checkpoint a commit runs when the journal is full
     printf(GREEN "Robustness tests completed successfully." RESET "\n");
 }
 void main()
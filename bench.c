@@ -0,0 +1,1362 @@
+/**
+ * @file bench.c
+ * @brief Micro-benchmarks for the OnlyFiles filesystem implementation
+ *
+ * Each benchmark formats a scratch image, drives the public fs_* API and
+ * prints its timings. Run all of them with no arguments, or pass the names
+ * of the benchmarks to run (e.g. ./fs_bench lookup).
+ *
+ * Numbers are only comparable between runs on the same machine; build with
+ * optimizations (see bench.sh) before comparing two revisions of fs.c.
+ */
+
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_IMAGE "bench.img"
+
+// Monotonic clock in nanoseconds
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int setup_image()
+{
+    if (fs_format(BENCH_IMAGE) != 0 || fs_mount(BENCH_IMAGE) != 0)
+    {
+        printf("Error preparing %s\n", BENCH_IMAGE);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Filename lookup cost with a full inode table
+ *
+ * Fills all MAX_FILES inodes with empty files, then times fs_read on the
+ * most recently created name (the worst case for a linear scan) and on a
+ * missing name. Empty files need no data I/O, so the timing is the lookup.
+ */
+static void bench_lookup()
+{
+    const int iterations = 200000;
+    char filename[MAX_FILENAME];
+    char buffer[16];
+
+    if (setup_image() != 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        snprintf(filename, sizeof(filename), "lookup_%03d", i);
+        fs_create(filename);
+    }
+
+    snprintf(filename, sizeof(filename), "lookup_%03d", MAX_FILES - 1);
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_read(filename, buffer, sizeof(buffer));
+    }
+    double hit_ns = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_read("missing_file", buffer, sizeof(buffer));
+    }
+    double miss_ns = (now_ns() - start) / iterations;
+
+    printf("lookup: %d files, hit %.1f ns/op, miss %.1f ns/op\n", MAX_FILES, hit_ns, miss_ns);
+    fs_unmount();
+}
+
+// Times a 12-block rewrite of one file after filling the image with fill_files other max-size files
+static double time_full_rewrite(int fill_files, int iterations)
+{
+    int max_size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *data = malloc(max_size);
+    char filename[MAX_FILENAME];
+
+    memset(data, 'A', max_size);
+    if (setup_image() != 0)
+    {
+        free(data);
+        return 0;
+    }
+
+    for (int i = 0; i < fill_files; i++)
+    {
+        snprintf(filename, sizeof(filename), "fill_%03d", i);
+        fs_create(filename);
+        fs_write(filename, data, max_size);
+    }
+
+    fs_create("rewrite");
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_write("rewrite", data, max_size);
+    }
+    double per_op = (now_ns() - start) / iterations;
+
+    fs_unmount();
+    free(data);
+    return per_op;
+}
+
+/**
+ * @brief Block allocation cost as the image fills
+ *
+ * Each fs_write of a 48KB file allocates 12 blocks. The rewrite is timed on
+ * an empty image and on one that is nearly full; a flat allocator keeps
+ * the two close.
+ */
+static void bench_alloc()
+{
+    const int iterations = 5000;
+    int fill_files = (MAX_BLOCKS - 10) / MAX_DIRECT_BLOCKS - 3; // Leave room for two copies of the rewritten file
+
+    double empty_us = time_full_rewrite(0, iterations) / 1000;
+    double full_us = time_full_rewrite(fill_files, iterations) / 1000;
+
+    printf("alloc: 12-block rewrite, empty image %.2f us/op, %d%% full %.2f us/op\n",
+           empty_us, (fill_files * MAX_DIRECT_BLOCKS * 100) / MAX_BLOCKS, full_us);
+}
+
+/**
+ * @brief Metadata bytes written per operation
+ *
+ * Runs create / 20-byte write / delete cycles and reports the average
+ * metadata write cost per operation from fs_get_stats(), next to the cost
+ * of rewriting the superblock, bitmap and inode table in full.
+ */
+static void bench_metadata()
+{
+    const int cycles = 10000;
+    const char data[] = "twenty bytes of data";
+    fs_stats stats;
+
+    if (setup_image() != 0)
+    {
+        return;
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < cycles; i++)
+    {
+        fs_create("meta_file");
+        fs_write("meta_file", data, sizeof(data));
+        fs_delete("meta_file");
+    }
+    double per_op_us = (now_ns() - start) / (3.0 * cycles) / 1000;
+
+    fs_get_stats(&stats);
+    long long full_sync = sizeof(superblock) + BLOCK_SIZE + (long long)sizeof(inode) * MAX_FILES;
+    printf("metadata: %.0f bytes/op written (full rewrite %lld bytes), %.2f us/op\n",
+           (double)stats.metadata_bytes_written / stats.metadata_syncs, full_sync, per_op_us);
+    fs_unmount();
+}
+
+/**
+ * @brief Metadata operation throughput at various group commit intervals
+ *
+ * Runs create / small write / delete cycles with 1, 4, 16 and 64 operations
+ * per journal commit and reports operations per second and journal commits.
+ */
+static void bench_journal()
+{
+    const int cycles = 20000;
+    const int intervals[] = {1, 4, 16, 64};
+    const char data[] = "journal bench";
+    fs_stats stats;
+
+    for (int k = 0; k < (int)(sizeof(intervals) / sizeof(intervals[0])); k++)
+    {
+        if (setup_image() != 0)
+        {
+            return;
+        }
+        fs_set_commit_interval(intervals[k]);
+
+        double start = now_ns();
+        for (int i = 0; i < cycles; i++)
+        {
+            fs_create("journal_file");
+            fs_write("journal_file", data, sizeof(data));
+            fs_delete("journal_file");
+        }
+        double seconds = (now_ns() - start) / 1e9;
+
+        fs_get_stats(&stats);
+        printf("journal: commit every %2d ops, %.0f ops/s, %lld commits, %lld checkpoints\n",
+               intervals[k], 3.0 * cycles / seconds, stats.journal_commits, stats.checkpoints);
+        fs_unmount();
+    }
+}
+
+/**
+ * @brief Whole-file transfer cost for 48KB files
+ *
+ * Writes and reads a maximum-size file repeatedly and reports the time and
+ * the number of data I/O requests per call (from fs_get_stats()). On a
+ * fresh image the file's blocks are contiguous.
+ */
+static void bench_io()
+{
+    const int iterations = 20000;
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *data = malloc(size);
+    fs_stats before, after;
+
+    memset(data, 'D', size);
+    if (setup_image() != 0)
+    {
+        free(data);
+        return;
+    }
+    fs_create("io_file");
+
+    fs_get_stats(&before);
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_write("io_file", data, size);
+    }
+    double write_us = (now_ns() - start) / iterations / 1000;
+    fs_get_stats(&after);
+    double write_calls = (double)(after.data_io_calls - before.data_io_calls) / iterations;
+
+    before = after;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_read("io_file", data, size);
+    }
+    double read_us = (now_ns() - start) / iterations / 1000;
+    fs_get_stats(&after);
+    double read_calls = (double)(after.data_io_calls - before.data_io_calls) / iterations;
+
+    printf("io: 48KB write %.2f us/op (%.1f requests), read %.2f us/op (%.1f requests)\n",
+           write_us, write_calls, read_us, read_calls);
+    fs_unmount();
+    free(data);
+}
+
+// Times fs_read of a file of the given size on the mounted image
+static double time_reads(const char *filename, char *buffer, int size, int iterations)
+{
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_read(filename, buffer, size);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+/**
+ * @brief Read cost with syscalls, with a memory-mapped image and zero-copy
+ *
+ * Reads a 4KB and a 48KB file with fs_read on a normal mount, then with
+ * fs_read and fs_read_zerocopy on an fs_mount_mmap mount.
+ */
+static void bench_mmap()
+{
+    const int iterations = 100000;
+    const int sizes[] = {BLOCK_SIZE, MAX_DIRECT_BLOCKS * BLOCK_SIZE};
+    char *buffer = malloc(MAX_DIRECT_BLOCKS * BLOCK_SIZE);
+    fs_segment segments[MAX_DIRECT_BLOCKS];
+
+    memset(buffer, 'M', MAX_DIRECT_BLOCKS * BLOCK_SIZE);
+    if (setup_image() != 0)
+    {
+        free(buffer);
+        return;
+    }
+    fs_create("small");
+    fs_write("small", buffer, sizes[0]);
+    fs_create("large");
+    fs_write("large", buffer, sizes[1]);
+
+    double syscall_ns[2];
+    syscall_ns[0] = time_reads("small", buffer, sizes[0], iterations);
+    syscall_ns[1] = time_reads("large", buffer, sizes[1], iterations);
+    fs_unmount();
+
+    fs_mount_mmap(BENCH_IMAGE);
+    for (int k = 0; k < 2; k++)
+    {
+        const char *filename = (k == 0) ? "small" : "large";
+        double mapped_ns = time_reads(filename, buffer, sizes[k], iterations);
+
+        long checksum = 0;
+        double start = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            int count = fs_read_zerocopy(filename, segments, MAX_DIRECT_BLOCKS);
+            checksum += count > 0 ? ((const char *)segments[0].data)[0] : 0;
+        }
+        double zero_copy_ns = (now_ns() - start) / iterations;
+
+        printf("mmap: %2dKB read, syscalls %.0f ns, mmap %.0f ns, zero-copy %.0f ns (%ld)\n",
+               sizes[k] / 1024, syscall_ns[k], mapped_ns, zero_copy_ns, checksum & 1);
+    }
+    fs_unmount();
+    free(buffer);
+}
+
+/**
+ * @brief Repeated reads of a hot 48KB file with the block cache on and off
+ *
+ * Reports fs_read time with the default cache and with fs_set_cache_size(0),
+ * plus the cache hit rate from fs_get_stats() for the cached run.
+ */
+static void bench_cache()
+{
+    const int iterations = 100000;
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *buffer = malloc(size);
+    fs_stats before, after;
+
+    memset(buffer, 'C', size);
+    if (setup_image() != 0)
+    {
+        free(buffer);
+        return;
+    }
+    fs_create("hot");
+    fs_write("hot", buffer, size);
+
+    fs_get_stats(&before);
+    double cached_us = time_reads("hot", buffer, size, iterations) / 1000;
+    fs_get_stats(&after);
+    long long hits = after.cache_hits - before.cache_hits;
+    long long misses = after.cache_misses - before.cache_misses;
+
+    fs_set_cache_size(0);
+    double uncached_us = time_reads("hot", buffer, size, iterations) / 1000;
+
+    printf("cache: 48KB read, cached %.2f us/op (%.2f%% hits), uncached %.2f us/op\n",
+           cached_us, 100.0 * hits / (hits + misses), uncached_us);
+    fs_set_cache_size(256);
+    fs_unmount();
+    free(buffer);
+}
+
+/**
+ * @brief Cost of changing a few bytes of a 48KB file
+ *
+ * Compares rewriting the whole file with fs_write against a 16-byte
+ * fs_pwrite at a random offset, reporting time and data I/O requests per
+ * update.
+ */
+static void bench_pwrite()
+{
+    const int iterations = 20000;
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *data = malloc(size);
+    fs_stats before, after;
+
+    memset(data, 'W', size);
+    if (setup_image() != 0)
+    {
+        free(data);
+        return;
+    }
+    fs_create("update");
+    fs_write("update", data, size);
+
+    fs_get_stats(&before);
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        data[(i * 4099) % size] ^= 1;
+        fs_write("update", data, size);
+    }
+    double rewrite_us = (now_ns() - start) / iterations / 1000;
+    fs_get_stats(&after);
+    double rewrite_calls = (double)(after.data_io_calls - before.data_io_calls) / iterations;
+
+    srand(1);
+    before = after;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_pwrite("update", rand() % (size - 16), data, 16);
+    }
+    double pwrite_us = (now_ns() - start) / iterations / 1000;
+    fs_get_stats(&after);
+    double pwrite_calls = (double)(after.data_io_calls - before.data_io_calls) / iterations;
+
+    printf("pwrite: 16-byte update of a 48KB file, fs_write %.2f us/op (%.1f requests), fs_pwrite %.2f us/op (%.1f requests)\n",
+           rewrite_us, rewrite_calls, pwrite_us, pwrite_calls);
+    fs_unmount();
+    free(data);
+}
+
+/**
+ * @brief Reading 100 bytes from the end of a 48KB file
+ *
+ * Compares fs_read of the whole file (the only way to reach the tail before
+ * fs_pread) with fs_pread of just the tail, with the block cache disabled so
+ * every read reaches the image.
+ */
+static void bench_pread()
+{
+    const int iterations = 100000;
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    char *buffer = malloc(size);
+
+    memset(buffer, 'R', size);
+    if (setup_image() != 0)
+    {
+        free(buffer);
+        return;
+    }
+    fs_set_cache_size(0);
+    fs_create("records");
+    fs_write("records", buffer, size);
+
+    double full_us = time_reads("records", buffer, size, iterations) / 1000;
+
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_pread("records", buffer, size - 100, 100);
+    }
+    double tail_us = (now_ns() - start) / iterations / 1000;
+
+    printf("pread: last 100 bytes of a 48KB file, fs_read %.2f us/op, fs_pread %.2f us/op\n", full_us, tail_us);
+    fs_set_cache_size(256);
+    fs_unmount();
+    free(buffer);
+}
+
+/**
+ * @brief Building a 48KB log out of 64-byte records
+ *
+ * Grows a file one record at a time, first by reading it back and rewriting
+ * it with fs_write, then with fs_append, and reports the average time per
+ * record and data I/O requests per record.
+ */
+static void bench_append()
+{
+    const int rounds = 20;
+    const int record_size = 64;
+    int size = MAX_DIRECT_BLOCKS * BLOCK_SIZE;
+    int records = size / record_size;
+    char *log = malloc(size);
+    char record[64];
+    fs_stats before, after;
+
+    memset(record, 'L', sizeof(record));
+    if (setup_image() != 0)
+    {
+        free(log);
+        return;
+    }
+
+    double elapsed[2];
+    double calls[2];
+    for (int mode = 0; mode < 2; mode++)
+    {
+        fs_get_stats(&before);
+        double start = now_ns();
+        for (int r = 0; r < rounds; r++)
+        {
+            fs_create("log");
+            for (int i = 0; i < records; i++)
+            {
+                if (mode == 0)
+                {
+                    int length = fs_read("log", log, size);
+                    memcpy(log + length, record, record_size);
+                    fs_write("log", log, length + record_size);
+                }
+                else
+                {
+                    fs_append("log", record, record_size);
+                }
+            }
+            fs_delete("log");
+        }
+        elapsed[mode] = (now_ns() - start) / rounds / records / 1000;
+        fs_get_stats(&after);
+        calls[mode] = (double)(after.data_io_calls - before.data_io_calls) / rounds / records;
+    }
+
+    printf("append: 64-byte records to 48KB, read+fs_write %.2f us/record (%.1f requests), fs_append %.2f us/record (%.1f requests)\n",
+           elapsed[0], calls[0], elapsed[1], calls[1]);
+    fs_unmount();
+    free(log);
+}
+
+/**
+ * @brief Sequential whole-file I/O on a file that needs indirect blocks
+ *
+ * Writes and reads a block-mapped 4.3MB file (1100 blocks, reaching into
+ * the double indirect range) and reports throughput and how many pointer
+ * blocks each read had to load from the image. The block cache is disabled
+ * so the reads reach the image.
+ */
+static void bench_indirect()
+{
+    const int iterations = 50;
+    int size = 1100 * BLOCK_SIZE;
+    char *data = malloc(size);
+    fs_stats before, after;
+
+    memset(data, 'I', size);
+    if (setup_image() != 0)
+    {
+        free(data);
+        return;
+    }
+    fs_set_cache_size(0);
+    fs_set_extent_mapping(0); // Measure the pointer-block path
+    fs_create("large");
+
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        fs_write("large", data, size);
+    }
+    double write_s = (now_ns() - start) / 1e9;
+
+    fs_get_stats(&before);
+    double read_s = time_reads("large", data, size, iterations) * iterations / 1e9;
+    fs_get_stats(&after);
+
+    double megabytes = (double)size * iterations / (1024 * 1024);
+    printf("indirect: 4.3MB file, write %.0f MB/s, read %.0f MB/s, %.2f pointer block reads per read\n",
+           megabytes / write_s, megabytes / read_s,
+           (double)(after.pointer_block_reads - before.pointer_block_reads) / iterations);
+    fs_set_cache_size(256);
+    fs_set_extent_mapping(1);
+    fs_unmount();
+    free(data);
+}
+
+/**
+ * @brief Sequential read throughput, extent mapping vs. block pointers
+ *
+ * Writes the same 4.3MB file once with fs_set_extent_mapping(1) and once
+ * with 0, remounting each time so the pointer blocks start uncached, and
+ * reports read throughput and data requests per read with the block cache
+ * disabled.
+ */
+static void bench_extents()
+{
+    const int iterations = 50;
+    int size = 1100 * BLOCK_SIZE;
+    char *data = malloc(size);
+    fs_stats before, after;
+
+    memset(data, 'E', size);
+    for (int extents = 1; extents >= 0; extents--)
+    {
+        if (setup_image() != 0)
+        {
+            free(data);
+            return;
+        }
+        fs_set_extent_mapping(extents);
+        fs_create("sequential");
+        fs_write("sequential", data, size);
+        fs_unmount();
+
+        fs_mount(BENCH_IMAGE);
+        fs_set_cache_size(0);
+        fs_get_stats(&before);
+        double read_s = time_reads("sequential", data, size, iterations) * iterations / 1e9;
+        fs_get_stats(&after);
+
+        printf("extents: %s, 4.3MB read %.0f MB/s, %.1f requests per read, %lld pointer block reads\n",
+               extents ? "extent-mapped" : "block-mapped ", (double)size * iterations / (1024 * 1024) / read_s,
+               (double)(after.data_io_calls - before.data_io_calls) / iterations,
+               after.pointer_block_reads - before.pointer_block_reads);
+        fs_set_cache_size(256);
+        fs_set_extent_mapping(1);
+        fs_unmount();
+    }
+    free(data);
+}
+
+/**
+ * @brief File fragmentation on a churned image
+ *
+ * Repeatedly deletes and rewrites random files of 1 to 20 blocks on an image
+ * kept about 85% full, then reports the average number of data requests
+ * needed to read a file back (1 means every file is contiguous) and the
+ * average fs_write time during the churn.
+ */
+static void bench_churn()
+{
+    const int files = 200;
+    const int rounds = 20000;
+    char *data = malloc(20 * BLOCK_SIZE);
+    char filename[MAX_FILENAME];
+    int sizes[200];
+    fs_stats before, after;
+
+    memset(data, 'C', 20 * BLOCK_SIZE);
+    if (setup_image() != 0)
+    {
+        free(data);
+        return;
+    }
+
+    srand(7);
+    for (int i = 0; i < files; i++)
+    {
+        sizes[i] = 1 + rand() % 20;
+        snprintf(filename, sizeof(filename), "churn_%03d", i);
+        fs_create(filename);
+        fs_write(filename, data, sizes[i] * BLOCK_SIZE);
+    }
+
+    double start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        int i = rand() % files;
+        sizes[i] = 1 + rand() % 20;
+        snprintf(filename, sizeof(filename), "churn_%03d", i);
+        fs_delete(filename);
+        fs_create(filename);
+        fs_write(filename, data, sizes[i] * BLOCK_SIZE);
+    }
+    double write_us = (now_ns() - start) / rounds / 1000;
+
+    fs_set_cache_size(0);
+    fs_get_stats(&before);
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(filename, sizeof(filename), "churn_%03d", i);
+        fs_read(filename, data, sizes[i] * BLOCK_SIZE);
+    }
+    fs_get_stats(&after);
+
+    printf("churn: %d rewrites, %.2f us/op, %.2f requests per file read\n", rounds, write_us,
+           (double)(after.data_io_calls - before.data_io_calls) / files);
+    fs_set_cache_size(256);
+    fs_unmount();
+    free(data);
+}
+
+/**
+ * @brief Sequential I/O with 4KB vs. 64KB blocks
+ *
+ * Formats a 128MB image with each block size through fs_format_ex, then
+ * rewrites and reads a 32MB file with the block cache off. Larger blocks mean
+ * fewer bitmap bits, segments and pointers per byte moved.
+ */
+static void bench_geometry()
+{
+    const int iterations = 10;
+    const int block_sizes[] = {4096, 65536};
+    int size = 32 * 1024 * 1024;
+    char *data = malloc(size);
+    fs_stats before, after;
+
+    memset(data, 'G', size);
+    for (int k = 0; k < 2; k++)
+    {
+        int total_blocks = 128 * 1024 * 1024 / block_sizes[k]; // As large as one 4KB bitmap block allows
+        if (fs_format_ex(BENCH_IMAGE, total_blocks, block_sizes[k], MAX_FILES) != 0 || fs_mount(BENCH_IMAGE) != 0)
+        {
+            printf("Error preparing %s\n", BENCH_IMAGE);
+            free(data);
+            return;
+        }
+        fs_set_cache_size(0);
+        fs_create("bulk");
+
+        double start = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            fs_write("bulk", data, size);
+        }
+        double write_s = (now_ns() - start) / 1e9;
+
+        fs_get_stats(&before);
+        double read_s = time_reads("bulk", data, size, iterations) * iterations / 1e9;
+        fs_get_stats(&after);
+
+        printf("geometry: %2dKB blocks, 32MB write %.0f MB/s, read %.0f MB/s (%.1f requests per read)\n",
+               block_sizes[k] / 1024, 32.0 * iterations / write_s, 32.0 * iterations / read_s,
+               (double)(after.data_io_calls - before.data_io_calls) / iterations);
+        fs_set_cache_size(256);
+        fs_unmount();
+    }
+    free(data);
+}
+
+/**
+ * @brief Mount time and allocation cost as the image grows
+ *
+ * Formats sparse 4KB-block images from 10MB to 64GB, then times fs_mount
+ * (which reads the whole bitmap), whole-file rewrites of a 16KB file (a
+ * best-fit search for 4 blocks) and 4KB appends (which continue the file's
+ * run).
+ */
+static void bench_scale()
+{
+    const int sizes[] = {2560, 256 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024};
+    const int mounts = 20;
+    const int iterations = 2000;
+    char data[4 * BLOCK_SIZE];
+
+    memset(data, 'S', sizeof(data));
+    for (int k = 0; k < 4; k++)
+    {
+        if (fs_format_ex(BENCH_IMAGE, sizes[k], BLOCK_SIZE, MAX_FILES) != 0)
+        {
+            printf("Error preparing %s\n", BENCH_IMAGE);
+            return;
+        }
+
+        double mount_ns = 0;
+        for (int i = 0; i < mounts; i++)
+        {
+            double start = now_ns();
+            fs_mount(BENCH_IMAGE);
+            mount_ns += now_ns() - start;
+            fs_unmount();
+        }
+
+        fs_mount(BENCH_IMAGE);
+        fs_create("rewrite");
+        fs_create("log");
+        double start = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            fs_write("rewrite", data, sizeof(data));
+        }
+        double write_us = (now_ns() - start) / iterations / 1000;
+
+        start = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            fs_append("log", data, BLOCK_SIZE);
+        }
+        double append_us = (now_ns() - start) / iterations / 1000;
+        fs_unmount();
+
+        printf("scale: %6.2f GB image, mount %8.1f us, 16KB rewrite %7.2f us/op, 4KB append %5.2f us/op\n",
+               (double)sizes[k] * BLOCK_SIZE / (1024.0 * 1024 * 1024), mount_ns / mounts / 1000, write_us, append_us);
+    }
+}
+
+#define THREAD_BENCH_FILE (48 * 1024)
+#define THREAD_BENCH_MAX 64
+
+typedef struct
+{
+    char name[MAX_FILENAME];
+    int calls;
+    int mode; // 0: 4KB fs_pread, 1: 4KB fs_pwrite in place, 2: 16KB fs_write
+} thread_bench_job;
+
+static void *thread_bench_worker(void *arg)
+{
+    thread_bench_job *job = arg;
+    char buffer[4 * BLOCK_SIZE] = {0};
+    for (int i = 0; i < job->calls; i++)
+    {
+        if (job->mode == 0)
+        {
+            fs_pread(job->name, buffer, (long long)(i % 12) * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        else if (job->mode == 1)
+        {
+            fs_pwrite(job->name, (long long)(i % 12) * BLOCK_SIZE, buffer, BLOCK_SIZE);
+        }
+        else
+        {
+            fs_write(job->name, buffer, sizeof(buffer));
+        }
+    }
+    return NULL;
+}
+
+// Total calls per second with 'threads' workers, each on its own file or all on one
+static double time_parallel_calls(int threads, int same_file, int calls, int mode)
+{
+    pthread_t ids[THREAD_BENCH_MAX];
+    thread_bench_job jobs[THREAD_BENCH_MAX];
+    for (int t = 0; t < threads; t++)
+    {
+        snprintf(jobs[t].name, sizeof(jobs[t].name), "reader_%02d", same_file ? 0 : t);
+        jobs[t].calls = calls;
+        jobs[t].mode = mode;
+    }
+
+    double start = now_ns();
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_create(&ids[t], NULL, thread_bench_worker, &jobs[t]);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+    }
+    return (double)threads * calls / ((now_ns() - start) / 1e9);
+}
+
+/**
+ * @brief Read and write throughput as threads are added
+ *
+ * Gives each of up to THREAD_BENCH_MAX threads a 48KB file, then times 4KB
+ * fs_pread calls from 1, 2, 4, ... threads up to the number of online CPUs,
+ * first each on its own file and then all on the same file. Both cases only
+ * share locks in read mode, so throughput should grow with the cores. Then
+ * times writers on their own files: 4KB fs_pwrite calls within the file, which
+ * never take alloc_lock, and 16KB fs_write calls, which take it only to
+ * reserve blocks and to commit.
+ */
+static void bench_threads()
+{
+    const int reads = 200000;
+    const int writes = 40000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = (cpus < 1) ? 1 : (cpus > THREAD_BENCH_MAX) ? THREAD_BENCH_MAX : (int)cpus;
+    char *data = calloc(1, THREAD_BENCH_FILE);
+    char name[MAX_FILENAME];
+
+    if (setup_image() != 0)
+    {
+        free(data);
+        return;
+    }
+    for (int t = 0; t < max_threads; t++)
+    {
+        snprintf(name, sizeof(name), "reader_%02d", t);
+        fs_create(name);
+        fs_write(name, data, THREAD_BENCH_FILE);
+    }
+
+    for (int threads = 1;; threads *= 2)
+    {
+        threads = (threads > max_threads) ? max_threads : threads;
+        double separate = time_parallel_calls(threads, 0, reads, 0);
+        double same = time_parallel_calls(threads, 1, reads, 0);
+        printf("threads: %2d readers, separate files %6.2f Mreads/s, same file %6.2f Mreads/s\n", threads, separate / 1e6,
+               same / 1e6);
+        if (threads == max_threads)
+        {
+            break;
+        }
+    }
+    for (int threads = 1;; threads *= 2)
+    {
+        threads = (threads > max_threads) ? max_threads : threads;
+        double overwrites = time_parallel_calls(threads, 0, writes, 1);
+        double rewrites = time_parallel_calls(threads, 0, writes / 8, 2);
+        printf("threads: %2d writers, 4KB fs_pwrite %6.3f Mwrites/s, 16KB fs_write %6.3f Mwrites/s\n", threads,
+               overwrites / 1e6, rewrites / 1e6);
+        if (threads == max_threads)
+        {
+            break;
+        }
+    }
+
+    fs_unmount();
+    free(data);
+}
+
+#define MIXED_BENCH_FILES 4
+
+typedef struct
+{
+    int seed;
+    int ops;
+    double *latencies; // ns per fs_pread, one slot per operation
+    int reads;
+} mixed_bench_job;
+
+static void *mixed_bench_worker(void *arg)
+{
+    mixed_bench_job *job = arg;
+    char buffer[BLOCK_SIZE];
+    char name[MAX_FILENAME];
+    unsigned int state = job->seed;
+    memset(buffer, job->seed, sizeof(buffer));
+    job->reads = 0;
+    for (int i = 0; i < job->ops; i++)
+    {
+        state = state * 1103515245 + 12345;
+        snprintf(name, sizeof(name), "mixed_%d", (state >> 8) % MIXED_BENCH_FILES);
+        long long offset = (long long)((state >> 16) % 12) * BLOCK_SIZE;
+        if ((state >> 24) % 20 == 0)
+        {
+            fs_pwrite(name, offset, buffer, BLOCK_SIZE); // 5% writes
+            continue;
+        }
+        double start = now_ns();
+        fs_pread(name, buffer, offset, BLOCK_SIZE);
+        job->latencies[job->reads++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Read latency under a 95/5 read/write mix
+ *
+ * Runs one thread per online CPU (at least two) against four shared 48KB
+ * files, each thread issuing 4KB fs_pread calls with one fs_pwrite in
+ * twenty, and prints the median and 99th percentile fs_pread latency.
+ * Reads only fall back to the locks when a write to their file overlaps.
+ */
+static void bench_mixed()
+{
+    const int ops = 200000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = (cpus < 2) ? 2 : (cpus > THREAD_BENCH_MAX) ? THREAD_BENCH_MAX : (int)cpus;
+    pthread_t ids[THREAD_BENCH_MAX];
+    mixed_bench_job jobs[THREAD_BENCH_MAX];
+    double *latencies = malloc(sizeof(double) * ops * threads);
+    char *data = calloc(1, THREAD_BENCH_FILE);
+    char name[MAX_FILENAME];
+
+    if (latencies == NULL || data == NULL || setup_image() != 0)
+    {
+        free(latencies);
+        free(data);
+        return;
+    }
+    for (int f = 0; f < MIXED_BENCH_FILES; f++)
+    {
+        snprintf(name, sizeof(name), "mixed_%d", f);
+        fs_create(name);
+        fs_write(name, data, THREAD_BENCH_FILE);
+    }
+
+    double start = now_ns();
+    for (int t = 0; t < threads; t++)
+    {
+        jobs[t].seed = t + 1;
+        jobs[t].ops = ops;
+        jobs[t].latencies = latencies + (size_t)t * ops;
+        pthread_create(&ids[t], NULL, mixed_bench_worker, &jobs[t]);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // Pack every thread's samples together, then sort for the percentiles
+    int samples = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        memmove(latencies + samples, jobs[t].latencies, sizeof(double) * jobs[t].reads);
+        samples += jobs[t].reads;
+    }
+    qsort(latencies, samples, sizeof(double), compare_doubles);
+    printf("mixed: %2d threads, 95%% pread / 5%% pwrite, %6.2f Mops/s, pread p50 %7.0f ns, p99 %7.0f ns\n", threads,
+           (double)threads * ops / seconds / 1e6, latencies[samples / 2], latencies[(int)(samples * 0.99)]);
+
+    fs_unmount();
+    free(latencies);
+    free(data);
+}
+
+/**
+ * @brief Fragmented-file I/O with one syscall per run vs. batched io_uring
+ *
+ * Builds a 1MB file whose 256 blocks are all non-adjacent (alternating
+ * appends with a second file), then times whole-file fs_read and in-place
+ * fs_pwrite with the cache off, first with preadv/pwritev per block and then
+ * with fs_set_io_uring(1). The gain grows with device queue depth; on a
+ * page-cached image it mostly reflects the saved syscalls.
+ */
+static void bench_ring()
+{
+    const int blocks = 256;
+    const int iterations = 200;
+    int size = blocks * BLOCK_SIZE;
+    char *data = malloc(size);
+    char block[BLOCK_SIZE];
+    fs_stats before, after;
+
+    if (setup_image() != 0)
+    {
+        free(data);
+        return;
+    }
+    memset(block, 'R', sizeof(block));
+    fs_create("scattered");
+    fs_create("filler");
+    for (int i = 0; i < blocks; i++)
+    {
+        fs_append("scattered", block, BLOCK_SIZE);
+        fs_append("filler", block, BLOCK_SIZE);
+    }
+    fs_set_cache_size(0);
+
+    for (int ring = 0; ring <= 1; ring++)
+    {
+        fs_set_io_uring(ring);
+        fs_get_stats(&before);
+        double read_ns = time_reads("scattered", data, size, iterations);
+        double start = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            fs_pwrite("scattered", 0, data, size);
+        }
+        double write_ns = (now_ns() - start) / iterations;
+        fs_get_stats(&after);
+
+        printf("ring: %s, 1MB in 256 runs, read %5.0f MB/s, pwrite %5.0f MB/s, %5.1f syscalls per call\n",
+               ring ? "io_uring      " : "preadv/pwritev", (double)size / (1024 * 1024) / (read_ns / 1e9),
+               (double)size / (1024 * 1024) / (write_ns / 1e9),
+               (double)(ring ? after.ring_submissions - before.ring_submissions
+                             : after.data_io_calls - before.data_io_calls) / (2 * iterations));
+    }
+
+    fs_set_io_uring(0);
+    fs_set_cache_size(256);
+    fs_unmount();
+    free(data);
+}
+
+static void count_completion(void *cookie, int result)
+{
+    (void)result;
+    (*(int *)cookie)++;
+}
+
+/**
+ * @brief Event-loop style asynchronous reads
+ *
+ * Keeps 64 fs_read_async calls on a 48KB file in flight from one thread,
+ * waiting on fs_completion_fd() with poll() and refilling from the
+ * callbacks' count, and compares the time the loop spends inside
+ * fs_read_async with the cost of the same fs_read done synchronously.
+ */
+static void bench_async()
+{
+    const int requests = 20000;
+    const int depth = 64;
+    char *data = calloc(1, THREAD_BENCH_FILE);
+    char *buffers = malloc((size_t)depth * THREAD_BENCH_FILE);
+
+    if (data == NULL || buffers == NULL || setup_image() != 0)
+    {
+        free(data);
+        free(buffers);
+        return;
+    }
+    fs_create("async");
+    fs_write("async", data, THREAD_BENCH_FILE);
+
+    double sync_ns = time_reads("async", data, THREAD_BENCH_FILE, requests);
+
+    struct pollfd pfd = {.fd = fs_completion_fd(), .events = POLLIN};
+    int submitted = 0;
+    int completed = 0;
+    double submit_ns = 0;
+    double start = now_ns();
+    while (completed < requests)
+    {
+        while (submitted < requests && submitted - completed < depth)
+        {
+            double before = now_ns();
+            fs_read_async("async", buffers + (size_t)(submitted % depth) * THREAD_BENCH_FILE, THREAD_BENCH_FILE,
+                          count_completion, &completed);
+            submit_ns += now_ns() - before;
+            submitted++;
+        }
+        poll(&pfd, 1, -1);
+        fs_poll_completions(depth);
+    }
+    double total_ns = now_ns() - start;
+
+    printf("async: 48KB fs_read %6.2f us blocking, fs_read_async %5.2f us to submit, %6.0f reads/s at depth %d\n",
+           sync_ns / 1000, submit_ns / requests / 1000, requests / (total_ns / 1e9), depth);
+
+    fs_unmount();
+    free(data);
+    free(buffers);
+}
+
+#define BATCH_BENCH_FILES 32
+
+/**
+ * @brief Many small files created, written and deleted with and without fs_batch
+ *
+ * Each round creates 32 files, writes 8KB to each and deletes them again,
+ * first with one call per operation and then as two fs_batch calls (the
+ * creates and writes, then the deletes). Reports time, journal commits and
+ * data requests per round.
+ */
+static void bench_batch()
+{
+    const int rounds = 2000;
+    static char data[2 * BLOCK_SIZE];
+    char names[BATCH_BENCH_FILES][MAX_FILENAME];
+    fs_op ops[2 * BATCH_BENCH_FILES];
+    fs_stats before, after;
+
+    for (int f = 0; f < BATCH_BENCH_FILES; f++)
+    {
+        snprintf(names[f], sizeof(names[f]), "batched_%02d", f);
+    }
+    memset(data, 'B', sizeof(data));
+
+    for (int batched = 0; batched <= 1; batched++)
+    {
+        if (setup_image() != 0)
+        {
+            return;
+        }
+        fs_get_stats(&before);
+        double start = now_ns();
+        for (int r = 0; r < rounds; r++)
+        {
+            if (!batched)
+            {
+                for (int f = 0; f < BATCH_BENCH_FILES; f++)
+                {
+                    fs_create(names[f]);
+                    fs_write(names[f], data, sizeof(data));
+                }
+                for (int f = 0; f < BATCH_BENCH_FILES; f++)
+                {
+                    fs_delete(names[f]);
+                }
+                continue;
+            }
+
+            for (int f = 0; f < BATCH_BENCH_FILES; f++)
+            {
+                ops[2 * f] = (fs_op){.type = FS_OP_CREATE, .filename = names[f]};
+                ops[2 * f + 1] = (fs_op){.type = FS_OP_WRITE, .filename = names[f], .data = data, .size = sizeof(data)};
+            }
+            fs_batch(ops, 2 * BATCH_BENCH_FILES);
+            for (int f = 0; f < BATCH_BENCH_FILES; f++)
+            {
+                ops[f] = (fs_op){.type = FS_OP_DELETE, .filename = names[f]};
+            }
+            fs_batch(ops, BATCH_BENCH_FILES);
+        }
+        double round_us = (now_ns() - start) / rounds / 1000;
+        fs_get_stats(&after);
+
+        printf("batch: %s, 32 x (create, 8KB write, delete) %7.1f us/round, %5.1f commits, %5.1f data requests\n",
+               batched ? "fs_batch     " : "one call each", round_us,
+               (double)(after.journal_commits - before.journal_commits) / rounds,
+               (double)(after.data_io_calls - before.data_io_calls) / rounds);
+        fs_unmount();
+    }
+}
+
+#define TXN_BENCH_FILES 4
+
+/**
+ * @brief A multi-file update with and without a transaction around it
+ *
+ * Each round replaces a record spread over four files: a temporary file is
+ * created and written for each, the old file deleted and the new one
+ * created and written under its name. This runs as separate calls, inside
+ * fs_txn_begin/fs_txn_commit, and inside a transaction that is aborted.
+ * Reports time and journal commits per round.
+ */
+static void bench_txn()
+{
+    const int rounds = 2000;
+    static char data[BLOCK_SIZE];
+    char names[TXN_BENCH_FILES][MAX_FILENAME];
+    char temps[TXN_BENCH_FILES][MAX_FILENAME];
+    const char *modes[] = {"separate calls  ", "fs_txn_commit   ", "fs_txn_abort    "};
+    fs_stats before, after;
+
+    for (int f = 0; f < TXN_BENCH_FILES; f++)
+    {
+        snprintf(names[f], sizeof(names[f]), "record_%d", f);
+        snprintf(temps[f], sizeof(temps[f]), "record_%d.tmp", f);
+    }
+    memset(data, 'T', sizeof(data));
+
+    for (int mode = 0; mode < 3; mode++)
+    {
+        if (setup_image() != 0)
+        {
+            return;
+        }
+        for (int f = 0; f < TXN_BENCH_FILES; f++)
+        {
+            fs_create(names[f]);
+            fs_write(names[f], data, sizeof(data));
+        }
+        fs_get_stats(&before);
+        double start = now_ns();
+        for (int r = 0; r < rounds; r++)
+        {
+            if (mode > 0)
+            {
+                fs_txn_begin();
+            }
+            for (int f = 0; f < TXN_BENCH_FILES; f++)
+            {
+                fs_create(temps[f]);
+                fs_write(temps[f], data, sizeof(data));
+                fs_delete(names[f]);
+                fs_create(names[f]);
+                fs_write(names[f], data, sizeof(data));
+                fs_delete(temps[f]);
+            }
+            if (mode == 1)
+            {
+                fs_txn_commit();
+            }
+            else if (mode == 2)
+            {
+                fs_txn_abort();
+            }
+        }
+        double round_us = (now_ns() - start) / rounds / 1000;
+        fs_get_stats(&after);
+
+        printf("txn: %s 4-file update %7.1f us/round, %5.1f commits\n", modes[mode], round_us,
+               (double)(after.journal_commits - before.journal_commits) / rounds);
+        fs_unmount();
+    }
+}
+
+/**
+ * @brief Operation throughput against how much a power failure can lose
+ *
+ * Runs the same stream of small file rewrites in each durability mode and
+ * reports calls per second, journal commits and fdatasync calls, and the
+ * most calls a crash could lose. Lazy mode includes the closing fs_sync.
+ */
+static void bench_durability()
+{
+    const int operations = 4000;
+    const int files = 16;
+    char data[512];
+    char name[MAX_FILENAME];
+    fs_stats before, after;
+    struct
+    {
+        const char *label;
+        int mode;
+        int operations;
+        int milliseconds;
+        const char *at_risk;
+    } modes[] = {
+        {"none (default)   ", FS_DURABILITY_NONE, 0, 0, "what the kernel has not written"},
+        {"strict           ", FS_DURABILITY_STRICT, 0, 0, "0 calls"},
+        {"periodic, 64 ops ", FS_DURABILITY_PERIODIC, 64, 0, "63 calls"},
+        {"periodic, 10 ms  ", FS_DURABILITY_PERIODIC, 0, 10, "10 ms"},
+        {"lazy + fs_sync   ", FS_DURABILITY_LAZY, 0, 0, "all since fs_sync"},
+    };
+    memset(data, 'D', sizeof(data));
+
+    for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++)
+    {
+        if (setup_image() != 0)
+        {
+            return;
+        }
+        for (int f = 0; f < files; f++)
+        {
+            snprintf(name, sizeof(name), "durable_%02d", f);
+            fs_create(name);
+        }
+        fs_set_durability(modes[m].mode, modes[m].operations, modes[m].milliseconds);
+        fs_get_stats(&before);
+        double start = now_ns();
+        for (int i = 0; i < operations; i++)
+        {
+            snprintf(name, sizeof(name), "durable_%02d", i % files);
+            fs_write(name, data, sizeof(data));
+        }
+        if (modes[m].mode == FS_DURABILITY_LAZY)
+        {
+            fs_sync();
+        }
+        double elapsed_ns = now_ns() - start;
+        fs_get_stats(&after);
+
+        printf("durability: %s %9.0f writes/s, %5lld commits, %5lld flushes, crash loses %s\n", modes[m].label,
+               operations / (elapsed_ns / 1e9), after.journal_commits - before.journal_commits,
+               after.flushes - before.flushes, modes[m].at_risk);
+        fs_set_durability(FS_DURABILITY_NONE, 0, 0);
+        fs_unmount();
+    }
+}
+
+typedef struct
+{
+    const char *name;
+    void (*run)();
+} benchmark;
+
+static const benchmark benchmarks[] = {
+    {"lookup", bench_lookup},
+    {"alloc", bench_alloc},
+    {"metadata", bench_metadata},
+    {"journal", bench_journal},
+    {"io", bench_io},
+    {"mmap", bench_mmap},
+    {"cache", bench_cache},
+    {"pwrite", bench_pwrite},
+    {"pread", bench_pread},
+    {"append", bench_append},
+    {"indirect", bench_indirect},
+    {"extents", bench_extents},
+    {"churn", bench_churn},
+    {"geometry", bench_geometry},
+    {"scale", bench_scale},
+    {"threads", bench_threads},
+    {"mixed", bench_mixed},
+    {"ring", bench_ring},
+    {"async", bench_async},
+    {"batch", bench_batch},
+    {"txn", bench_txn},
+    {"durability", bench_durability},
+};
+
+int main(int argc, char *argv[])
+{
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+    for (int i = 0; i < count; i++)
+    {
+        int selected = (argc == 1);
+        for (int j = 1; j < argc; j++)
+        {
+            if (strcmp(argv[j], benchmarks[i].name) == 0)
+            {
+                selected = 1;
+            }
+        }
+        if (selected)
+        {
+            benchmarks[i].run();
+        }
+    }
+
+    unlink(BENCH_IMAGE);
+    return 0;
+}
@@ -0,0 +1 @@
+gcc -O2 fs.c bench.c -o fs_bench -pthread && ./fs_bench "$@"
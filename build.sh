@@ -1 +1 @@
-gcc fs.c main.c -o fs_main
+gcc fs.c main.c -o fs_main -pthread
@@ -1,656 +1,5450 @@
+#define _GNU_SOURCE // For PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // linux/fs.h's 1KB unit, pulled in above; fs.h defines ours
 #include "fs.h"
+#include <endian.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_INODE_COUNT 65536
+#define MAX_BLOCK_COUNT (1 << 30) // Block numbers are int; the cap leaves headroom for run arithmetic
+#define INODE_SLOT_BYTES 128       // Inode table space reserved per inode (2560 x 4KB default: blocks 2-9)
+#define BLOCKS_PER_BITMAP_BLOCK(c) ((c)->geo.block_size * 8)
+#define BITMAP_BYTES(c) ((c)->geo.bitmap_blocks * (c)->geo.block_size)
+#define INODE_TABLE_START(c) ((c)->geo.inode_start) // Inode table follows the bitmap
+#define INODE_TABLE_OFFSET(c) (INODE_TABLE_START(c) * (c)->geo.block_size)
+#define MIN_JOURNAL_BYTES 65536    // Journal region size unless two worst-case transactions need more
+#define JOURNAL_TXN_BUDGET (1 << 20) // Largest transaction kept in the journal; see spill_records
+#define NAME_INDEX_SIZE(c) ((c)->geo.name_index_size) // Power of two, kept at most half full so probe chains stay short
+#define INODE_TABLE_BYTES(c) ((int)sizeof(inode) * (c)->geo.total_inodes)
+#define INODE_TABLE_BLOCKS(c) ((INODE_TABLE_BYTES(c) + (c)->geo.block_size - 1) / (c)->geo.block_size)
+#define JOURNAL_START(c) ((c)->geo.journal_start) // Journal region follows the inode table
+#define JOURNAL_BLOCKS(c) ((c)->geo.journal_blocks)
+#define JOURNAL_BYTES(c) (JOURNAL_BLOCKS(c) * (c)->geo.block_size)
+#define DATA_START(c) (JOURNAL_START(c) + JOURNAL_BLOCKS(c)) // First block handed out to files
+#define IMAGE_BYTES(c) ((off_t)(c)->geo.total_blocks * (c)->geo.block_size)
+#define MAX_FILE_SIZE(c) ((long long)MAX_BLOCK_COUNT * (c)->geo.block_size) // No file outgrows the largest image
+#define DEFAULT_CACHE_BLOCKS 256 // Cached data blocks (1MB with 4KB blocks) unless fs_set_cache_size says otherwise
+#define INDIRECT_CACHE_BLOCKS 64 // Pointer blocks kept in memory; one covers 4MB of file data with 4KB blocks
+#define POINTERS_PER_BLOCK(c) ((c)->geo.block_size / (int)sizeof(int))
+#define TRANSFER_BATCH 256 // Block segments mapped and moved per disk_transfer call (1MB with 4KB blocks)
+#define MAX_EXTENTS (MAX_DIRECT_BLOCKS / 2) // (start, length) pairs that fit in inode.blocks
+#define SUMMARY_LEVELS 3 // Free-space summary over groups of 64, 4096 and 262144 blocks
+#define JOURNAL_MAGIC 0x4A524E4Cu                  // "JRNL"
+#define IO_RING_ENTRIES 64 // Requests in flight per io_uring submission
+#define ASYNC_WORKERS 4     // Threads serving fs_read_async and fs_write_async, shared by all contexts
+
+// Counters are updated atomically: readers bump them in parallel, and fs_get_stats
+// reads them without waiting for alloc_lock
+#define STAT_ADD(c, counter, amount) __atomic_fetch_add(&(c)->stats.counter, (amount), __ATOMIC_RELAXED)
+
+// In-memory cache of block contents with CLOCK eviction. Slots are found through
+// an open-addressing hash from block number to slot, like the name index.
+// Lookups take no lock (see cache_read); changes hold cache_lock exclusive and
+// make the slot's sequence odd while they refill or empty it, so a lookup that
+// copied from the slot meanwhile knows to discard the copy.
+typedef struct block_cache
+{
+    int capacity;                // Number of slots, 0 when disabled
+    int *slot_block;             // Block held by each slot, -1 if empty
+    int *slot_length;            // Valid bytes in each slot (a file's last block may be partial)
+    unsigned int *slot_seq;      // Per slot: odd while the slot changes
+    char *referenced;            // CLOCK reference bit per slot
+    char *data;                  // capacity * geo.block_size bytes
+    int *index;                  // Block number -> slot + 1, 0 marks an empty entry
+    int index_size;              // Power of two, at least twice the capacity
+    int hand;                    // CLOCK hand
+    unsigned int generation;     // Odd while cache_init swaps in new arrays
+    int readers;                 // Lookups running in cache_read
+    struct block_cache *retired; // Arrays swapped out while lookups were running, which they may still read
+} block_cache;
+
+// Sizes and layout of the image, read from the superblock at mount. Block 0 holds
+// the superblock, then come the bitmap, the inode table and the journal.
+typedef struct
+{
+    int block_size;
+    int total_blocks;
+    int total_inodes;
+    int bitmap_blocks;   // Blocks 1.. hold the bitmap
+    int inode_start;     // First inode-table block
+    int journal_start;   // First journal block
+    int journal_blocks;
+    int name_index_size;
+    int journal_max_txn; // See JOURNAL_MAX_TXN(c)
+} geometry;
+
+// Bitmap bytes [lo, hi) changed within one bitmap block, empty when lo >= hi. Tracking
+// each bitmap block separately keeps far-apart changes from spanning the bytes between.
+typedef struct
+{
+    int lo;
+    int hi;
+} dirty_range;
+
+// One positional transfer in a batch for disk_batch_io
+typedef struct
+{
+    off_t offset;
+    struct iovec *iov;
+    int iovcnt;
+    int length; // Sum of the iovec lengths
+    int moved;  // Set by disk_batch_io: bytes transferred, or -1 on error
+} disk_request;
+
+// A thread's io_uring instance, set up with raw syscalls on first use. Rings are
+// per thread rather than per context: submissions name the image's descriptor, so
+// one ring serves every context the thread works on, and no lock guards it.
+typedef struct
+{
+    int fd; // -1 until set up, -2 if io_uring is unavailable
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int entries;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring; // Same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} io_ring;
+
+// A queued fs_read_async or fs_write_async call
+typedef struct async_request
+{
+    fs_ctx *ctx; // Context the request runs on
+    int writing;
+    char filename[MAX_FILENAME + 1];
+    void *buffer;
+    int size;
+    int result; // What fs_read or fs_write returned, set by the worker
+    fs_completion callback;
+    void *cookie;
+    struct async_request *next;
+} async_request;
+
+// Worker threads and the queue behind the asynchronous calls of every context.
+// Workers are started on the first request in the process and then wait for
+// more, so contexts that never submit one cost no threads.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // Signalled when a request is queued
+    async_request *pending;  // Waiting for a worker, oldest first
+    async_request *pending_tail;
+    int workers;             // Threads running
+} async_pool;
+
+// A context's side of the asynchronous calls: its finished requests and the
+// descriptor that announces them
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t idle;     // Signalled when the last of the context's requests finishes
+    async_request *done;     // Finished, waiting for fs_poll_completions, oldest first
+    async_request *done_tail;
+    int event_fd;            // Counts finished requests not yet collected, -1 until first needed
+    int in_flight;           // Queued or running, not finished yet
+} async_completions;
+
+// Background thread of FS_DURABILITY_PERIODIC: commits and flushes the changes of
+// the last 'milliseconds' if any are waiting. Started by fs_mount or fs_set_durability.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     // Signalled to stop the thread early
+    int running;
+    int stopping;
+    pthread_t thread;
+} flusher;
+
+// One block's share of a data transfer; see disk_transfer
+typedef struct
+{
+    int block;    // Physical block number
+    int offset;   // Byte offset within the block, 0 unless the transfer starts mid-block
+    void *buffer; // Memory holding (or receiving) this block's bytes
+    int length;   // Bytes to transfer
+} block_segment;
+
+// A journal transaction is a header followed by records, each a journal_record
+// and the bytes it carries. Records hold full-image byte offsets, so replaying
+// one is a plain copy over the superblock, bitmap or inode table.
+typedef struct
+{
+    unsigned int magic;
+    int sequence;     // Transactions replay in order starting at sb.journal_seq
+    int length;       // Bytes of records after the header
+    int record_count;
+    uint64_t checksum; // FNV-1a over the records
+} journal_header;
+
+typedef struct
+{
+    int offset; // Byte offset of the metadata on the image, or JOURNAL_SPILL
+    int length;
+} journal_record;
+
+// A transaction too big for the journal is written to free data blocks, and the
+// journal holds a single record with this offset: a spill_header and its runs.
+#define JOURNAL_SPILL -1
+
+typedef struct
+{
+    int length;        // Bytes of records spilled
+    int record_count;
+    int run_count;     // (first block, block count) int pairs that follow
+    uint64_t checksum; // FNV-1a over the spilled records
+} spill_header;
+
+// Upper bound on one transaction in the journal: all metadata, with a record per
+// inode at worst, or JOURNAL_TXN_BUDGET if that is smaller
+#define JOURNAL_MAX_TXN(c) ((c)->geo.journal_max_txn)
+
+// Sequence values an unlocked read started from; it is valid if neither changed
+typedef struct
+{
+    unsigned int names;             // names_seq at the start
+    const unsigned int *inode_seq; // Sequence counter of the file read, NULL if it was not found
+    unsigned int inode;
+} read_guard;
+
+// Undo records of an open transaction: an inode or a block's bitmap bit as it was before a change
+typedef struct
+{
+    int index;
+    inode before;
+} inode_undo;
+
+typedef struct
+{
+    int block;
+    int was_used;
+} block_undo;
+
+// State of fs_txn_begin .. fs_txn_commit / fs_txn_abort. Changes are logged as they
+// are made, so an abort replays the log backwards instead of copying all metadata.
+typedef struct
+{
+    int active;              // Set and cleared atomically, so other threads can test it without alloc_lock
+    pthread_t owner;         // Thread that called fs_txn_begin
+    superblock sb;           // As at fs_txn_begin; covers free_blocks and free_inodes
+    int alloc_cursor;
+    inode_undo *inodes;      // Every write_inode, oldest first
+    int inode_count;
+    int inode_capacity;
+    block_undo *blocks;      // Every bitmap bit flipped, oldest first
+    int block_count;
+    int block_capacity;
+    int incomplete;          // A record could not be stored, so the log cannot undo everything
+} transaction;
+
+// Everything one mounted image needs. Every helper takes the context it works
+// on; the fs_* calls without a context use default_context.
+struct fs_ctx
+{
+    geometry geo;                            // Layout of the formatted or mounted image
+    inode *inode_table;                      // Metadata arrays below are sized by geometry_init
+    superblock sb;
+    char *bitmap;                            // Bit i set when block i is in use
+    int disk_fd;                             // File descriptor for the disk image, -1 when not mounted
+    char *disk_map;                          // Whole image when mounted with fs_mount_mmap, NULL otherwise
+    dev_t image_dev;                         // File of the mounted image, so fs_format can refuse it
+    ino_t image_ino;
+    struct fs_ctx *next_mounted;             // Next context in mounted_images
+    int *name_index;                         // Open-addressing hash from filename to inode number + 1, 0 marks an empty slot
+    int alloc_cursor;                        // Next-fit hint: block after the last one allocated
+    int sb_dirty;                            // Superblock changed since the last checkpoint
+    dirty_range *bitmap_dirty;               // Per bitmap block, the bytes changed since the last checkpoint
+    char *inode_blocks_dirty;                // Inode-table blocks changed since the last checkpoint
+    dirty_range *journal_bitmap_dirty;       // Per bitmap block, the bytes changed since the last journal commit
+    char *journal_inode_dirty;               // Inodes changed since the last journal commit
+    int journal_head;                        // Byte offset in the journal region for the next transaction
+    int journal_sequence;                    // Sequence number of the next transaction
+    int commit_interval;                     // Operations grouped into one journal commit
+    int ops_since_commit;
+    char *pending_free;                      // Blocks freed since the last commit, not reusable until it lands
+    int pending_free_count;
+    char *reserved_map;                      // Blocks set aside by writers still moving data outside alloc_lock
+    int reserved_blocks;                     // Free blocks promised to those writers, pointer blocks included
+    char *journal_buffer;                    // Staging area for the transaction being committed
+    int journal_pending_bytes;               // Upper bound on the records the next commit writes
+    char *spill_map;                         // Blocks holding a spilled transaction until a checkpoint, else NULL
+    uint64_t *free_summary[SUMMARY_LEVELS];  // Level k bit i set when group i of 64^(k+1) blocks has an allocatable block
+    int *free_summary_count[SUMMARY_LEVELS]; // Allocatable blocks per group, from level 1 (level 0 is a popcount)
+    block_cache data_cache;
+    block_cache indirect_cache;              // Indirect and double-indirect pointer blocks
+    int data_cache_blocks;                   // Capacity used at the next mount
+    int extent_mapping;                      // New files and whole-file writes use extents
+    int io_uring;                            // Batches of transfers go through the thread's io_uring
+    int in_batch;                            // fs_batch is applying operations; they share its one metadata sync
+    int durability;                          // FS_DURABILITY_*, kept across mounts
+    int flush_operations;                    // FS_DURABILITY_PERIODIC: commit after this many operations, 0 for never
+    int flush_milliseconds;                  // FS_DURABILITY_PERIODIC: commit this often, 0 for never
+    int data_unflushed;                      // Data, pointer or spill blocks written since the last flush
+    transaction txn;                         // Open fs_txn_begin transaction, if any; it holds txn_gate and alloc_lock throughout
+    fs_stats stats;
+
+    // Locking: locks are taken in the order txn_gate, names_lock, inode lock,
+    // alloc_lock, cache_lock. fs_read_zerocopy, and fs_read and fs_pread when the
+    // unlocked attempt below fails, hold names_lock shared and the file's inode lock
+    // shared. Every call that changes files holds txn_gate shared, unless its thread
+    // owns the transaction. fs_create and fs_delete then hold names_lock exclusive and
+    // alloc_lock throughout. fs_write, fs_pwrite and fs_append hold names_lock shared
+    // and the file's inode lock exclusive throughout, but alloc_lock only while they
+    // reserve blocks and while they map them and commit: the data moves in between
+    // without it. Reserved blocks stay free in the bitmap, so a journal commit never
+    // sees half an operation. alloc_lock is recursive so that a transaction's thread
+    // keeps it from fs_txn_begin to the end while its own calls take it again; they
+    // take names_lock and inode locks out of order, which is safe only because
+    // txn_gate keeps out every other thread that might wait for alloc_lock holding
+    // one. Changes to both caches take cache_lock exclusive; lookups take no lock.
+    pthread_rwlock_t txn_gate;      // Exclusive while a transaction is open
+    pthread_mutex_t alloc_lock;     // Bitmap, allocator, superblock, inode table updates and journal
+    pthread_rwlock_t names_lock;    // Name index and the used/name fields of inodes
+    pthread_rwlock_t cache_lock;    // Changes to data_cache and indirect_cache
+    pthread_rwlock_t *inode_locks;  // Per inode: shared while the file is read, exclusive while written
+
+    // fs_read and fs_pread first try without any lock: they note these counters, read,
+    // and keep the result only if neither moved (seqlock). Writers make a counter odd
+    // for as long as they change what it covers. Failed attempts fall back to the locks.
+    unsigned int names_seq;   // Odd while fs_create or fs_delete runs
+    unsigned int *inode_seq;  // Per inode: odd while the file is written
+
+    async_completions async;  // Has its own lock, never held while calling into the filesystem
+    flusher flusher;          // Has its own lock, never held while calling into the filesystem
+};
 
 // Global viriables
-inode inode_table[MAX_FILES];
-superblock sb;
-char bitmap[BLOCK_SIZE] = {0}; // Initialize block bitmap to all zeros
-int disk_fd = -1;              // File descriptor for the disk image, initialized to -1 (invalid)
+#define CONTEXT_DEFAULTS                                                                                   \
+    {.disk_fd = -1, .commit_interval = 1, .data_cache_blocks = DEFAULT_CACHE_BLOCKS, .extent_mapping = 1,     \
+     .txn_gate = PTHREAD_RWLOCK_INITIALIZER, .alloc_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,             \
+     .names_lock = PTHREAD_RWLOCK_INITIALIZER, .cache_lock = PTHREAD_RWLOCK_INITIALIZER,                      \
+     .async = {.lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER, .event_fd = -1},            \
+     .flusher = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER}}
+static fs_ctx default_context = CONTEXT_DEFAULTS;         // Used by the fs_* calls that take no context
+static fs_ctx *mounted_images = NULL;                    // Every mounted context, linked by next_mounted
+static pthread_mutex_t mounted_lock = PTHREAD_MUTEX_INITIALIZER; // Guards mounted_images
+static __thread const read_guard *unlocked_read = NULL;  // Set while this thread reads without locks
+static __thread io_ring thread_ring = {.fd = -1};        // See io_ring
+static pthread_key_t ring_key;                           // Its destructor closes a thread's ring at thread exit
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
 // End of global variables
 
 // Helper functions
 
-int validate_string_manual(const char *str)
-{
-    if (str == NULL)
-        return -1;
-
-    for (int i = 0; i < 28; i++)
-    {
-        if (str[i] == '\0')
-        {
-            return 0; // Found null terminator within 28 chars
-        }
-    }
+// Block I/O: every access to the image goes through these helpers, using positional
+// I/O so no call depends on (or moves) the shared file offset. When the image is
+// memory-mapped they copy to and from the mapping instead of making syscalls.
 
-    // Check if 28th position is null terminator
-    if (str[28] == '\0')
+int map_copy(fs_ctx *c, int writing, off_t offset, void *buffer, int length)
+{
+    // Same contract as disk_read/disk_write, served from the mapping
+    if (offset >= IMAGE_BYTES(c))
     {
         return 0;
     }
-    return -1;
-}
-
-int find_inode(const char *filename)
-{
-    if (filename == NULL)
+    if (length > IMAGE_BYTES(c) - offset)
     {
-        return -1;
+        length = IMAGE_BYTES(c) - offset;
     }
 
-    int filename_len = strlen(filename);
-    if (filename_len > MAX_FILENAME)
+    if (writing)
     {
-        return -1; // Filename too long
+        memcpy(c->disk_map + offset, buffer, length);
     }
-
-    for (int i = 0; i < MAX_FILES; i++)
+    else
     {
-        if (inode_table[i].used == 1)
-        {
-            // Compare manually
-            int match = 1;
-            for (int j = 0; j < filename_len; j++)
-            {
-                if (inode_table[i].name[j] != filename[j])
-                {
-                    match = 0;
-                    break;
-                }
-            }
-            // Check remaining bytes are zero
-            if (match)
-            {
-                for (int j = filename_len; j < MAX_FILENAME; j++)
-                {
-                    if (inode_table[i].name[j] != 0)
-                    {
-                        match = 0;
-                        break;
-                    }
-                }
-            }
-            if (match)
-                return i;
-        }
+        memcpy(buffer, c->disk_map + offset, length);
     }
-    return -1;
+    return length;
 }
 
-int find_free_inode()
+int disk_read(fs_ctx *c, off_t offset, void *buffer, int length)
 {
-    if (sb.free_inodes == 0)
+    // Returns the bytes read, short only at the end of the image, or -1 on error
+    if (c->disk_map != NULL)
     {
-        return -2; // No free inodes available
+        return map_copy(c, 0, offset, buffer, length);
     }
-    for (int i = 0; i < MAX_FILES; i++)
+
+    int total = 0;
+    while (total < length)
     {
-        if (inode_table[i].used == 0)
+        ssize_t n = pread(c->disk_fd, (char *)buffer + total, length - total, offset + total);
+        if (n < 0)
         {
-            return i;
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
         }
+        total += n;
     }
-    return -2; // No free inodes available
+    return total;
 }
 
-int find_free_block()
+int disk_vector_io(fs_ctx *c, int writing, off_t offset, struct iovec *iov, int iovcnt)
 {
-    for (int i = 0; i < MAX_BLOCKS; i++)
+    // preadv/pwritev with retry of short transfers; returns bytes moved or -1 on error
+    int total = 0;
+
+    if (c->disk_map != NULL)
     {
-        if (!(bitmap[i / 8] & (1 << (i % 8))))
+        for (int i = 0; i < iovcnt; i++)
         {
-            return i;
+            int moved = map_copy(c, writing, offset + total, iov[i].iov_base, iov[i].iov_len);
+            total += moved;
+            if (moved < (int)iov[i].iov_len)
+            {
+                break;
+            }
         }
+        return total;
     }
-    return -1; // No free blocks available
-}
 
-void mark_block_used(int block_index)
-{
-    if (block_index >= 0 && block_index < MAX_BLOCKS)
+    while (iovcnt > 0)
     {
-        // Check if block is actually free before marking it used
-        if (!(bitmap[block_index / 8] & (1 << (block_index % 8))))
+        ssize_t n = writing ? pwritev(c->disk_fd, iov, iovcnt, offset + total) : preadv(c->disk_fd, iov, iovcnt, offset + total);
+        if (n < 0)
         {
-            bitmap[block_index / 8] |= (1 << (block_index % 8));
-            sb.free_blocks--;
+            return -1;
         }
-    }
-}
+        if (n == 0)
+        {
+            break; // End of image on read, device full on write
+        }
+        total += n;
 
-void mark_block_free(int block_index)
-{
-    if (block_index >= 0 && block_index < MAX_BLOCKS)
-    {
-        // Check if block is actually used before marking it free
-        if (bitmap[block_index / 8] & (1 << (block_index % 8)))
+        // Skip the iovecs already transferred and trim a partially transferred one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
         {
-            bitmap[block_index / 8] &= ~(1 << (block_index % 8));
-            sb.free_blocks++;
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
     }
+    return total;
 }
 
-void read_inode(int inode_num, inode *target)
+void close_ring(void *arg)
 {
-    if (inode_num < 0 || inode_num >= MAX_FILES || target == NULL)
+    io_ring *ring = arg;
+    if (ring->sqes != NULL)
     {
-        return; // Invalid parameters
+        munmap(ring->sqes, ring->sqes_size);
     }
-
-    if (inode_table[inode_num].used == 0)
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
     {
-        return; // Inode is not used
+        munmap(ring->cq_ring, ring->cq_ring_size);
     }
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -2;
+}
 
-    *target = inode_table[inode_num];
+void create_ring_key()
+{
+    pthread_key_create(&ring_key, close_ring);
 }
 
-void write_inode(int inode_num, const inode *source)
+io_ring *thread_io_ring()
 {
-    if (inode_num < 0 || inode_num >= MAX_FILES || source == NULL)
+    // The calling thread's ring, set up on first use; NULL if the kernel refuses io_uring
+    io_ring *ring = &thread_ring;
+    if (ring->fd != -1)
     {
-        return;
+        return (ring->fd >= 0) ? ring : NULL;
     }
 
-    int was_used = inode_table[inode_num].used;
-    inode_table[inode_num] = *source;
-
-    // Handle allocation
-    if (was_used == 0 && source->used == 1)
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring->fd < 0)
     {
-        sb.free_inodes--; // Allocating a free inode
+        ring->fd = -2;
+        return NULL;
     }
-    // Handle deallocation
-    else if (was_used == 1 && source->used == 0)
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
     {
-        sb.free_inodes++; // Freeing a used inode
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
     }
-}
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
 
-int calculate_blocks_needed(int size)
-{
-    if (size <= 0)
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
     {
-        return 0; // No blocks needed for zero or negative size
+        ring->sq_ring = (ring->sq_ring == MAP_FAILED) ? NULL : ring->sq_ring;
+        ring->cq_ring = (ring->cq_ring == MAP_FAILED) ? NULL : ring->cq_ring;
+        ring->sqes = (ring->sqes == MAP_FAILED) ? NULL : ring->sqes;
+        close_ring(ring);
+        return NULL;
     }
-    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE; // Calculate number of blocks needed
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+    return ring;
 }
 
-void sync_metadata_to_disk()
+int ring_transfer(fs_ctx *c, io_ring *ring, int writing, disk_request *requests, int count)
 {
-
-    if (disk_fd < 0)
+    // Submits up to ring->entries requests at once and waits for all of them.
+    // Returns 0, or -1 if the ring failed; requests it did not complete keep moved = -1.
+    // Never returns while the kernel may still use the requests' buffers.
+    int requested = count;
+    unsigned int tail = *ring->sq_tail;
+    for (int i = 0; i < count; i++)
     {
-        return;
+        unsigned int index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = c->disk_fd;
+        sqe->off = requests[i].offset;
+        sqe->addr = (uintptr_t)requests[i].iov;
+        sqe->len = requests[i].iovcnt;
+        sqe->user_data = i;
+        ring->sq_array[index] = index;
+        requests[i].moved = -1;
+        tail++;
     }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
 
-    // Write superblock
-    lseek(disk_fd, 0, SEEK_SET);
-    int sb_written = write(disk_fd, &sb, sizeof(superblock));
-
-    // Write bitmap
-    lseek(disk_fd, BLOCK_SIZE, SEEK_SET);
-    int bitmap_written = write(disk_fd, bitmap, sizeof(bitmap));
+    int submitted = 0;
+    int completed = 0;
+    while (completed < submitted || submitted < count)
+    {
+        // Submit what is left and wait for at least one completion
+        int result = syscall(__NR_io_uring_enter, ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result < 0 && errno != EINTR && errno != EAGAIN)
+        {
+            if (submitted < count)
+            {
+                // Withdraw the entries the kernel has not taken and finish the ones it has
+                __atomic_store_n(ring->sq_tail, tail - (count - submitted), __ATOMIC_RELEASE);
+                tail -= count - submitted;
+                count = submitted;
+                continue;
+            }
+            // Waiting in the kernel failed, but the submitted requests still read or write
+            // the caller's buffers: poll the completion queue until they all finish. The
+            // yield also lets the kernel run completion work queued for this thread.
+            sched_yield();
+        }
+        submitted += (result > 0) ? result : 0;
 
-    // Write inode table
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET);
-    int inode_written = write(disk_fd, inode_table, sizeof(inode_table));
+        unsigned int head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < (uint64_t)count)
+            {
+                requests[cqe->user_data].moved = (cqe->res < 0) ? -1 : cqe->res;
+                completed++;
+            }
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return (completed == requested) ? 0 : -1;
 }
 
-// End of helper functions
-
-int fs_format(const char *disk_path)
+int disk_batch_io(fs_ctx *c, int writing, disk_request *requests, int count)
 {
+    // Runs independent transfers, as io_uring submissions when the context enables it
+    // and there is more than one, otherwise one preadv/pwritev each. Sets each
+    // request's moved field; returns 0, or -1 if any request failed.
+    io_ring *ring = (__atomic_load_n(&c->io_uring, __ATOMIC_RELAXED) && count > 1 && c->disk_map == NULL) ? thread_io_ring() : NULL;
+    int done = 0;
 
-    if (disk_path == NULL || strlen(disk_path) == 0 || disk_fd != -1)
+    while (ring != NULL && done < count)
     {
-        return -1; // Error: null path
+        int batch = (count - done > (int)ring->entries) ? (int)ring->entries : count - done;
+        if (ring_transfer(c, ring, writing, requests + done, batch) != 0)
+        {
+            break;
+        }
+        STAT_ADD(c, ring_submissions, 1);
+        done += batch;
     }
 
-    // Open the disk image file for writing
-    disk_fd = open(disk_path, O_RDWR | O_CREAT, 0644); // rw-r--r-- permissions
-    if (disk_fd < 0)
+    int result = 0;
+    for (int i = 0; i < count; i++)
     {
-        return -1;
+        // Short or failed ring transfers are redone with syscalls, which retry short transfers
+        // and stop at the end of the image; repeating the whole request is harmless
+        if (i >= done || requests[i].moved != requests[i].length)
+        {
+            requests[i].moved = disk_vector_io(c, writing, requests[i].offset, requests[i].iov, requests[i].iovcnt);
+        }
+        result = (requests[i].moved < 0) ? -1 : result;
     }
-    // Initialize the superblock structure
+    return result;
+}
 
-    sb.total_blocks = MAX_BLOCKS;
-    sb.block_size = BLOCK_SIZE;
-    sb.free_blocks = MAX_BLOCKS;
-    sb.total_inodes = MAX_FILES;
-    sb.free_inodes = MAX_FILES;
+void cache_invalidate(block_cache *cache, int block);
 
-    // Initialize the inode table
+void note_data_written(fs_ctx *c)
+{
+    // Blocks a journal record may point to were written; see flush_data
+    __atomic_store_n(&c->data_unflushed, 1, __ATOMIC_RELAXED);
+}
+
+off_t segment_start(fs_ctx *c, const block_segment *segment)
+{
+    return (off_t)segment->block * c->geo.block_size + segment->offset;
+}
+
+int disk_transfer(fs_ctx *c, int writing, const block_segment *segments, int count)
+{
+    // Moves a list of block segments as one request per run of physically
+    // contiguous segments, handing the runs to disk_batch_io together. Returns
+    // the bytes moved before the first short transfer, or -1 on error.
+    struct iovec iov[TRANSFER_BATCH];
+    disk_request requests[TRANSFER_BATCH];
+    int total = 0;
+    int i = 0;
 
-    for (int i = 0; i < MAX_FILES; i++)
+    while (i < count)
     {
-        inode_table[i].used = 0;
-        inode_table[i].size = 0;
-        memset(inode_table[i].name, 0, MAX_FILENAME); // Clear the name
-        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+        int first = i;
+        int runs = 0;
+        while (i < count && i - first < TRANSFER_BATCH)
         {
-            inode_table[i].blocks[j] = -1; // Initialize all blocks to -1
+            disk_request *request = &requests[runs++];
+            request->offset = segment_start(c, &segments[i]);
+            request->iov = &iov[i - first];
+            request->iovcnt = 0;
+            request->length = 0;
+            do
+            {
+                iov[i - first].iov_base = segments[i].buffer;
+                iov[i - first].iov_len = segments[i].length;
+                request->length += segments[i].length;
+                request->iovcnt++;
+                i++;
+            } while (i < count && i - first < TRANSFER_BATCH &&
+                     segment_start(c, &segments[i]) == segment_start(c, &segments[i - 1]) + segments[i - 1].length);
         }
-    }
 
-    memset(bitmap, 0, sizeof(bitmap)); // Set all blocks to free (0)
-    bitmap[0] |= (1 << (0 % 8));       // Superblock
-    bitmap[1 / 8] |= (1 << (1 % 8));   // Block bitmap
+        if (writing && c->data_cache.capacity > 0)
+        {
+            pthread_rwlock_wrlock(&c->cache_lock);
+            for (int j = first; j < i; j++)
+            {
+                cache_invalidate(&c->data_cache, segments[j].block); // Cached copy is about to be stale
+            }
+            pthread_rwlock_unlock(&c->cache_lock);
+        }
 
-    for (int i = 2; i < 10; i++)
-    {
-        bitmap[i / 8] |= (1 << (i % 8));
+        disk_batch_io(c, writing, requests, runs);
+        if (writing)
+        {
+            note_data_written(c);
+        }
+        if (c->disk_map == NULL)
+        {
+            STAT_ADD(c, data_io_calls, runs);
+        }
+        for (int r = 0; r < runs; r++)
+        {
+            if (requests[r].moved < 0)
+            {
+                return -1;
+            }
+            total += requests[r].moved;
+            if (requests[r].moved < requests[r].length)
+            {
+                return total;
+            }
+        }
     }
+    return total;
+}
 
-    sb.free_blocks -= 10; // Decrease free blocks count by 10 since superblock, block bitmap and the inode table are used
+void begin_sequence_write(unsigned int *seq)
+{
+    // Callers hold the lock that serialises writers of 'seq'
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    // Write the superblock to the disk
-    lseek(disk_fd, 0, SEEK_SET);
-    if (write(disk_fd, &sb, sizeof(superblock)) != sizeof(superblock))
-    {
-        close(disk_fd);
-        return -1; // Error: cannot write superblock
-    }
+void end_sequence_write(unsigned int *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int cache_home(int index_size, int block)
+{
+    return ((unsigned int)block * 2654435761u) & (index_size - 1);
+}
 
-    lseek(disk_fd, BLOCK_SIZE, SEEK_SET); // BLOCK_SIZE = 4096
+void cache_free_arrays(block_cache *cache)
+{
+    free(cache->slot_block);
+    free(cache->slot_length);
+    free(cache->slot_seq);
+    free(cache->referenced);
+    free(cache->data);
+    free(cache->index);
+}
 
-    if (write(disk_fd, bitmap, BLOCK_SIZE) != BLOCK_SIZE)
+void cache_free_retired(block_cache *cache)
+{
+    while (cache->retired != NULL)
     {
-        close(disk_fd);
-        return -1; // Error: cannot write block bitmap
+        block_cache *old = cache->retired;
+        cache->retired = old->retired;
+        cache_free_arrays(old);
+        free(old);
     }
+}
 
-    // Write the inode table to the disk
-    lseek(disk_fd, BLOCK_SIZE * 2, SEEK_SET); // Start writing at block 2 (after superblock and block bitmap)
-    if (write(disk_fd, inode_table, sizeof(inode_table)) != sizeof(inode_table))
+void cache_reclaim(block_cache *cache)
+{
+    // Frees the retired arrays once no lookup is running. Called with cache_lock held
+    // exclusive, after the arrays were swapped out: a lookup starting from here on
+    // loads the current ones, so only those already counted in 'readers' can hold
+    // retired ones.
+    if (cache->retired == NULL)
     {
-        close(disk_fd);
-        return -1; // Error: cannot write inode table
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cache->readers, __ATOMIC_SEQ_CST) == 0)
+    {
+        cache_free_retired(cache);
     }
-    close(disk_fd);
-    disk_fd = -1;
-    return 0;
 }
 
-int fs_mount(const char *disk_path)
+void cache_free(block_cache *cache)
 {
-    if (disk_path == NULL)
+    // Only when no lookup can be running: at unmount, or before the cache is first used
+    cache_free_retired(cache);
+    cache_free_arrays(cache);
+    memset(cache, 0, sizeof(*cache));
+}
+
+int cache_init(fs_ctx *c, block_cache *cache, int capacity)
+{
+    // Drops any cached blocks and sets up 'capacity' empty slots. Lookups may be
+    // running, so arrays in use are retired and freed once they finish.
+    // Returns 0, or -1 if memory is exhausted (the cache is then left as it was).
+    block_cache fresh = {0};
+    if (capacity > 0)
     {
-        return -1; // Error: null path
+        fresh.index_size = 1;
+        while (fresh.index_size < capacity * 2)
+        {
+            fresh.index_size *= 2;
+        }
+
+        fresh.slot_block = malloc(capacity * sizeof(int));
+        fresh.slot_length = calloc(capacity, sizeof(int));
+        fresh.slot_seq = calloc(capacity, sizeof(unsigned int));
+        fresh.referenced = calloc(capacity, 1);
+        fresh.data = malloc((size_t)capacity * c->geo.block_size);
+        fresh.index = calloc(fresh.index_size, sizeof(int));
+        if (fresh.slot_block == NULL || fresh.slot_length == NULL || fresh.slot_seq == NULL || fresh.referenced == NULL ||
+            fresh.data == NULL || fresh.index == NULL)
+        {
+            cache_free_arrays(&fresh);
+            return -1;
+        }
+
+        for (int i = 0; i < capacity; i++)
+        {
+            fresh.slot_block[i] = -1;
+        }
+        fresh.capacity = capacity;
     }
 
-    if (disk_fd >= 0)
+    if (cache->capacity > 0)
     {
-        return -1; // Error: already mounted
+        block_cache *old = malloc(sizeof(block_cache));
+        if (old == NULL)
+        {
+            cache_free_arrays(&fresh);
+            return -1;
+        }
+        *old = *cache;
+        cache->retired = old;
     }
 
-    disk_fd = open(disk_path, O_RDWR, 0644);
+    begin_sequence_write(&cache->generation);
+    cache->capacity = fresh.capacity;
+    cache->slot_block = fresh.slot_block;
+    cache->slot_length = fresh.slot_length;
+    cache->slot_seq = fresh.slot_seq;
+    cache->referenced = fresh.referenced;
+    cache->data = fresh.data;
+    cache->index = fresh.index;
+    cache->index_size = fresh.index_size;
+    cache->hand = 0;
+    end_sequence_write(&cache->generation);
+    cache_reclaim(cache);
+    return 0;
+}
 
-    if (disk_fd < 0)
+int cache_find_slot(const block_cache *cache, int block)
+{
+    if (cache->capacity == 0)
     {
         return -1;
     }
 
-    lseek(disk_fd, 0, SEEK_SET); // Ensure we start reading from the beginning
-    if (read(disk_fd, &sb, sizeof(superblock)) != sizeof(superblock))
+    unsigned int pos = cache_home(cache->index_size, block);
+    while (cache->index[pos] != 0)
     {
-        close(disk_fd);
-        return -1; // Error: cannot read superblock
+        int slot = cache->index[pos] - 1;
+        if (cache->slot_block[slot] == block)
+        {
+            return slot;
+        }
+        pos = (pos + 1) & (cache->index_size - 1);
     }
+    return -1;
+}
 
-    if (sb.total_blocks != MAX_BLOCKS || sb.block_size != BLOCK_SIZE ||
-        sb.total_inodes != MAX_FILES || sb.free_inodes < 0 || sb.free_blocks < 0 || sb.free_blocks > MAX_BLOCKS ||
-        sb.free_inodes > MAX_FILES)
+void cache_invalidate(block_cache *cache, int block)
+{
+    int slot = cache_find_slot(cache, block);
+    if (slot == -1)
     {
-        close(disk_fd);
-        return -1; // Error: invalid filesystem structure
+        return;
     }
 
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Ensure we start reading from the beginning
-    if (read(disk_fd, &bitmap, sizeof(bitmap)) != sizeof(bitmap))
+    unsigned int pos = cache_home(cache->index_size, block);
+    while (cache->index[pos] != slot + 1)
     {
-        close(disk_fd);
-        return -1; // Error: cannot read block bitmap
+        pos = (pos + 1) & (cache->index_size - 1);
     }
 
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Ensure we start reading from the beginning
-    if (read(disk_fd, &inode_table, sizeof(inode_table)) != sizeof(inode_table))
+    // Backward-shift deletion, as in name_index_remove. Lookups probing meanwhile
+    // may miss an entry as it moves, which costs them a disk read, nothing more.
+    unsigned int hole = pos;
+    unsigned int next = (pos + 1) & (cache->index_size - 1);
+    while (cache->index[next] != 0)
     {
-        close(disk_fd);
-        return -1; // Error: cannot read inode table
+        unsigned int home = cache_home(cache->index_size, cache->slot_block[cache->index[next] - 1]);
+        if (((next - home) & (cache->index_size - 1)) >= ((next - hole) & (cache->index_size - 1)))
+        {
+            __atomic_store_n(&cache->index[hole], cache->index[next], __ATOMIC_RELAXED);
+            hole = next;
+        }
+        next = (next + 1) & (cache->index_size - 1);
     }
-    return 0; // Success: filesystem mounted
+    __atomic_store_n(&cache->index[hole], 0, __ATOMIC_RELAXED);
+
+    begin_sequence_write(&cache->slot_seq[slot]);
+    __atomic_store_n(&cache->slot_block[slot], -1, __ATOMIC_RELAXED);
+    cache->slot_length[slot] = 0;
+    cache->referenced[slot] = 0;
+    end_sequence_write(&cache->slot_seq[slot]);
 }
 
-void fs_unmount()
+int cache_lookup(fs_ctx *c, block_cache *cache, int block, int offset, int length, void *out)
 {
-    if (disk_fd >= 0)
+    // Copies bytes [offset, offset + length) of 'block' into 'out' if the cache
+    // holds them. Takes no lock: the arrays are read under 'generation' and the
+    // copy under the slot's sequence, and is only kept if neither moved, so a
+    // change racing with it turns a hit into a miss. Returns 1 on a hit, else 0.
+    unsigned int generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+    int capacity = __atomic_load_n(&cache->capacity, __ATOMIC_RELAXED);
+    int index_size = __atomic_load_n(&cache->index_size, __ATOMIC_RELAXED);
+    int *index = __atomic_load_n(&cache->index, __ATOMIC_RELAXED);
+    int *slot_block = __atomic_load_n(&cache->slot_block, __ATOMIC_RELAXED);
+    int *slot_length = __atomic_load_n(&cache->slot_length, __ATOMIC_RELAXED);
+    unsigned int *slot_seq = __atomic_load_n(&cache->slot_seq, __ATOMIC_RELAXED);
+    char *referenced = __atomic_load_n(&cache->referenced, __ATOMIC_RELAXED);
+    char *data = __atomic_load_n(&cache->data, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((generation & 1) || capacity == 0 || __atomic_load_n(&cache->generation, __ATOMIC_RELAXED) != generation)
     {
-        // Write the superblock, block bitmap, and inode table back to disk
-        lseek(disk_fd, 0, SEEK_SET);
-        if (write(disk_fd, &sb, sizeof(superblock)) != sizeof(superblock))
-        {
-            perror("Error writing superblock"); //// change to error message
-        }
+        return 0; // Disabled, or being resized
+    }
 
-        lseek(disk_fd, BLOCK_SIZE, SEEK_SET);
-        if (write(disk_fd, bitmap, sizeof(bitmap)) != sizeof(bitmap))
+    // The probe is bounded, as entries can move under it
+    unsigned int pos = cache_home(index_size, block);
+    for (int probes = 0; probes < index_size; probes++)
+    {
+        int entry = __atomic_load_n(&index[pos], __ATOMIC_RELAXED);
+        if (entry == 0)
         {
-            perror("Error writing block bitmap"); /// change to error message
+            return 0;
         }
-
-        lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET);
-        if (write(disk_fd, inode_table, sizeof(inode_table)) != sizeof(inode_table))
+        int slot = entry - 1;
+        if (__atomic_load_n(&slot_block[slot], __ATOMIC_RELAXED) == block)
         {
-            perror("Error writing inode table"); /// change to error message
+            unsigned int seq = __atomic_load_n(&slot_seq[slot], __ATOMIC_ACQUIRE);
+            if ((seq & 1) || __atomic_load_n(&slot_block[slot], __ATOMIC_RELAXED) != block ||
+                __atomic_load_n(&slot_length[slot], __ATOMIC_RELAXED) < offset + length)
+            {
+                return 0;
+            }
+            memcpy(out, data + (size_t)slot * c->geo.block_size + offset, length);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot_seq[slot], __ATOMIC_RELAXED) != seq)
+            {
+                return 0;
+            }
+            __atomic_store_n(&referenced[slot], 1, __ATOMIC_RELAXED);
+            return 1;
         }
-
-        close(disk_fd);
-        disk_fd = -1; // Reset file descriptor
+        pos = (pos + 1) & (index_size - 1);
     }
+    return 0;
 }
 
-int fs_create(const char *filename)
+int cache_read(fs_ctx *c, block_cache *cache, int block, int offset, int length, void *out)
 {
-
-    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || strlen(filename) == 0 || disk_fd == -1)
+    // cache_lookup, counted in 'readers' so that cache_reclaim keeps the arrays it
+    // may be reading
+    if (__atomic_load_n(&cache->capacity, __ATOMIC_RELAXED) == 0)
     {
-        return -3; // Error: invalid filename
+        return 0;
     }
+    __atomic_add_fetch(&cache->readers, 1, __ATOMIC_SEQ_CST);
+    int hit = cache_lookup(c, cache, block, offset, length, out);
+    __atomic_sub_fetch(&cache->readers, 1, __ATOMIC_RELEASE);
+    return hit;
+}
 
-    // Check if the file already exists
-    if (find_inode(filename) != -1)
+void cache_insert(fs_ctx *c, block_cache *cache, int block, const char *bytes, int length)
+{
+    cache_reclaim(cache); // Lookups that held retired arrays through a resize may have finished since
+    if (cache->capacity == 0)
     {
-        return -1; // Error: file already exists
+        return;
     }
 
-    int inode_index = find_free_inode();
-    if (inode_index == -2)
+    int slot = cache_find_slot(cache, block);
+    if (slot == -1)
     {
-        return -2; // No free inodes available
-    }
+        // CLOCK: sweep past recently referenced slots, clearing their bit, and take the first cold one
+        while (cache->slot_block[cache->hand] != -1 && cache->referenced[cache->hand])
+        {
+            cache->referenced[cache->hand] = 0;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+        }
+        slot = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
 
-    inode new_inode;
-    new_inode.used = 1;                                 // Mark inode as used
-    new_inode.size = 0;                                 // Initialize size to 0
-    memset(new_inode.name, 0, MAX_FILENAME);            // Clear all 28 bytes
-    memcpy(new_inode.name, filename, strlen(filename)); // Copy filename
+        if (cache->slot_block[slot] != -1)
+        {
+            cache_invalidate(cache, cache->slot_block[slot]);
+        }
 
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+        unsigned int pos = cache_home(cache->index_size, block);
+        while (cache->index[pos] != 0)
+        {
+            pos = (pos + 1) & (cache->index_size - 1);
+        }
+        begin_sequence_write(&cache->slot_seq[slot]);
+        __atomic_store_n(&cache->slot_block[slot], block, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->index[pos], slot + 1, __ATOMIC_RELAXED);
+    }
+    else
     {
-        new_inode.blocks[i] = -1; // Initialize all blocks to -1 (unallocated)
+        begin_sequence_write(&cache->slot_seq[slot]);
     }
 
-    write_inode(inode_index, &new_inode); // Write the new inode to the inode table
+    memcpy(cache->data + (size_t)slot * c->geo.block_size, bytes, length);
+    __atomic_store_n(&cache->slot_length[slot], length, __ATOMIC_RELAXED);
+    cache->referenced[slot] = 1;
+    end_sequence_write(&cache->slot_seq[slot]);
+}
 
-    sync_metadata_to_disk(); // Sync metadata to disk
-    return 0;                // Success: file created
+int read_guard_valid(fs_ctx *c, const read_guard *guard)
+{
+    // Whether the data read since 'guard' was taken is still current
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&c->names_seq, __ATOMIC_RELAXED) == guard->names &&
+           (guard->inode_seq == NULL || __atomic_load_n(guard->inode_seq, __ATOMIC_RELAXED) == guard->inode);
 }
 
-int fs_delete(const char *filename)
+int read_segments(fs_ctx *c, block_segment *segments, int count)
 {
-    int inode_index = find_inode(filename);
+    // disk_transfer for reads, serving what it can from data_cache and caching the rest
+    if (c->data_cache.capacity == 0 || c->disk_map != NULL)
+    {
+        return disk_transfer(c, 0, segments, count);
+    }
+
+    block_segment misses[TRANSFER_BATCH];
+    char hit[TRANSFER_BATCH];
+    int miss_count = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        hit[i] = cache_read(c, &c->data_cache, segments[i].block, segments[i].offset, segments[i].length, segments[i].buffer);
+        if (hit[i])
+        {
+            STAT_ADD(c, cache_hits, 1);
+        }
+        else
+        {
+            misses[miss_count++] = segments[i];
+            STAT_ADD(c, cache_misses, 1);
+        }
+    }
+
+    int total = 0;
+    if (miss_count == 0)
+    {
+        // All hits: no lock was taken, so parallel readers never queue here
+        for (int i = 0; i < count; i++)
+        {
+            total += segments[i].length;
+        }
+        return total;
+    }
 
-    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || inode_index == -1 || disk_fd == -1)
+    int miss_bytes = disk_transfer(c, 0, misses, miss_count);
+    if (miss_bytes < 0)
     {
         return -1;
     }
 
-    // Create a temporary copy of the inode before modifying it
-    inode temp_inode = inode_table[inode_index];
+    // Count bytes up to the first short read, noting the blocks that were read in full
+    int insert_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!hit[i])
+        {
+            if (miss_bytes < segments[i].length)
+            {
+                total += miss_bytes;
+                break;
+            }
+            miss_bytes -= segments[i].length;
+            if (segments[i].offset == 0)
+            {
+                misses[insert_count++] = segments[i];
+            }
+        }
+        total += segments[i].length;
+    }
 
-    // Free all allocated blocks
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    if (insert_count > 0)
     {
-        if (temp_inode.blocks[i] != -1)
+        pthread_rwlock_wrlock(&c->cache_lock);
+        if (unlocked_read == NULL || read_guard_valid(c, unlocked_read)) // Never cache what a writer replaced
         {
-            mark_block_free(temp_inode.blocks[i]);
-            temp_inode.blocks[i] = -1;
+            for (int i = 0; i < insert_count; i++)
+            {
+                cache_insert(c, &c->data_cache, misses[i].block, misses[i].buffer, misses[i].length);
+            }
         }
+        pthread_rwlock_unlock(&c->cache_lock);
     }
+    return total;
+}
 
-    // Mark the inode as free
-    temp_inode.used = 0;
-    temp_inode.size = 0;
-    memset(temp_inode.name, 0, MAX_FILENAME);
+int disk_write(fs_ctx *c, off_t offset, const void *buffer, int length)
+{
+    // Returns the bytes written, short only when the device is full, or -1 on error
+    if (c->disk_map != NULL)
+    {
+        return map_copy(c, 1, offset, (void *)buffer, length);
+    }
 
-    // Write the updated inode (this will properly update sb.free_inodes)
-    write_inode(inode_index, &temp_inode);
+    int total = 0;
+    while (total < length)
+    {
+        ssize_t n = pwrite(c->disk_fd, (const char *)buffer + total, length - total, offset + total);
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
 
-    sync_metadata_to_disk();
-    return 0;
+int flush_image(fs_ctx *c)
+{
+    // Forces everything written so far to stable storage. Returns 0, or -1 on error.
+    // Writers set data_unflushed after their write, so one landing meanwhile keeps it set.
+    STAT_ADD(c, flushes, 1);
+    __atomic_store_n(&c->data_unflushed, 0, __ATOMIC_RELAXED);
+    int result = (c->disk_map != NULL) ? msync(c->disk_map, IMAGE_BYTES(c), MS_SYNC) : fdatasync(c->disk_fd);
+    if (result != 0)
+    {
+        __atomic_store_n(&c->data_unflushed, 1, __ATOMIC_RELAXED);
+    }
+    return result;
 }
 
-int fs_list(char filenames[][MAX_FILENAME], int max_files)
+int flush_data(fs_ctx *c)
 {
-    if (max_files == 0)
+    // Makes the blocks a commit's records point to stable before the records
+    // themselves are written, as the kernel may write back in any order: a
+    // replayed record must never name blocks that still hold old contents.
+    // Returns 0, or -1 if the flush failed.
+    if (!__atomic_load_n(&c->data_unflushed, __ATOMIC_RELAXED))
     {
         return 0;
     }
+    return flush_image(c);
+}
 
-    if (filenames == NULL || max_files < 0 || max_files > MAX_FILES || disk_fd == -1)
-    {
+int flushes_commits(fs_ctx *c)
+{
+    // Modes in which a journal commit is not done until it is on stable storage
+    return c->durability == FS_DURABILITY_STRICT || c->durability == FS_DURABILITY_PERIODIC;
+}
+
+int validate_string_manual(const char *str)
+{
+    if (str == NULL)
         return -1;
-    }
 
-    int count_files = 0; // Counter for the number of files found
+    for (int i = 0; i < 28; i++)
+    {
+        if (str[i] == '\0')
+        {
+            return 0; // Found null terminator within 28 chars
+        }
+    }
 
-    for (int i = 0; i < MAX_FILES && count_files < max_files; i++)
+    // Check if 28th position is null terminator
+    if (str[28] == '\0')
     {
-        if (inode_table[i].used == 1)
-        { // If the inode is used
-            // Find the length of the name in the raw array
-            int name_len = 0;
-            for (int j = 0; j < MAX_FILENAME && inode_table[i].name[j] != 0; j++)
-            {
-                name_len++;
-            }
+        return 0;
+    }
+    return -1;
+}
 
-            memcpy(filenames[count_files], inode_table[i].name, name_len);
-            filenames[count_files][name_len] = '\0'; // Add null terminator for the output
-            count_files++;                           // Increment the count of files found
-        }
+unsigned int hash_name(const char *name, int len)
+{
+    // FNV-1a over the significant bytes of the name
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    return count_files; // Return the number of files found
+int name_length(const char *name)
+{
+    // Stored names are not null terminated when they use all MAX_FILENAME bytes
+    int len = 0;
+    while (len < MAX_FILENAME && name[len] != 0)
+    {
+        len++;
+    }
+    return len;
 }
 
-int fs_write(const char *filename, const void *data, int size)
+int inode_name_matches(fs_ctx *c, int inode_num, const char *filename, int filename_len)
 {
-    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || data == NULL || size < 0 || disk_fd < 0)
+    if (memcmp(c->inode_table[inode_num].name, filename, filename_len) != 0)
     {
-        return -3;
+        return 0;
+    }
+    // Check remaining bytes are zero
+    for (int j = filename_len; j < MAX_FILENAME; j++)
+    {
+        if (c->inode_table[inode_num].name[j] != 0)
+        {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    int inode_index = find_inode(filename);
-    if (inode_index == -1)
+void name_index_insert(fs_ctx *c, int inode_num)
+{
+    const char *name = c->inode_table[inode_num].name;
+    unsigned int slot = hash_name(name, name_length(name)) & (NAME_INDEX_SIZE(c) - 1);
+
+    while (c->name_index[slot] != 0)
     {
-        return -1;
+        slot = (slot + 1) & (NAME_INDEX_SIZE(c) - 1);
     }
+    c->name_index[slot] = inode_num + 1;
+}
 
-    int blocks_needed = calculate_blocks_needed(size);
+void name_index_remove(fs_ctx *c, int inode_num)
+{
+    const char *name = c->inode_table[inode_num].name;
+    unsigned int slot = hash_name(name, name_length(name)) & (NAME_INDEX_SIZE(c) - 1);
 
-    if (blocks_needed > sb.free_blocks)
+    while (c->name_index[slot] != inode_num + 1)
     {
-        return -2; // Error: too many blocks needed
+        if (c->name_index[slot] == 0)
+        {
+            return; // Not indexed
+        }
+        slot = (slot + 1) & (NAME_INDEX_SIZE(c) - 1);
     }
 
-    if (blocks_needed > MAX_DIRECT_BLOCKS)
+    // Backward-shift deletion: pull later entries of the probe chain into the hole
+    // so lookups never need tombstones
+    unsigned int hole = slot;
+    unsigned int next = (slot + 1) & (NAME_INDEX_SIZE(c) - 1);
+    while (c->name_index[next] != 0)
     {
-        return -3;
+        const char *next_name = c->inode_table[c->name_index[next] - 1].name;
+        unsigned int home = hash_name(next_name, name_length(next_name)) & (NAME_INDEX_SIZE(c) - 1);
+
+        // Move the entry only if its home slot is not cyclically between the hole and its position
+        if (((next - home) & (NAME_INDEX_SIZE(c) - 1)) >= ((next - hole) & (NAME_INDEX_SIZE(c) - 1)))
+        {
+            c->name_index[hole] = c->name_index[next];
+            hole = next;
+        }
+        next = (next + 1) & (NAME_INDEX_SIZE(c) - 1);
     }
+    c->name_index[hole] = 0;
+}
 
-    inode target_inode;
-    read_inode(inode_index, &target_inode);
+void name_index_build(fs_ctx *c)
+{
+    memset(c->name_index, 0, NAME_INDEX_SIZE(c) * sizeof(int));
+    for (int i = 0; i < c->geo.total_inodes; i++)
+    {
+        if (c->inode_table[i].used == 1)
+        {
+            name_index_insert(c, i);
+        }
+    }
+}
 
-    int original_blocks[MAX_DIRECT_BLOCKS];
-    int original_size = target_inode.size;
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+int find_inode(fs_ctx *c, const char *filename)
+{
+    if (filename == NULL || c->name_index == NULL)
     {
-        original_blocks[i] = target_inode.blocks[i];
+        return -1; // Also before the first format or mount sizes the index
     }
 
-    int new_blocks[MAX_DIRECT_BLOCKS];
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    int filename_len = strlen(filename);
+    if (filename_len > MAX_FILENAME)
     {
-        new_blocks[i] = -1; // Initialize
+        return -1; // Filename too long
     }
 
-    // Allocate all blocks we need
-    for (int i = 0; i < blocks_needed; i++)
+    unsigned int slot = hash_name(filename, filename_len) & (NAME_INDEX_SIZE(c) - 1);
+    while (c->name_index[slot] != 0)
     {
-        new_blocks[i] = find_free_block();
+        int i = c->name_index[slot] - 1;
+        if (c->inode_table[i].used == 1 && inode_name_matches(c, i, filename, filename_len))
+        {
+            return i;
+        }
+        slot = (slot + 1) & (NAME_INDEX_SIZE(c) - 1);
+    }
+    return -1;
+}
 
-        if (new_blocks[i] == -1)
+int find_free_inode(fs_ctx *c)
+{
+    if (c->sb.free_inodes == 0)
+    {
+        return -2; // No free inodes available
+    }
+    for (int i = 0; i < c->geo.total_inodes; i++)
+    {
+        if (c->inode_table[i].used == 0)
         {
-            // ROLLBACK: Free any blocks we allocated
-            for (int j = 0; j < i; j++)
-            {
-                mark_block_free(new_blocks[j]);
-            }
-            return -2; // Not enough space
+            return i;
         }
-        mark_block_used(new_blocks[i]);
     }
+    return -2; // No free inodes available
+}
 
-    const char *data_ptr = (const char *)data;
-    int remaining_size = size;
+uint64_t load_bitmap_word(const char *map, int word)
+{
+    // Block i is bit (i % 8) of byte (i / 8), so reading 8 bytes little-endian
+    // puts block (word * 64 + j) in bit j
+    uint64_t value;
+    memcpy(&value, map + word * 8, sizeof(value));
+    return le64toh(value);
+}
 
-    for (int i = 0; i < blocks_needed; i++)
+uint64_t load_unavailable_word(fs_ctx *c, int word)
+{
+    // Used blocks, plus freed blocks whose release is not yet committed and blocks
+    // reserved by writers. Bits past the last block read as unavailable.
+    uint64_t value = load_bitmap_word(c->bitmap, word) | load_bitmap_word(c->pending_free, word) |
+                     load_bitmap_word(c->reserved_map, word);
+    if (c->spill_map != NULL)
     {
-        int bytes_to_write = (remaining_size > BLOCK_SIZE) ? BLOCK_SIZE : remaining_size;
-
-        lseek(disk_fd, new_blocks[i] * BLOCK_SIZE, SEEK_SET);
+        value |= load_bitmap_word(c->spill_map, word);
+    }
+    int past = (word + 1) * 64 - c->geo.total_blocks;
+    if (past > 0)
+    {
+        value |= ~0ULL << (64 - past);
+    }
+    return value;
+}
 
-        // Handle partial writes with retry
-        int total_written = 0;
-        while (total_written < bytes_to_write)
-        {
-            int bytes_written = write(disk_fd, data_ptr + total_written,
-                                      bytes_to_write - total_written);
+// Free-space summary: level 0 has a bit per bitmap word, and each level above a
+// bit per word of the level below, so one level up marks groups 64 times larger.
+// Searches skip words of zero bits (full regions) by asking the next level up.
 
-            if (bytes_written < 0)
-            {
-                // Free all newly allocated blocks
-                for (int j = 0; j < blocks_needed; j++)
-                {
-                    if (new_blocks[j] != -1)
-                    {
-                        mark_block_free(new_blocks[j]);
-                    }
-                }
+int summary_groups(fs_ctx *c, int level)
+{
+    // Groups at a level, counting a partial last one
+    int shift = 6 * (level + 1);
+    return (int)(((long long)c->geo.total_blocks + (1LL << shift) - 1) >> shift);
+}
 
-                // Original data is still intact!
-                return -3;
-            }
-            if (bytes_written == 0)
-            {
-                // Disk full - ROLLBACK
-                // Free all newly allocated blocks
+void summary_set_bit(fs_ctx *c, int level, int group, int available)
+{
+    uint64_t bit = 1ULL << (group % 64);
+    if (available)
+    {
+        c->free_summary[level][group / 64] |= bit;
+    }
+    else
+    {
+        c->free_summary[level][group / 64] &= ~bit;
+    }
+}
 
-                for (int j = 0; j < blocks_needed; j++)
-                {
-                    if (new_blocks[j] != -1)
-                    {
-                        mark_block_free(new_blocks[j]);
-                    }
-                }
+void summary_adjust(fs_ctx *c, int block, int delta)
+{
+    // Records that 'block' became allocatable (delta 1) or stopped being so (delta -1)
+    int word = block / 64;
+    summary_set_bit(c, 0, word, ~load_unavailable_word(c, word) != 0);
+    for (int level = 1; level < SUMMARY_LEVELS; level++)
+    {
+        int group = block >> (6 * (level + 1));
+        c->free_summary_count[level][group] += delta;
+        summary_set_bit(c, level, group, c->free_summary_count[level][group] > 0);
+    }
+}
 
-                return -2;
-            }
-            total_written += bytes_written;
+int summary_build(fs_ctx *c)
+{
+    // Sizes the summary for the mounted image and fills it from the bitmap. Returns 0, or -1 if out of memory.
+    for (int level = 0; level < SUMMARY_LEVELS; level++)
+    {
+        int groups = summary_groups(c, level);
+        free(c->free_summary[level]);
+        free(c->free_summary_count[level]);
+        c->free_summary[level] = calloc((groups + 63) / 64, sizeof(uint64_t));
+        c->free_summary_count[level] = (level > 0) ? calloc(groups, sizeof(int)) : NULL;
+        if (c->free_summary[level] == NULL || (level > 0 && c->free_summary_count[level] == NULL))
+        {
+            return -1;
         }
-
-        data_ptr += bytes_to_write;
-        remaining_size -= bytes_to_write;
     }
 
-    // Update inode to point to new blocks
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    int words = summary_groups(c, 0);
+    for (int group = 0; group < summary_groups(c, 1); group++)
+    {
+        // One level-1 group is one word of level 0
+        uint64_t bits = 0;
+        int available = 0;
+        for (int word = group * 64; word < words && word < (group + 1) * 64; word++)
+        {
+            int count = __builtin_popcountll(~load_unavailable_word(c, word));
+            bits |= (uint64_t)(count > 0) << (word % 64);
+            available += count;
+        }
+        c->free_summary[0][group] = bits;
+        c->free_summary_count[1][group] = available;
+        c->free_summary_count[2][group / 64] += available;
+    }
+    for (int level = 1; level < SUMMARY_LEVELS; level++)
     {
-        target_inode.blocks[i] = new_blocks[i];
+        for (int group = 0; group < summary_groups(c, level); group++)
+        {
+            summary_set_bit(c, level, group, c->free_summary_count[level][group] > 0);
+        }
     }
-    target_inode.size = size;
+    return 0;
+}
 
-    // Write updated inode
-    write_inode(inode_index, &target_inode);
+int summary_next(fs_ctx *c, int level, int group)
+{
+    // First group at or after 'group' on this level with an allocatable block, or -1
+    if (group >= summary_groups(c, level))
+    {
+        return -1;
+    }
 
-    // free the original blocks
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    int word = group / 64;
+    uint64_t bits = c->free_summary[level][word] & (~0ULL << (group % 64));
+    if (bits == 0)
     {
-        if (original_blocks[i] != -1)
+        if (level + 1 < SUMMARY_LEVELS)
+        {
+            // Bit j one level up is set exactly when word j here is non-zero
+            word = summary_next(c, level + 1, word + 1);
+        }
+        else
+        {
+            // The top level is at most 64 words
+            int words = (summary_groups(c, level) + 63) / 64;
+            do
+            {
+                word++;
+            } while (word < words && c->free_summary[level][word] == 0);
+            word = (word < words) ? word : -1;
+        }
+        if (word == -1)
         {
-            mark_block_free(original_blocks[i]);
+            return -1;
         }
+        bits = c->free_summary[level][word];
     }
+    return word * 64 + __builtin_ctzll(bits);
+}
 
-    // Sync metadata to disk
-    sync_metadata_to_disk();
+int available_group_at(fs_ctx *c, int block)
+{
+    // Size of the largest summary group starting at 'block' that is entirely allocatable, or 0
+    for (int level = SUMMARY_LEVELS - 1; level >= 1; level--)
+    {
+        int size = 1 << (6 * (level + 1));
+        if (block % size == 0 && c->free_summary_count[level][block / size] == size)
+        {
+            return size;
+        }
+    }
     return 0;
 }
 
-int fs_read(const char *filename, void *buffer, int size)
+int scan_free_block(fs_ctx *c, int from, int to)
 {
-    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || buffer == NULL || size < 0 || disk_fd == -1)
+    // Returns the first free block in [from, to), skipping full regions through the summary
+    if (from >= to)
     {
-        return -3; // Error: invalid parameters
+        return -1;
     }
 
-    int inode_index = find_inode(filename);
-    if (inode_index == -1)
+    int word = from / 64;
+    uint64_t free_bits = ~load_unavailable_word(c, word) & (~0ULL << (from % 64));
+    if (free_bits == 0)
     {
-        return -1; // Error: file not found
+        word = summary_next(c, 0, word + 1);
+        if (word == -1)
+        {
+            return -1;
+        }
+        free_bits = ~load_unavailable_word(c, word);
     }
 
-    // Use read_inode helper function to get the inode
-    inode target_inode;
-    read_inode(inode_index, &target_inode);
+    int block = word * 64 + __builtin_ctzll(free_bits);
+    return (block < to) ? block : -1;
+}
 
-    if (target_inode.used == 0)
+int scan_used_block(fs_ctx *c, int from, int to)
+{
+    // Returns the first unavailable block in [from, to), or 'to' if they are all free.
+    // Groups the summary counts as entirely free are skipped whole.
+    if (from >= to)
     {
-        return -1; // Error: inode not used
+        return to;
     }
 
-    int bytes_to_read = (size > target_inode.size) ? target_inode.size : size; // Read only up to the file size
-    int total_bytes_read = 0;                                                  // Counter for total bytes read
-    char *data_ptr = (char *)buffer;                                           // Pointer to the buffer where data will be read
+    int word = from / 64;
+    uint64_t used_bits = load_unavailable_word(c, word) & (~0ULL << (from % 64));
+    int next = (word + 1) * 64; // First block not examined yet
 
-    // Iterate over blocks
-    for (int i = 0; i < MAX_DIRECT_BLOCKS && total_bytes_read < bytes_to_read; i++)
+    while (used_bits == 0)
     {
-        if (target_inode.blocks[i] == -1)
+        if (next >= to)
         {
-            break; // No more blocks to read
+            return to;
         }
-
-        int block_index = target_inode.blocks[i];
-        if (block_index < 0 || block_index >= MAX_BLOCKS)
+        int skip = available_group_at(c, next);
+        if (skip > 0)
         {
-            return -3; // Error: invalid block index
+            next += skip;
+            continue;
         }
+        word = next / 64;
+        used_bits = load_unavailable_word(c, word);
+        next += 64;
+    }
 
-        // Calculate how many bytes to read from this block
-        int remaining_bytes = bytes_to_read - total_bytes_read;
-        int bytes_from_block = (remaining_bytes > BLOCK_SIZE) ? BLOCK_SIZE : remaining_bytes;
+    int block = word * 64 + __builtin_ctzll(used_bits);
+    return (block < to) ? block : to;
+}
 
-        lseek(disk_fd, block_index * BLOCK_SIZE, SEEK_SET);
-        int bytes_read = read(disk_fd, data_ptr, bytes_from_block);
+int find_free_run(fs_ctx *c, int count, int *length)
+{
+    // Best fit: returns the start of the smallest free run of at least 'count'
+    // blocks, or of the longest run if none is that long, and stores the run's
+    // length in *length. A single block takes the first free one instead. The
+    // search starts at the next-fit cursor and wraps once; full regions are
+    // skipped through the summary. Returns -1 if no block is free.
+    int best = -1;
+    int best_length = 0;
 
-        if (bytes_read < 0)
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int limit = (pass == 0) ? c->geo.total_blocks : c->alloc_cursor;
+        int start = scan_free_block(c, (pass == 0) ? c->alloc_cursor : 0, limit);
+        while (start != -1)
         {
-            return -3; // Error: read failed
+            int end = scan_used_block(c, start, c->geo.total_blocks);
+            int run = end - start;
+
+            int better = (best_length >= count) ? (run >= count && run < best_length) : (run > best_length);
+            if (better)
+            {
+                best = start;
+                best_length = run;
+                if (run == count || count == 1)
+                {
+                    *length = best_length;
+                    return best; // Exact fit, or any fit for a single block
+                }
+            }
+            start = scan_free_block(c, end, limit);
         }
+    }
 
-        data_ptr += bytes_read;
-        total_bytes_read += bytes_read;
+    *length = best_length;
+    return best;
+}
 
-        // If we read less than requested from this block, we've reached end of file
-        if (bytes_read < bytes_from_block)
-        {
-            break;
-        }
+int find_free_block(fs_ctx *c)
+{
+    // Next-fit: continue from where the last allocation stopped, wrapping once
+    int block = scan_free_block(c, c->alloc_cursor, c->geo.total_blocks);
+    if (block == -1)
+    {
+        block = scan_free_block(c, 0, c->alloc_cursor);
     }
+    return block; // -1 if no free blocks available
+}
 
-    return total_bytes_read; // Return total bytes successfully read
+void reset_dirty_ranges(fs_ctx *c, dirty_range *ranges)
+{
+    for (int b = 0; b < c->geo.bitmap_blocks; b++)
+    {
+        ranges[b].lo = INT_MAX;
+        ranges[b].hi = 0;
+    }
+}
+
+void extend_dirty_range(dirty_range *range, int byte)
+{
+    if (byte < range->lo)
+    {
+        range->lo = byte;
+    }
+    if (byte + 1 > range->hi)
+    {
+        range->hi = byte + 1;
+    }
+}
+
+void *grow_log(void *log, int *capacity, int count, size_t record)
+{
+    // Returns the log with room for one more record, or NULL if memory runs out
+    if (count < *capacity)
+    {
+        return log;
+    }
+    int grown = (*capacity > 0) ? *capacity * 2 : 64;
+    void *larger = realloc(log, grown * record);
+    if (larger != NULL)
+    {
+        *capacity = grown;
+    }
+    return larger;
+}
+
+void txn_save_inode(fs_ctx *c, int inode_num)
+{
+    transaction *txn = &c->txn;
+    inode_undo *log = grow_log(txn->inodes, &txn->inode_capacity, txn->inode_count, sizeof(inode_undo));
+    if (log == NULL)
+    {
+        txn->incomplete = 1;
+        return;
+    }
+    txn->inodes = log;
+    log[txn->inode_count].index = inode_num;
+    log[txn->inode_count].before = c->inode_table[inode_num];
+    txn->inode_count++;
+}
+
+void txn_save_block(fs_ctx *c, int block_index, int was_used)
+{
+    transaction *txn = &c->txn;
+    block_undo *log = grow_log(txn->blocks, &txn->block_capacity, txn->block_count, sizeof(block_undo));
+    if (log == NULL)
+    {
+        txn->incomplete = 1;
+        return;
+    }
+    txn->blocks = log;
+    log[txn->block_count].block = block_index;
+    log[txn->block_count].was_used = was_used;
+    txn->block_count++;
+}
+
+void mark_bitmap_dirty(fs_ctx *c, int block_index)
+{
+    int byte = block_index / 8;
+    dirty_range *journal_range = &c->journal_bitmap_dirty[block_index / BLOCKS_PER_BITMAP_BLOCK(c)];
+    int before = (journal_range->lo < journal_range->hi) ? journal_range->hi - journal_range->lo
+                                                          : -(int)sizeof(journal_record); // A new range adds a record
+    extend_dirty_range(&c->bitmap_dirty[block_index / BLOCKS_PER_BITMAP_BLOCK(c)], byte);
+    extend_dirty_range(journal_range, byte);
+    c->journal_pending_bytes += journal_range->hi - journal_range->lo - before;
+    c->sb_dirty = 1; // free_blocks changes with every bitmap update
+}
+
+void mark_inode_dirty(fs_ctx *c, int inode_num)
+{
+    // An inode can straddle two blocks of the table
+    int first = inode_num * (int)sizeof(inode);
+    int last = first + (int)sizeof(inode) - 1;
+    for (int b = first / c->geo.block_size; b <= last / c->geo.block_size; b++)
+    {
+        c->inode_blocks_dirty[b] = 1;
+    }
+    if (!c->journal_inode_dirty[inode_num])
+    {
+        c->journal_inode_dirty[inode_num] = 1;
+        c->journal_pending_bytes += sizeof(journal_record) + sizeof(inode); // At worst a record of its own
+    }
+}
+
+void clear_metadata_dirty(fs_ctx *c)
+{
+    // Resets checkpoint tracking; journal tracking is reset by journal_commit
+    c->sb_dirty = 0;
+    reset_dirty_ranges(c, c->bitmap_dirty);
+    memset(c->inode_blocks_dirty, 0, INODE_TABLE_BLOCKS(c));
+}
+
+void mark_block_used(fs_ctx *c, int block_index)
+{
+    if (block_index >= 0 && block_index < c->geo.total_blocks)
+    {
+        // Check if block is actually free before marking it used
+        if (!(c->bitmap[block_index / 8] & (1 << (block_index % 8))))
+        {
+            if (c->txn.active)
+            {
+                txn_save_block(c, block_index, 0);
+            }
+            c->bitmap[block_index / 8] |= (1 << (block_index % 8));
+            c->sb.free_blocks--;
+            mark_bitmap_dirty(c, block_index);
+            if (!(c->pending_free[block_index / 8] & (1 << (block_index % 8))))
+            {
+                summary_adjust(c, block_index, -1);
+            }
+        }
+        c->alloc_cursor = (block_index + 1 < c->geo.total_blocks) ? block_index + 1 : 0;
+    }
+}
+
+void mark_block_free(fs_ctx *c, int block_index)
+{
+    if (block_index >= 0 && block_index < c->geo.total_blocks)
+    {
+        // Check if block is actually used before marking it free
+        if (c->bitmap[block_index / 8] & (1 << (block_index % 8)))
+        {
+            if (c->txn.active)
+            {
+                txn_save_block(c, block_index, 1);
+            }
+            c->bitmap[block_index / 8] &= ~(1 << (block_index % 8));
+            c->sb.free_blocks++;
+            mark_bitmap_dirty(c, block_index);
+
+            // A crash before the next commit would bring back the old owner of this block,
+            // so it must not be handed out and overwritten until then
+            c->pending_free[block_index / 8] |= (1 << (block_index % 8));
+            c->pending_free_count++;
+
+            pthread_rwlock_wrlock(&c->cache_lock);
+            cache_invalidate(&c->data_cache, block_index);
+            cache_invalidate(&c->indirect_cache, block_index);
+            pthread_rwlock_unlock(&c->cache_lock);
+        }
+    }
+}
+
+void reserve_block(fs_ctx *c, int block_index)
+{
+    // Keeps a free block from the allocator without marking it used; see reserve_blocks
+    c->reserved_map[block_index / 8] |= (1 << (block_index % 8));
+    summary_adjust(c, block_index, -1);
+    c->alloc_cursor = (block_index + 1 < c->geo.total_blocks) ? block_index + 1 : 0;
+}
+
+void unreserve_block(fs_ctx *c, int block_index)
+{
+    c->reserved_map[block_index / 8] &= ~(1 << (block_index % 8));
+    summary_adjust(c, block_index, 1);
+}
+
+int allocate_blocks(fs_ctx *c, int goal, int count, int *blocks, int reserve)
+{
+    // Allocates 'count' blocks into 'blocks' as few runs as possible: first the
+    // free blocks right at 'goal' (the block after the file's last one, or -1),
+    // then the smallest free run that holds the rest, or failing that the
+    // longest runs one after another. With 'reserve' the blocks are only
+    // reserved. Returns 0, or -1 with nothing allocated if space runs out.
+    int done = 0;
+
+    if (goal >= 0 && goal < c->geo.total_blocks)
+    {
+        // Look no further than needed, so a large free area is not scanned to its end
+        int limit = (count < c->geo.total_blocks - goal) ? goal + count : c->geo.total_blocks;
+        int run = scan_used_block(c, goal, limit) - goal;
+        while (done < count && done < run)
+        {
+            blocks[done] = goal + done;
+            if (reserve)
+            {
+                reserve_block(c, blocks[done]);
+            }
+            else
+            {
+                mark_block_used(c, blocks[done]);
+            }
+            done++;
+        }
+    }
+
+    while (done < count)
+    {
+        int length;
+        int start = find_free_run(c, count - done, &length);
+        if (start == -1)
+        {
+            // ROLLBACK: Free any blocks we allocated
+            for (int j = 0; j < done; j++)
+            {
+                if (reserve)
+                {
+                    unreserve_block(c, blocks[j]);
+                }
+                else
+                {
+                    mark_block_free(c, blocks[j]);
+                }
+            }
+            return -1;
+        }
+
+        for (int i = 0; i < length && done < count; i++)
+        {
+            blocks[done] = start + i;
+            if (reserve)
+            {
+                reserve_block(c, blocks[done]);
+            }
+            else
+            {
+                mark_block_used(c, blocks[done]);
+            }
+            done++;
+        }
+    }
+    return 0;
+}
+
+void read_inode(fs_ctx *c, int inode_num, inode *target)
+{
+    if (inode_num < 0 || inode_num >= c->geo.total_inodes || target == NULL)
+    {
+        return; // Invalid parameters
+    }
+
+    if (c->inode_table[inode_num].used == 0)
+    {
+        return; // Inode is not used
+    }
+
+    *target = c->inode_table[inode_num];
+}
+
+void write_inode(fs_ctx *c, int inode_num, const inode *source)
+{
+    if (inode_num < 0 || inode_num >= c->geo.total_inodes || source == NULL)
+    {
+        return;
+    }
+
+    if (c->txn.active)
+    {
+        txn_save_inode(c, inode_num);
+    }
+    int was_used = c->inode_table[inode_num].used;
+    if (was_used == source->used && memcmp(c->inode_table[inode_num].name, source->name, MAX_FILENAME) == 0)
+    {
+        // Same file: lookups of other names may be reading used and name, so only the rest is stored
+        memcpy((char *)&c->inode_table[inode_num] + offsetof(inode, size), (const char *)source + offsetof(inode, size),
+               sizeof(inode) - offsetof(inode, size));
+    }
+    else
+    {
+        c->inode_table[inode_num] = *source;
+    }
+    mark_inode_dirty(c, inode_num);
+
+    // Handle allocation
+    if (was_used == 0 && source->used == 1)
+    {
+        c->sb.free_inodes--; // Allocating a free inode
+        c->sb_dirty = 1;
+    }
+    // Handle deallocation
+    else if (was_used == 1 && source->used == 0)
+    {
+        c->sb.free_inodes++; // Freeing a used inode
+        c->sb_dirty = 1;
+    }
+}
+
+int second_level_blocks(fs_ctx *c, int data_blocks)
+{
+    // Second-level pointer blocks under the double-indirect block for a file of 'data_blocks' blocks
+    int beyond = data_blocks - MAX_DIRECT_BLOCKS - POINTERS_PER_BLOCK(c);
+    return (beyond > 0) ? (beyond + POINTERS_PER_BLOCK(c) - 1) / POINTERS_PER_BLOCK(c) : 0;
+}
+
+int pointer_blocks_needed(fs_ctx *c, int data_blocks)
+{
+    // Blocks a file of 'data_blocks' blocks needs for pointers, on top of its data
+    int needed = (data_blocks > MAX_DIRECT_BLOCKS) ? 1 : 0;
+    if (data_blocks > MAX_DIRECT_BLOCKS + POINTERS_PER_BLOCK(c))
+    {
+        needed += 1 + second_level_blocks(c, data_blocks);
+    }
+    return needed;
+}
+
+const int *load_pointer_block(fs_ctx *c, int block)
+{
+    // Returns a copy of the pointers stored in 'block', from indirect_cache when
+    // possible. The copy is per thread and only valid until its next load. NULL on error.
+    static __thread int pointers[MAX_BLOCK_SIZE / sizeof(int)];
+
+    if (block < 0 || block >= c->geo.total_blocks)
+    {
+        return NULL;
+    }
+
+    if (cache_read(c, &c->indirect_cache, block, 0, c->geo.block_size, pointers))
+    {
+        return pointers;
+    }
+
+    STAT_ADD(c, pointer_block_reads, 1);
+    if (disk_read(c, (off_t)block * c->geo.block_size, pointers, c->geo.block_size) != c->geo.block_size)
+    {
+        return NULL;
+    }
+    pthread_rwlock_wrlock(&c->cache_lock);
+    if (unlocked_read == NULL || read_guard_valid(c, unlocked_read))
+    {
+        cache_insert(c, &c->indirect_cache, block, (const char *)pointers, c->geo.block_size);
+    }
+    pthread_rwlock_unlock(&c->cache_lock);
+    return pointers;
+}
+
+int load_pointer(fs_ctx *c, int block, int entry)
+{
+    // Returns one pointer stored in 'block' without copying the whole block on a cache hit, -2 on error
+    int pointer;
+    if (block >= 0 && block < c->geo.total_blocks &&
+        cache_read(c, &c->indirect_cache, block, entry * (int)sizeof(int), sizeof(int), &pointer))
+    {
+        return pointer;
+    }
+
+    const int *pointers = load_pointer_block(c, block);
+    return (pointers != NULL) ? pointers[entry] : -2;
+}
+
+int store_pointer_block(fs_ctx *c, int block, const int *pointers)
+{
+    int written = disk_write(c, (off_t)block * c->geo.block_size, pointers, c->geo.block_size);
+    note_data_written(c);
+    pthread_rwlock_wrlock(&c->cache_lock);
+    if (written == c->geo.block_size)
+    {
+        cache_insert(c, &c->indirect_cache, block, (const char *)pointers, c->geo.block_size);
+    }
+    else
+    {
+        cache_invalidate(&c->indirect_cache, block);
+    }
+    pthread_rwlock_unlock(&c->cache_lock);
+    return (written == c->geo.block_size) ? 0 : -1;
+}
+
+int bmap(fs_ctx *c, const inode *node, int file_block)
+{
+    // Physical block holding block 'file_block' of the file, -1 if none, -2 on error
+    if (node->flags & INODE_EXTENTS)
+    {
+        for (int i = 0; i < MAX_EXTENTS && node->blocks[2 * i + 1] > 0; i++)
+        {
+            if (file_block < node->blocks[2 * i + 1])
+            {
+                return node->blocks[2 * i] + file_block;
+            }
+            file_block -= node->blocks[2 * i + 1];
+        }
+        return -1;
+    }
+
+    if (file_block < MAX_DIRECT_BLOCKS)
+    {
+        return node->blocks[file_block];
+    }
+
+    file_block -= MAX_DIRECT_BLOCKS;
+    if (file_block < POINTERS_PER_BLOCK(c))
+    {
+        if (node->indirect_block == -1)
+        {
+            return -1;
+        }
+        return load_pointer(c, node->indirect_block, file_block);
+    }
+
+    file_block -= POINTERS_PER_BLOCK(c);
+    if (node->double_indirect_block == -1 || file_block / POINTERS_PER_BLOCK(c) >= POINTERS_PER_BLOCK(c))
+    {
+        return -1;
+    }
+    int second = load_pointer(c, node->double_indirect_block, file_block / POINTERS_PER_BLOCK(c));
+    if (second < 0)
+    {
+        return second;
+    }
+    return load_pointer(c, second, file_block % POINTERS_PER_BLOCK(c));
+}
+
+int assign_pointers(fs_ctx *c, int *pointer_block, int first, int count, const int *physical)
+{
+    // Stores 'count' pointers at entries first.. of the pointer block *pointer_block,
+    // allocating a fresh one if it is -1. Returns 0, or -1 on error.
+    int pointers[MAX_BLOCK_SIZE / sizeof(int)];
+    int allocated = (*pointer_block == -1);
+
+    if (allocated)
+    {
+        *pointer_block = find_free_block(c);
+        if (*pointer_block == -1)
+        {
+            return -1;
+        }
+        mark_block_used(c, *pointer_block);
+        for (int i = 0; i < POINTERS_PER_BLOCK(c); i++)
+        {
+            pointers[i] = -1;
+        }
+    }
+    else
+    {
+        const int *current = load_pointer_block(c, *pointer_block);
+        if (current == NULL)
+        {
+            return -1;
+        }
+        memcpy(pointers, current, c->geo.block_size);
+    }
+
+    memcpy(pointers + first, physical, count * sizeof(int));
+    if (store_pointer_block(c, *pointer_block, pointers) != 0)
+    {
+        if (allocated)
+        {
+            mark_block_free(c, *pointer_block);
+            *pointer_block = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int extend_block_map(fs_ctx *c, inode *node, int mapped, int count, const int *physical)
+{
+    // Maps file blocks mapped..mapped+count-1 (the file currently has 'mapped' blocks)
+    // to 'physical', allocating and writing indirect blocks as needed. Pointer entries
+    // past the old end are never trusted, so a rolled-back extension leaves no trace.
+    // Returns how many blocks were mapped, less than 'count' on error.
+    int done = 0;
+    if ((long long)mapped + count > MAX_DIRECT_BLOCKS + POINTERS_PER_BLOCK(c) + (long long)POINTERS_PER_BLOCK(c) * POINTERS_PER_BLOCK(c))
+    {
+        return 0; // Beyond the double indirect block
+    }
+    while (done < count)
+    {
+        int run;
+        int left = count - done;
+        if (mapped < MAX_DIRECT_BLOCKS)
+        {
+            run = (left < MAX_DIRECT_BLOCKS - mapped) ? left : MAX_DIRECT_BLOCKS - mapped;
+            memcpy(node->blocks + mapped, physical + done, run * sizeof(int));
+        }
+        else if (mapped < MAX_DIRECT_BLOCKS + POINTERS_PER_BLOCK(c))
+        {
+            int index = mapped - MAX_DIRECT_BLOCKS;
+            run = (left < POINTERS_PER_BLOCK(c) - index) ? left : POINTERS_PER_BLOCK(c) - index;
+            if (assign_pointers(c, &node->indirect_block, index, run, physical + done) != 0)
+            {
+                return done;
+            }
+        }
+        else
+        {
+            int index = mapped - MAX_DIRECT_BLOCKS - POINTERS_PER_BLOCK(c);
+            int slot = index / POINTERS_PER_BLOCK(c);
+            int within = index % POINTERS_PER_BLOCK(c);
+            run = (left < POINTERS_PER_BLOCK(c) - within) ? left : POINTERS_PER_BLOCK(c) - within;
+
+            // A run starting at entry 0 needs a new second-level block
+            int second = -1;
+            if (within != 0)
+            {
+                const int *top = load_pointer_block(c, node->double_indirect_block);
+                if (top == NULL)
+                {
+                    return done;
+                }
+                second = top[slot];
+            }
+
+            int old_second = second;
+            if (assign_pointers(c, &second, within, run, physical + done) != 0)
+            {
+                return done;
+            }
+            if (second != old_second && assign_pointers(c, &node->double_indirect_block, slot, 1, &second) != 0)
+            {
+                mark_block_free(c, second);
+                return done;
+            }
+        }
+
+        mapped += run;
+        done += run;
+    }
+    return done;
+}
+
+void free_pointer_blocks(fs_ctx *c, const inode *node, int keep, int mapped);
+
+int append_extents(inode *node, int count, const int *physical)
+{
+    // Adds blocks to an extent-mapped file, growing the last extent when they
+    // follow it on disk. Returns -1, leaving the inode unchanged, if more than
+    // MAX_EXTENTS extents would be needed.
+    int extents[MAX_DIRECT_BLOCKS];
+    int used = 0;
+
+    memcpy(extents, node->blocks, sizeof(extents));
+    while (used < MAX_EXTENTS && extents[2 * used + 1] > 0)
+    {
+        used++;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (used > 0 && extents[2 * used - 2] + extents[2 * used - 1] == physical[i])
+        {
+            extents[2 * used - 1]++;
+        }
+        else if (used < MAX_EXTENTS)
+        {
+            extents[2 * used] = physical[i];
+            extents[2 * used + 1] = 1;
+            used++;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    memcpy(node->blocks, extents, sizeof(extents));
+    return 0;
+}
+
+int extend_file_blocks(fs_ctx *c, inode *node, int mapped, int count, const int *physical)
+{
+    // Maps file blocks mapped..mapped+count-1 to 'physical'. An extent-mapped
+    // file that would need too many extents is rewritten as a block-mapped one
+    // with fresh pointer blocks. Returns how many blocks were mapped, less than
+    // 'count' on error.
+    if (!(node->flags & INODE_EXTENTS))
+    {
+        return extend_block_map(c, node, mapped, count, physical);
+    }
+
+    if (append_extents(node, count, physical) == 0)
+    {
+        return count;
+    }
+
+    int *all_blocks = malloc((mapped + count) * sizeof(int));
+    if (all_blocks == NULL)
+    {
+        return 0;
+    }
+    for (int i = 0; i < mapped; i++)
+    {
+        all_blocks[i] = bmap(c, node, i);
+    }
+    memcpy(all_blocks + mapped, physical, count * sizeof(int));
+
+    inode converted = *node;
+    converted.flags &= ~INODE_EXTENTS;
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        converted.blocks[i] = -1;
+    }
+
+    int done = extend_block_map(c, &converted, 0, mapped + count, all_blocks);
+    free(all_blocks);
+    if (done < mapped + count)
+    {
+        free_pointer_blocks(c, &converted, 0, done);
+        return 0;
+    }
+
+    *node = converted;
+    return count;
+}
+
+void free_pointer_blocks(fs_ctx *c, const inode *node, int keep, int mapped)
+{
+    // Frees the indirect blocks of a 'mapped'-block file that a 'keep'-block file would not need
+    if (node->double_indirect_block != -1)
+    {
+        const int *top = load_pointer_block(c, node->double_indirect_block);
+        for (int slot = second_level_blocks(c, keep); top != NULL && slot < second_level_blocks(c, mapped); slot++)
+        {
+            mark_block_free(c, top[slot]); // Does not touch the cached top block
+        }
+        if (keep <= MAX_DIRECT_BLOCKS + POINTERS_PER_BLOCK(c))
+        {
+            mark_block_free(c, node->double_indirect_block);
+        }
+    }
+
+    if (node->indirect_block != -1 && keep <= MAX_DIRECT_BLOCKS)
+    {
+        mark_block_free(c, node->indirect_block);
+    }
+}
+
+void free_file_blocks(fs_ctx *c, const inode *node, int keep, int mapped)
+{
+    // Frees data blocks keep..mapped-1 and the indirect blocks a 'keep'-block file no longer needs
+    for (int i = keep; i < mapped; i++)
+    {
+        int block = bmap(c, node, i);
+        if (block >= 0)
+        {
+            mark_block_free(c, block);
+        }
+    }
+    free_pointer_blocks(c, node, keep, mapped);
+}
+
+void discard_extension(fs_ctx *c, const inode *before, const inode *after, int old_blocks, const int *new_blocks, int new_count,
+                       int mapped)
+{
+    // Undoes allocate_blocks and extend_file_blocks (which mapped 'mapped' of the
+    // 'new_count' blocks) after a failed write: frees the new data blocks and the
+    // pointer blocks 'after' has but 'before' does not
+    for (int i = 0; i < new_count; i++)
+    {
+        mark_block_free(c, new_blocks[i]);
+    }
+
+    // A file converted from extents owns none of its pointer blocks yet
+    int keep = ((before->flags & INODE_EXTENTS) && !(after->flags & INODE_EXTENTS)) ? 0 : old_blocks;
+    free_pointer_blocks(c, after, keep, old_blocks + mapped);
+}
+
+long long transfer_file_range(fs_ctx *c, int writing, const inode *node, long long position, long long length, char *buffer,
+                              int advance, const int *new_blocks, int first_new)
+{
+    // Moves the file bytes [position, position + length) through 'buffer', one
+    // segment per block and up to TRANSFER_BATCH segments per disk_transfer. With
+    // advance == 0 every segment uses the start of the buffer (zero fill). File
+    // blocks from 'first_new' on are not mapped yet and are in 'new_blocks'
+    // (NULL and INT_MAX when all are mapped). Returns the bytes moved before a
+    // short transfer or an unmapped block, or -1 on error.
+    block_segment segments[TRANSFER_BATCH];
+    long long total = 0;
+
+    while (length > 0)
+    {
+        int count = 0;
+        int batch_bytes = 0;
+        while (count < TRANSFER_BATCH && length > 0)
+        {
+            int file_block = (int)(position / c->geo.block_size);
+            int block = (file_block >= first_new) ? new_blocks[file_block - first_new] : bmap(c, node, file_block);
+            if (block == -1)
+            {
+                break; // Unmapped block: the file ends here
+            }
+            if (block < 0 || block >= c->geo.total_blocks)
+            {
+                return -1; // Invalid block index
+            }
+
+            int within = (int)(position % c->geo.block_size);
+            int chunk = (length < c->geo.block_size - within) ? (int)length : c->geo.block_size - within;
+            segments[count].block = block;
+            segments[count].offset = within;
+            segments[count].buffer = buffer;
+            segments[count].length = chunk;
+            count++;
+
+            if (advance)
+            {
+                buffer += chunk;
+            }
+            batch_bytes += chunk;
+            position += chunk;
+            length -= chunk;
+        }
+
+        if (count == 0)
+        {
+            break;
+        }
+
+        int moved = writing ? disk_transfer(c, 1, segments, count) : read_segments(c, segments, count);
+        if (moved < 0)
+        {
+            return -1;
+        }
+        total += moved;
+        if (moved < batch_bytes)
+        {
+            break;
+        }
+    }
+    return total;
+}
+
+int calculate_blocks_needed(fs_ctx *c, long long size)
+{
+    if (size <= 0)
+    {
+        return 0; // No blocks needed for zero or negative size
+    }
+    return (int)((size + c->geo.block_size - 1) / c->geo.block_size); // Calculate number of blocks needed
+}
+
+int file_blocks_held(fs_ctx *c, const inode *node)
+{
+    // Blocks free_file_blocks(c, node, 0, ...) releases for the whole file, pointer blocks included
+    int mapped = calculate_blocks_needed(c, node->size);
+    int held = 0;
+    for (int i = 0; i < mapped; i++)
+    {
+        held += (bmap(c, node, i) >= 0);
+    }
+    if (node->double_indirect_block != -1)
+    {
+        const int *top = load_pointer_block(c, node->double_indirect_block);
+        for (int slot = 0; top != NULL && slot < second_level_blocks(c, mapped); slot++)
+        {
+            held += (top[slot] >= 0);
+        }
+        held++;
+    }
+    return held + (node->indirect_block != -1);
+}
+
+uint64_t checksum_bytes(const char *data, int length)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int journal_add_record(char *buffer, int pos, int offset, const void *data, int length)
+{
+    // Appends one record at 'pos', or only measures it if buffer is NULL
+    if (buffer != NULL)
+    {
+        journal_record record = {offset, length};
+        memcpy(buffer + pos, &record, sizeof(record));
+        memcpy(buffer + pos + sizeof(record), data, length);
+    }
+    return pos + sizeof(journal_record) + length;
+}
+
+char *metadata_location(fs_ctx *c, int offset, int length)
+{
+    // Maps an image byte range onto the in-memory copy of the metadata it belongs to
+    if (offset < 0 || length < 0)
+    {
+        return NULL;
+    }
+    if (offset + length <= (int)sizeof(superblock))
+    {
+        return (char *)&c->sb + offset;
+    }
+    if (offset >= c->geo.block_size && offset + length <= c->geo.block_size + BITMAP_BYTES(c))
+    {
+        return c->bitmap + (offset - c->geo.block_size);
+    }
+    if (offset >= INODE_TABLE_OFFSET(c) && offset + length <= INODE_TABLE_OFFSET(c) + INODE_TABLE_BYTES(c))
+    {
+        return (char *)c->inode_table + (offset - INODE_TABLE_OFFSET(c));
+    }
+    return NULL;
+}
+
+int flush_metadata_writes(fs_ctx *c, disk_request *requests, int count)
+{
+    // Returns 0, or -1 if any range did not reach the image
+    int result = 0;
+    disk_batch_io(c, 1, requests, count);
+    for (int i = 0; i < count; i++)
+    {
+        if (requests[i].moved == requests[i].length)
+        {
+            STAT_ADD(c, metadata_bytes_written, requests[i].length);
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int queue_metadata_write(fs_ctx *c, disk_request *requests, struct iovec *iov, int queued, int *failed, off_t offset, void *data,
+                         int length)
+{
+    // Adds one home-location write to the checkpoint batch, writing the batch out
+    // once IO_RING_ENTRIES are queued (and setting *failed if it falls short).
+    // Returns the number now queued.
+    iov[queued].iov_base = data;
+    iov[queued].iov_len = length;
+    requests[queued].offset = offset;
+    requests[queued].iov = &iov[queued];
+    requests[queued].iovcnt = 1;
+    requests[queued].length = length;
+    queued++;
+    if (queued == IO_RING_ENTRIES)
+    {
+        if (flush_metadata_writes(c, requests, queued) != 0)
+        {
+            *failed = 1;
+        }
+        queued = 0;
+    }
+    return queued;
+}
+
+int collect_records(fs_ctx *c, char *buffer, int pos, int *count)
+{
+    // Writes a record for every metadata range changed since the last commit into
+    // 'buffer' from 'pos', or only measures them if buffer is NULL. Returns the end
+    // position and sets *count to the number of records.
+    *count = 0;
+    if (c->sb_dirty)
+    {
+        pos = journal_add_record(buffer, pos, 0, &c->sb, sizeof(superblock));
+        (*count)++;
+    }
+
+    for (int b = 0; b < c->geo.bitmap_blocks; b++)
+    {
+        dirty_range *range = &c->journal_bitmap_dirty[b];
+        if (range->lo < range->hi)
+        {
+            pos = journal_add_record(buffer, pos, c->geo.block_size + range->lo, c->bitmap + range->lo,
+                                     range->hi - range->lo);
+            (*count)++;
+        }
+    }
+
+    // One record per run of adjacent dirty inodes
+    for (int i = 0; i < c->geo.total_inodes; i++)
+    {
+        if (c->journal_inode_dirty[i])
+        {
+            int run_end = i;
+            while (run_end < c->geo.total_inodes && c->journal_inode_dirty[run_end])
+            {
+                run_end++;
+            }
+            pos = journal_add_record(buffer, pos, INODE_TABLE_OFFSET(c) + i * (int)sizeof(inode), &c->inode_table[i],
+                                     (run_end - i) * (int)sizeof(inode));
+            (*count)++;
+            i = run_end;
+        }
+    }
+    return pos;
+}
+
+void release_spill(fs_ctx *c)
+{
+    // Makes the blocks of a retired spilled transaction allocatable again
+    char *map = c->spill_map;
+    if (map == NULL)
+    {
+        return;
+    }
+    c->spill_map = NULL; // Before the summary rereads availability
+    for (int byte = 0; byte < BITMAP_BYTES(c); byte++)
+    {
+        unsigned char reserved = map[byte];
+        while (reserved != 0)
+        {
+            summary_adjust(c, byte * 8 + __builtin_ctz(reserved), 1);
+            reserved &= reserved - 1;
+        }
+    }
+    free(map);
+}
+
+int spill_records(fs_ctx *c, int length, int record_count)
+{
+    // For a transaction larger than JOURNAL_MAX_TXN(c): writes its 'length' bytes of
+    // records to free data blocks and stages, in journal_buffer, a journal
+    // transaction body holding one JOURNAL_SPILL record that lists them. The blocks
+    // stay free on the image but are kept from the allocator until a checkpoint
+    // retires the transaction. Returns the end position in journal_buffer, or -1
+    // if there is not enough free space or memory.
+    int block_size = c->geo.block_size;
+    int needed = (int)(((long long)length + block_size - 1) / block_size);
+    int pos = sizeof(journal_header) + sizeof(journal_record) + sizeof(spill_header);
+    int max_runs = (JOURNAL_MAX_TXN(c) - pos - 8) / (2 * (int)sizeof(int));
+    int *runs = (int *)(c->journal_buffer + pos);
+    int run_count = 0;
+    int found = 0;
+    if (c->spill_map != NULL)
+    {
+        return -1; // An earlier spill still waits for its checkpoint
+    }
+
+    // Gather free runs, lowest first, without touching the allocator's state
+    for (int word = 0; word < summary_groups(c, 0) && found < needed; word++)
+    {
+        uint64_t available = ~load_unavailable_word(c, word);
+        while (available != 0 && found < needed)
+        {
+            int block = word * 64 + __builtin_ctzll(available);
+            available &= available - 1;
+            if (run_count > 0 && runs[2 * run_count - 2] + runs[2 * run_count - 1] == block)
+            {
+                runs[2 * run_count - 1]++;
+            }
+            else if (run_count < max_runs)
+            {
+                runs[2 * run_count] = block;
+                runs[2 * run_count + 1] = 1;
+                run_count++;
+            }
+            else
+            {
+                return -1; // Free space too fragmented to list
+            }
+            found++;
+        }
+    }
+    if (found < needed)
+    {
+        return -1;
+    }
+
+    char *stream = calloc((size_t)needed, block_size);
+    char *reserved = calloc(BITMAP_BYTES(c), 1);
+    if (stream == NULL || reserved == NULL)
+    {
+        free(stream);
+        free(reserved);
+        return -1;
+    }
+    collect_records(c, stream, 0, &record_count);
+
+    int written = 0;
+    for (int r = 0; r < run_count && written >= 0; r++)
+    {
+        int bytes = runs[2 * r + 1] * block_size;
+        if (disk_write(c, (off_t)runs[2 * r] * block_size, stream + (size_t)written, bytes) != bytes)
+        {
+            written = -1;
+            break;
+        }
+        written += bytes;
+    }
+    note_data_written(c);
+    spill_header spill = {length, record_count, run_count, checksum_bytes(stream, length)};
+    free(stream);
+    if (written < 0)
+    {
+        free(reserved);
+        return -1;
+    }
+
+    c->spill_map = reserved; // Before the summary rereads availability
+    for (int r = 0; r < run_count; r++)
+    {
+        for (int block = runs[2 * r]; block < runs[2 * r] + runs[2 * r + 1]; block++)
+        {
+            reserved[block / 8] |= (1 << (block % 8));
+            summary_adjust(c, block, -1);
+        }
+    }
+
+    journal_record record = {JOURNAL_SPILL, (int)sizeof(spill) + run_count * 2 * (int)sizeof(int)};
+    memcpy(c->journal_buffer + sizeof(journal_header), &record, sizeof(record));
+    memcpy(c->journal_buffer + sizeof(journal_header) + sizeof(record), &spill, sizeof(spill));
+    return pos + run_count * 2 * (int)sizeof(int);
+}
+
+int checkpoint_metadata(fs_ctx *c)
+{
+    // Copy committed metadata to its home location, then advance sb.journal_seq
+    // so the transactions already applied are not replayed again. The bitmap and
+    // inode-table ranges are independent and go out in batches. Returns 0, or -1
+    // if a write failed: everything then stays dirty and the journal in use, so
+    // the next checkpoint writes it all again.
+    disk_request requests[IO_RING_ENTRIES];
+    struct iovec iov[IO_RING_ENTRIES];
+    int queued = 0;
+    int failed = 0;
+
+    for (int b = 0; b < c->geo.bitmap_blocks; b++)
+    {
+        if (c->bitmap_dirty[b].lo < c->bitmap_dirty[b].hi)
+        {
+            int length = c->bitmap_dirty[b].hi - c->bitmap_dirty[b].lo;
+            queued = queue_metadata_write(c, requests, iov, queued, &failed, c->geo.block_size + c->bitmap_dirty[b].lo,
+                                          c->bitmap + c->bitmap_dirty[b].lo, length);
+        }
+    }
+
+    for (int b = 0; b < INODE_TABLE_BLOCKS(c); b++)
+    {
+        if (c->inode_blocks_dirty[b])
+        {
+            int start = b * c->geo.block_size;
+            int length = (start + c->geo.block_size > INODE_TABLE_BYTES(c)) ? INODE_TABLE_BYTES(c) - start : c->geo.block_size;
+            queued = queue_metadata_write(c, requests, iov, queued, &failed, INODE_TABLE_OFFSET(c) + start,
+                                          (char *)c->inode_table + start, length);
+        }
+    }
+    if (flush_metadata_writes(c, requests, queued) != 0 || failed)
+    {
+        return -1;
+    }
+    // The home copies must be stable before the superblock retires the journal. LAZY
+    // needs this too: the transactions an earlier fs_sync flushed are about to be
+    // overwritten by the next commits.
+    if (c->durability != FS_DURABILITY_NONE && flush_image(c) != 0)
+    {
+        return -1;
+    }
+
+    // Superblock goes last: until it lands, a crash replays the journal over the home copies.
+    // The copy in memory keeps the sequence on the image, which journal records carry.
+    superblock sb = c->sb;
+    sb.journal_seq = c->journal_sequence;
+    if (disk_write(c, 0, &sb, sizeof(superblock)) != sizeof(superblock))
+    {
+        return -1;
+    }
+    STAT_ADD(c, metadata_bytes_written, sizeof(superblock));
+    c->sb.journal_seq = c->journal_sequence;
+
+    c->journal_head = 0;
+    STAT_ADD(c, checkpoints, 1);
+    clear_metadata_dirty(c);
+    release_spill(c); // Replay no longer reads it
+    return 0;
+}
+
+int checkpoint_committed(fs_ctx *c);
+
+void release_pending_frees(fs_ctx *c)
+{
+    // Blocks freed since the last commit become allocatable. They lie inside the
+    // ranges the next commit writes, so only those are visited.
+    for (int b = 0; b < c->geo.bitmap_blocks; b++)
+    {
+        dirty_range *range = &c->journal_bitmap_dirty[b];
+        for (int byte = range->lo; byte < range->hi; byte++)
+        {
+            unsigned char released = c->pending_free[byte] & ~c->bitmap[byte];
+            c->pending_free[byte] = 0;
+            while (released != 0)
+            {
+                summary_adjust(c, byte * 8 + __builtin_ctz(released), 1);
+                released &= released - 1;
+            }
+        }
+    }
+    c->pending_free_count = 0;
+}
+
+int journal_commit(fs_ctx *c)
+{
+    // Returns 0, or -1 if the transaction did not reach the journal (its changes
+    // then stay pending for the next commit) or, in the flushing modes, could not
+    // be flushed. A checkpoint that failed after the last commit left too little
+    // room; nothing is committed until one succeeds. That one must not write the
+    // changes this commit is about to journal, so it replays the journal instead.
+    if (JOURNAL_BYTES(c) - c->journal_head < JOURNAL_MAX_TXN(c) && checkpoint_committed(c) != 0)
+    {
+        return -1;
+    }
+
+    int record_count;
+    int pos = collect_records(c, NULL, sizeof(journal_header), &record_count);
+    int spilled = 0;
+    if (record_count > 0 && ((pos + 7) & ~7) > JOURNAL_MAX_TXN(c))
+    {
+        pos = spill_records(c, pos - (int)sizeof(journal_header), record_count);
+        if (pos < 0)
+        {
+            return -1; // Nothing written; the changes stay pending
+        }
+        record_count = 1;
+        spilled = 1;
+    }
+    else if (record_count > 0)
+    {
+        collect_records(c, c->journal_buffer, sizeof(journal_header), &record_count);
+    }
+
+    if (record_count > 0)
+    {
+        journal_header header;
+        header.magic = JOURNAL_MAGIC;
+        header.sequence = c->journal_sequence;
+        header.length = pos - sizeof(journal_header);
+        header.record_count = record_count;
+        header.checksum = checksum_bytes(c->journal_buffer + sizeof(journal_header), header.length);
+        memcpy(c->journal_buffer, &header, sizeof(header));
+
+        int padded = (pos + 7) & ~7; // Keep headers 8-byte aligned
+        memset(c->journal_buffer + pos, 0, padded - pos);
+
+        // The flushing modes make the data stable first, then the record that points to it
+        if (flushes_commits(c) && flush_data(c) != 0)
+        {
+            if (spilled)
+            {
+                release_spill(c); // Not committed, so its blocks are free again
+            }
+            return -1;
+        }
+
+        // The whole group of operations lands with one sequential write
+        if (disk_write(c, JOURNAL_START(c) * c->geo.block_size + c->journal_head, c->journal_buffer, padded) != padded)
+        {
+            if (spilled)
+            {
+                release_spill(c); // Its blocks are free again, and the next commit spills anew
+            }
+            return -1; // Replay stops at the torn transaction, and the next commit rewrites it
+        }
+        STAT_ADD(c, metadata_bytes_written, padded);
+        STAT_ADD(c, journal_bytes_written, padded);
+        STAT_ADD(c, journal_commits, 1);
+
+        c->journal_head += padded;
+        c->journal_sequence++;
+    }
+    c->ops_since_commit = 0;
+    int result = 0;
+    if (record_count > 0 && flushes_commits(c) && flush_image(c) != 0)
+    {
+        result = -1;
+    }
+
+    release_pending_frees(c);
+    reset_dirty_ranges(c, c->journal_bitmap_dirty);
+    memset(c->journal_inode_dirty, 0, c->geo.total_inodes);
+    c->journal_pending_bytes = 0;
+
+    // Leave room for a worst-case transaction so the next commit never has to checkpoint
+    // first, and retire a spilled one at once so its blocks can be handed out again.
+    // This commit is in the journal either way, so a failure here is retried later.
+    if (spilled || JOURNAL_BYTES(c) - c->journal_head < JOURNAL_MAX_TXN(c))
+    {
+        checkpoint_metadata(c);
+    }
+    return result;
+}
+
+int read_spill(fs_ctx *c, const char *records, const journal_header *header, char **spilled)
+{
+    // If the transaction at 'records' is a spilled one, reads its records into a
+    // buffer the caller frees and points *spilled at it. Leaves *spilled NULL when
+    // the transaction is not spilled or its spilled records fail the checks, so
+    // replay stops there. Returns 0, or -1 on a read error or out of memory.
+    journal_record record;
+    spill_header spill;
+    if (header->record_count != 1 || header->length < (int)(sizeof(record) + sizeof(spill)))
+    {
+        return 0;
+    }
+    memcpy(&record, records, sizeof(record));
+    memcpy(&spill, records + sizeof(record), sizeof(spill));
+    if (record.offset != JOURNAL_SPILL || spill.run_count < 0 || spill.length < 0 ||
+        record.length != (int)sizeof(spill) + spill.run_count * 2 * (int)sizeof(int) ||
+        record.length > header->length - (int)sizeof(record))
+    {
+        return 0;
+    }
+
+    const char *runs = records + sizeof(record) + sizeof(spill);
+    long long capacity = 0;
+    for (int r = 0; r < spill.run_count; r++)
+    {
+        int run[2];
+        memcpy(run, runs + r * sizeof(run), sizeof(run));
+        if (run[0] < DATA_START(c) || run[1] <= 0 || run[1] > c->geo.total_blocks - run[0])
+        {
+            return 0;
+        }
+        capacity += (long long)run[1] * c->geo.block_size;
+    }
+    if (capacity != ((long long)spill.length + c->geo.block_size - 1) / c->geo.block_size * c->geo.block_size ||
+        capacity > INT_MAX)
+    {
+        return 0; // spill_records takes just the blocks the records need
+    }
+
+    char *stream = malloc(capacity > 0 ? (size_t)capacity : 1);
+    if (stream == NULL)
+    {
+        return -1;
+    }
+    long long done = 0;
+    for (int r = 0; r < spill.run_count; r++)
+    {
+        int run[2];
+        memcpy(run, runs + r * sizeof(run), sizeof(run));
+        int bytes = run[1] * c->geo.block_size;
+        if (disk_read(c, (off_t)run[0] * c->geo.block_size, stream + done, bytes) != bytes)
+        {
+            free(stream);
+            return -1;
+        }
+        done += bytes;
+    }
+    if (spill.checksum != checksum_bytes(stream, spill.length))
+    {
+        free(stream);
+        return 0;
+    }
+    *spilled = stream;
+    return 0;
+}
+
+int apply_journal(fs_ctx *c, int end, int to_disk)
+{
+    // Applies the committed transactions in the first 'end' bytes of the journal,
+    // starting at sb.journal_seq: to the metadata in memory, or with 'to_disk' to
+    // the home copies on the image. Each one is read on its own, so this costs the
+    // transactions present, not the journal size. Returns the number applied and
+    // leaves the next sequence in journal_sequence, or returns -1 on an I/O error
+    // or out of memory.
+    int pos = 0;
+    int replayed = 0;
+    int sequence = c->sb.journal_seq;
+
+    while (pos + (int)sizeof(journal_header) <= end)
+    {
+        journal_header header;
+        if (disk_read(c, (off_t)JOURNAL_START(c) * c->geo.block_size + pos, &header, sizeof(header)) != sizeof(header))
+        {
+            return -1;
+        }
+
+        char *records = c->journal_buffer + sizeof(journal_header);
+        if (header.magic != JOURNAL_MAGIC || header.sequence != sequence || header.length < 0 ||
+            header.length > JOURNAL_BYTES(c) - pos - (int)sizeof(journal_header) ||
+            header.length > JOURNAL_MAX_TXN(c) - (int)sizeof(journal_header))
+        {
+            break; // End of the committed transactions
+        }
+        if (disk_read(c, (off_t)JOURNAL_START(c) * c->geo.block_size + pos + sizeof(journal_header), records, header.length) !=
+            header.length)
+        {
+            return -1;
+        }
+        if (header.checksum != checksum_bytes(records, header.length))
+        {
+            break; // Torn write of the last transaction
+        }
+
+        int length = header.length;
+        int record_count = header.record_count;
+        char *spilled = NULL;
+        if (read_spill(c, records, &header, &spilled) != 0)
+        {
+            return -1;
+        }
+        if (spilled != NULL)
+        {
+            spill_header spill;
+            memcpy(&spill, records + sizeof(journal_record), sizeof(spill));
+            records = spilled;
+            length = spill.length;
+            record_count = spill.record_count;
+        }
+
+        // Check every record before applying any, so a bad transaction is skipped as a whole
+        int valid = 1;
+        int offset = 0;
+        for (int r = 0; r < record_count && valid; r++)
+        {
+            journal_record record;
+            if (offset + (int)sizeof(record) > length)
+            {
+                valid = 0;
+                break;
+            }
+            memcpy(&record, records + offset, sizeof(record));
+            offset += sizeof(record);
+            if (record.length < 0 || record.length > length - offset ||
+                metadata_location(c, record.offset, record.length) == NULL)
+            {
+                valid = 0;
+                break;
+            }
+            offset += record.length;
+        }
+        if (!valid)
+        {
+            free(spilled);
+            break;
+        }
+
+        offset = 0;
+        for (int r = 0; r < record_count; r++)
+        {
+            journal_record record;
+            memcpy(&record, records + offset, sizeof(record));
+            offset += sizeof(record);
+            if (!to_disk)
+            {
+                memcpy(metadata_location(c, record.offset, record.length), records + offset, record.length);
+            }
+            else if (disk_write(c, record.offset, records + offset, record.length) != record.length)
+            {
+                free(spilled);
+                return -1;
+            }
+            else
+            {
+                STAT_ADD(c, metadata_bytes_written, record.length);
+            }
+            offset += record.length;
+        }
+        free(spilled);
+
+        pos += (sizeof(journal_header) + header.length + 7) & ~7;
+        sequence++;
+        replayed++;
+    }
+    if (!to_disk)
+    {
+        c->journal_sequence = sequence;
+    }
+    else if (sequence != c->journal_sequence)
+    {
+        return -1; // A committed transaction did not read back
+    }
+    return replayed;
+}
+
+int journal_replay(fs_ctx *c)
+{
+    // Applies every committed transaction newer than the last checkpoint
+    int replayed = apply_journal(c, JOURNAL_BYTES(c), 0);
+    if (replayed < 0)
+    {
+        return -1;
+    }
+
+    if (replayed > 0)
+    {
+        // Everything may differ from the home copies now
+        c->sb_dirty = 1;
+        for (int b = 0; b < c->geo.bitmap_blocks; b++)
+        {
+            c->bitmap_dirty[b].lo = b * c->geo.block_size;
+            c->bitmap_dirty[b].hi = (b + 1) * c->geo.block_size;
+        }
+        memset(c->inode_blocks_dirty, 1, INODE_TABLE_BLOCKS(c));
+        if (checkpoint_metadata(c) != 0)
+        {
+            return -1;
+        }
+    }
+    c->journal_head = 0;
+    return replayed;
+}
+
+int checkpoint_committed(fs_ctx *c)
+{
+    // Brings the home copies up to the last commit, and no further, by replaying the
+    // journal onto them, then retires the journal. For a commit that finds too little
+    // room: the changes it is about to journal never reach the home copies
+    // unjournaled. The ranges in memory stay dirty, so the next checkpoint_metadata
+    // still writes the changes committed since. Returns 0, or -1 as checkpoint_metadata.
+    if (c->journal_head == 0)
+    {
+        return 0;
+    }
+    if (apply_journal(c, c->journal_head, 1) < 0)
+    {
+        return -1;
+    }
+    if (c->durability != FS_DURABILITY_NONE && flush_image(c) != 0)
+    {
+        return -1;
+    }
+
+    // Replayed superblock records carry the old sequence, so it is written last on its own
+    int sequence = c->journal_sequence;
+    if (disk_write(c, offsetof(superblock, journal_seq), &sequence, sizeof(sequence)) != sizeof(sequence))
+    {
+        return -1;
+    }
+    STAT_ADD(c, metadata_bytes_written, sizeof(sequence));
+    c->sb.journal_seq = sequence;
+
+    c->journal_head = 0;
+    STAT_ADD(c, checkpoints, 1);
+    release_spill(c); // Replay no longer reads it
+    return 0;
+}
+
+void make_blocks_allocatable(fs_ctx *c, int blocks_needed)
+{
+    // Freed blocks become reusable once their release is committed; commit early
+    // rather than fail an allocation that only they could satisfy. An open
+    // transaction commits as a whole, so its frees wait for fs_txn_commit.
+    if (!c->txn.active && c->pending_free_count > 0 &&
+        blocks_needed > c->sb.free_blocks - c->reserved_blocks - c->pending_free_count)
+    {
+        journal_commit(c);
+    }
+}
+
+int reserve_blocks(fs_ctx *c, int goal, int count, int total, int *blocks)
+{
+    // Lets a writer move its data without alloc_lock: picks 'count' blocks into
+    // 'blocks' as allocate_blocks would, and holds 'total' blocks of free space
+    // in all, the rest for pointer blocks, until end_reservation. The bitmap does
+    // not change, so a commit meanwhile records nothing of the write. Returns 0,
+    // or -2 if there is not enough space.
+    make_blocks_allocatable(c, total);
+    if (total > c->sb.free_blocks - c->reserved_blocks || allocate_blocks(c, goal, count, blocks, 1) != 0)
+    {
+        return -2;
+    }
+    c->reserved_blocks += total;
+    return 0;
+}
+
+void end_reservation(fs_ctx *c, const int *blocks, int count, int total, int keep)
+{
+    // Gives back what reserve_blocks held. With 'keep' the blocks are allocated
+    // instead, and the space for pointer blocks is left for the caller to take.
+    c->reserved_blocks -= total;
+    for (int i = 0; i < count; i++)
+    {
+        unreserve_block(c, blocks[i]);
+        if (keep)
+        {
+            mark_block_used(c, blocks[i]);
+        }
+    }
+}
+
+int commit_threshold(fs_ctx *c)
+{
+    // Operations whose metadata changes are grouped into one journal commit
+    switch (c->durability)
+    {
+    case FS_DURABILITY_STRICT:
+        return 1;
+    case FS_DURABILITY_PERIODIC:
+        return (c->flush_operations > 0) ? c->flush_operations : INT_MAX;
+    case FS_DURABILITY_LAZY:
+        return INT_MAX; // Until fs_sync or fs_unmount
+    default:
+        return c->commit_interval;
+    }
+}
+
+int sync_metadata_to_disk(fs_ctx *c)
+{
+    // Returns 0, or -1 if a commit it ran failed
+    if (c->disk_fd < 0 || c->in_batch || c->txn.active)
+    {
+        return 0; // The batch or transaction syncs once at its end
+    }
+
+    // Group commit: the metadata changes of up to commit_threshold(c) operations
+    // share one journal transaction
+    STAT_ADD(c, metadata_syncs, 1);
+    c->ops_since_commit++;
+    if (c->ops_since_commit >= commit_threshold(c) || c->journal_pending_bytes > JOURNAL_MAX_TXN(c) / 2)
+    {
+        return journal_commit(c); // Also, in every mode, before the group outgrows the journal
+    }
+    return 0;
+}
+
+int sync_data_to_disk(fs_ctx *c)
+{
+    // For writes that changed file data but no metadata, so no commit flushes them.
+    // Returns 0, or -1 if the flush failed.
+    if (c->durability == FS_DURABILITY_STRICT && !c->in_batch && !c->txn.active)
+    {
+        return flush_image(c);
+    }
+    return 0;
+}
+
+void free_inode_locks(fs_ctx *c)
+{
+    if (c->inode_locks != NULL)
+    {
+        for (int i = 0; i < c->geo.total_inodes; i++)
+        {
+            pthread_rwlock_destroy(&c->inode_locks[i]);
+        }
+        free(c->inode_locks);
+        c->inode_locks = NULL;
+    }
+}
+
+int geometry_init(fs_ctx *c, int block_size, int total_blocks, int total_inodes)
+{
+    // Derives the layout from the superblock fields and sizes the metadata arrays
+    // for it. Returns 0, or -1 if the geometry is unsupported or memory is exhausted.
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 ||
+        total_inodes < 1 || total_inodes > MAX_INODE_COUNT || total_blocks < 1 || total_blocks > MAX_BLOCK_COUNT)
+    {
+        return -1;
+    }
+
+    geometry layout;
+    layout.block_size = block_size;
+    layout.total_blocks = total_blocks;
+    layout.total_inodes = total_inodes;
+    layout.bitmap_blocks = (total_blocks + block_size * 8 - 1) / (block_size * 8);
+    layout.inode_start = 1 + layout.bitmap_blocks;
+    layout.journal_start = layout.inode_start + (total_inodes * INODE_SLOT_BYTES + block_size - 1) / block_size;
+    layout.name_index_size = 1;
+    while (layout.name_index_size < total_inodes * 2)
+    {
+        layout.name_index_size *= 2;
+    }
+
+    // Room for two worst-case transactions, so a commit rarely has to checkpoint first.
+    // A transaction holds the superblock, a record per bitmap block and one per run of
+    // dirty inodes, at most every other one. Large images cap it at JOURNAL_TXN_BUDGET;
+    // operations commit before reaching that, and a transaction that still exceeds it
+    // spills to data blocks.
+    int table_bytes = (int)sizeof(inode) * total_inodes;
+    int bitmap_bytes = layout.bitmap_blocks * block_size;
+    long long max_records = 1 + layout.bitmap_blocks + (total_inodes + 1) / 2;
+    long long worst_txn = (long long)(sizeof(journal_header) + max_records * sizeof(journal_record) + sizeof(superblock)) +
+                          bitmap_bytes + table_bytes + 8;
+    layout.journal_max_txn = (worst_txn < JOURNAL_TXN_BUDGET) ? (int)worst_txn : JOURNAL_TXN_BUDGET;
+    int journal_bytes = (2 * layout.journal_max_txn > MIN_JOURNAL_BYTES) ? 2 * layout.journal_max_txn : MIN_JOURNAL_BYTES;
+    layout.journal_blocks = (journal_bytes + block_size - 1) / block_size;
+    if (layout.journal_start + layout.journal_blocks >= total_blocks)
+    {
+        return -1; // No data blocks left
+    }
+
+    int table_blocks = (table_bytes + block_size - 1) / block_size;
+    inode *table = calloc(total_inodes, sizeof(inode));
+    char *map = calloc(bitmap_bytes, 1);
+    char *freed = calloc(bitmap_bytes, 1);
+    char *reserved = calloc(bitmap_bytes, 1);
+    dirty_range *map_dirty = malloc(layout.bitmap_blocks * sizeof(dirty_range));
+    dirty_range *map_journal = malloc(layout.bitmap_blocks * sizeof(dirty_range));
+    int *index = calloc(layout.name_index_size, sizeof(int));
+    char *table_dirty = calloc(table_blocks, 1);
+    char *inode_dirty = calloc(total_inodes, 1);
+    char *txn = malloc(layout.journal_max_txn);
+    pthread_rwlock_t *locks = malloc(total_inodes * sizeof(pthread_rwlock_t));
+    unsigned int *sequences = calloc(total_inodes, sizeof(unsigned int));
+    if (table == NULL || map == NULL || freed == NULL || reserved == NULL || map_dirty == NULL || map_journal == NULL || index == NULL ||
+        table_dirty == NULL || inode_dirty == NULL || txn == NULL || locks == NULL || sequences == NULL)
+    {
+        free(table);
+        free(map);
+        free(freed);
+        free(reserved);
+        free(map_dirty);
+        free(map_journal);
+        free(index);
+        free(table_dirty);
+        free(inode_dirty);
+        free(txn);
+        free(locks);
+        free(sequences);
+        return -1;
+    }
+    for (int i = 0; i < total_inodes; i++)
+    {
+        pthread_rwlock_init(&locks[i], NULL);
+    }
+
+    free(c->inode_table);
+    free(c->bitmap);
+    free(c->pending_free);
+    free(c->reserved_map);
+    free(c->bitmap_dirty);
+    free(c->journal_bitmap_dirty);
+    free(c->name_index);
+    free(c->inode_blocks_dirty);
+    free(c->journal_inode_dirty);
+    free(c->journal_buffer);
+    free(c->spill_map);
+    free_inode_locks(c);
+    free(c->inode_seq);
+    c->inode_table = table;
+    c->bitmap = map;
+    c->pending_free = freed;
+    c->reserved_map = reserved;
+    c->bitmap_dirty = map_dirty;
+    c->journal_bitmap_dirty = map_journal;
+    c->name_index = index;
+    c->inode_blocks_dirty = table_dirty;
+    c->journal_inode_dirty = inode_dirty;
+    c->journal_buffer = txn;
+    c->spill_map = NULL;
+    c->inode_locks = locks;
+    c->inode_seq = sequences;
+    c->geo = layout;
+    reset_dirty_ranges(c, c->bitmap_dirty);
+    reset_dirty_ranges(c, c->journal_bitmap_dirty);
+    return 0;
+}
+
+void free_metadata_arrays(fs_ctx *c)
+{
+    // Frees everything geometry_init and summary_build allocated for the context,
+    // leaving it as before the first geometry_init
+    free(c->inode_table);
+    free(c->bitmap);
+    free(c->pending_free);
+    free(c->reserved_map);
+    free(c->bitmap_dirty);
+    free(c->journal_bitmap_dirty);
+    free(c->name_index);
+    free(c->inode_blocks_dirty);
+    free(c->journal_inode_dirty);
+    free(c->journal_buffer);
+    free(c->spill_map);
+    free_inode_locks(c);
+    free(c->inode_seq);
+    c->inode_table = NULL;
+    c->bitmap = NULL;
+    c->pending_free = NULL;
+    c->reserved_map = NULL;
+    c->bitmap_dirty = NULL;
+    c->journal_bitmap_dirty = NULL;
+    c->name_index = NULL;
+    c->inode_blocks_dirty = NULL;
+    c->journal_inode_dirty = NULL;
+    c->journal_buffer = NULL;
+    c->spill_map = NULL;
+    c->inode_seq = NULL;
+    for (int level = 0; level < SUMMARY_LEVELS; level++)
+    {
+        free(c->free_summary[level]);
+        free(c->free_summary_count[level]);
+        c->free_summary[level] = NULL;
+        c->free_summary_count[level] = NULL;
+    }
+}
+
+int begin_unlocked_read(fs_ctx *c, const char *filename, read_guard *guard)
+{
+    // Starts a lock-free read if no create, delete or write of the file is running.
+    // Returns 0 if the caller must take the locks instead.
+    if (c->disk_fd < 0)
+    {
+        return 0;
+    }
+    guard->names = __atomic_load_n(&c->names_seq, __ATOMIC_ACQUIRE);
+    if (guard->names & 1)
+    {
+        return 0;
+    }
+
+    int inode_index = find_inode(c, filename);
+    guard->inode_seq = (inode_index == -1) ? NULL : &c->inode_seq[inode_index];
+    guard->inode = (inode_index == -1) ? 0 : __atomic_load_n(guard->inode_seq, __ATOMIC_ACQUIRE);
+    if (guard->inode & 1)
+    {
+        return 0;
+    }
+    unlocked_read = guard;
+    return 1;
+}
+
+int end_unlocked_read(fs_ctx *c, const read_guard *guard)
+{
+    // Returns 1 if the read can stand, 0 if a writer got in the way and it must be redone under the locks
+    unlocked_read = NULL;
+    return read_guard_valid(c, guard);
+}
+
+pthread_rwlock_t *lock_file(fs_ctx *c, const char *filename, int exclusive)
+{
+    // Locks the file's inode shared or exclusive, holding names_lock shared so the name
+    // cannot be created or deleted meanwhile. Returns the inode lock for unlock_file, NULL
+    // if there is no such file (names_lock is still held).
+    pthread_rwlock_rdlock(&c->names_lock);
+    int inode_index = (c->disk_fd >= 0) ? find_inode(c, filename) : -1;
+    if (inode_index == -1)
+    {
+        return NULL;
+    }
+
+    pthread_rwlock_t *lock = &c->inode_locks[inode_index];
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(lock);
+        begin_sequence_write(&c->inode_seq[inode_index]);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(lock);
+    }
+    return lock;
+}
+
+void unlock_file(fs_ctx *c, pthread_rwlock_t *lock, int exclusive)
+{
+    if (lock != NULL && exclusive)
+    {
+        end_sequence_write(&c->inode_seq[lock - c->inode_locks]);
+    }
+    if (lock != NULL)
+    {
+        pthread_rwlock_unlock(lock);
+    }
+    pthread_rwlock_unlock(&c->names_lock);
+}
+
+int txn_owned(fs_ctx *c)
+{
+    // Whether the calling thread has the open transaction. Needs no lock: only
+    // the owner changes 'active' while it is set.
+    return __atomic_load_n(&c->txn.active, __ATOMIC_ACQUIRE) && pthread_equal(c->txn.owner, pthread_self());
+}
+
+int enter_update(fs_ctx *c)
+{
+    // Called before a change to files takes any other lock: waits for another
+    // thread's transaction to end. Returns whether leave_update has a gate to release.
+    if (txn_owned(c))
+    {
+        return 0; // The transaction holds the gate already
+    }
+    pthread_rwlock_rdlock(&c->txn_gate);
+    return 1;
+}
+
+void leave_update(fs_ctx *c, int gated)
+{
+    if (gated)
+    {
+        pthread_rwlock_unlock(&c->txn_gate);
+    }
+}
+
+void *flusher_thread(void *arg)
+{
+    // Every flush_milliseconds, commits the operations waiting since the last commit
+    fs_ctx *c = arg;
+    flusher *flush = &c->flusher;
+
+    pthread_mutex_lock(&flush->lock);
+    while (!flush->stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long long nanoseconds = deadline.tv_nsec + (long long)c->flush_milliseconds * 1000000;
+        deadline.tv_sec += nanoseconds / 1000000000;
+        deadline.tv_nsec = nanoseconds % 1000000000;
+        if (pthread_cond_timedwait(&flush->wake, &flush->lock, &deadline) != ETIMEDOUT)
+        {
+            continue; // Woken to stop, or spuriously
+        }
+        pthread_mutex_unlock(&flush->lock);
+
+        // A transaction holds alloc_lock, so this waits for it to end
+        pthread_mutex_lock(&c->alloc_lock);
+        if (c->disk_fd >= 0 && c->ops_since_commit > 0)
+        {
+            journal_commit(c);
+        }
+        pthread_mutex_unlock(&c->alloc_lock);
+
+        pthread_mutex_lock(&flush->lock);
+    }
+    pthread_mutex_unlock(&flush->lock);
+    return NULL;
+}
+
+void start_flusher(fs_ctx *c)
+{
+    // Runs the periodic flush if the mode asks for one; without the thread, commits
+    // still follow flush_operations
+    flusher *flush = &c->flusher;
+    if (c->durability != FS_DURABILITY_PERIODIC || c->flush_milliseconds <= 0 || c->disk_fd < 0)
+    {
+        return;
+    }
+    flush->stopping = 0;
+    flush->running = (pthread_create(&flush->thread, NULL, flusher_thread, c) == 0);
+}
+
+void stop_flusher(fs_ctx *c)
+{
+    // Must not be called holding alloc_lock: the thread may be waiting for it
+    flusher *flush = &c->flusher;
+    if (!flush->running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&flush->lock);
+    flush->stopping = 1;
+    pthread_cond_signal(&flush->wake);
+    pthread_mutex_unlock(&flush->lock);
+    pthread_join(flush->thread, NULL);
+    flush->running = 0;
+}
+
+void track_mounted(fs_ctx *c, int mounted)
+{
+    // Adds the context to mounted_images, or takes it off if there
+    pthread_mutex_lock(&mounted_lock);
+    fs_ctx **link = &mounted_images;
+    while (*link != NULL && *link != c)
+    {
+        link = &(*link)->next_mounted;
+    }
+    if (*link == c)
+    {
+        *link = c->next_mounted;
+    }
+    if (mounted)
+    {
+        c->next_mounted = mounted_images;
+        mounted_images = c;
+    }
+    pthread_mutex_unlock(&mounted_lock);
+}
+
+int image_mounted(const char *disk_path)
+{
+    // 1 if some context has the file at disk_path mounted, under any name
+    struct stat st;
+    if (stat(disk_path, &st) != 0)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&mounted_lock);
+    fs_ctx *c = mounted_images;
+    while (c != NULL && (c->image_dev != st.st_dev || c->image_ino != st.st_ino))
+    {
+        c = c->next_mounted;
+    }
+    pthread_mutex_unlock(&mounted_lock);
+    return c != NULL;
+}
+
+void release_image(fs_ctx *c)
+{
+    track_mounted(c, 0);
+    cache_free(&c->data_cache);
+    cache_free(&c->indirect_cache);
+    if (c->disk_map != NULL)
+    {
+        munmap(c->disk_map, IMAGE_BYTES(c));
+        c->disk_map = NULL;
+    }
+    close(c->disk_fd);
+    c->disk_fd = -1;
+}
+
+// End of helper functions
+
+int fs_format(const char *disk_path)
+{
+    return fs_format_ex(disk_path, MAX_BLOCKS, BLOCK_SIZE, MAX_FILES);
+}
+
+int abandon_format(fs_ctx *c)
+{
+    // Error exit of format_image once the geometry is set: closes the image and
+    // frees the arrays sized for it, so the context is as if never formatted. Returns -1.
+    if (c->disk_fd >= 0)
+    {
+        close(c->disk_fd);
+    }
+    c->disk_fd = -1;
+    free_metadata_arrays(c);
+    return -1;
+}
+
+int format_image(fs_ctx *c, const char *disk_path, int total_blocks, int block_size, int total_inodes)
+{
+    if (disk_path == NULL || strlen(disk_path) == 0 || c->disk_fd != -1 || image_mounted(disk_path))
+    {
+        return -1; // Error: null path, or the image is mounted
+    }
+
+    if (geometry_init(c, block_size, total_blocks, total_inodes) != 0)
+    {
+        return -1; // Error: unsupported geometry or out of memory
+    }
+
+    // Open the disk image file for writing
+    c->disk_fd = open(disk_path, O_RDWR | O_CREAT, 0644); // rw-r--r-- permissions
+    if (c->disk_fd < 0)
+    {
+        return abandon_format(c); // Error: cannot open the image
+    }
+    // Initialize the superblock structure
+
+    c->sb.magic = FS_MAGIC;
+    c->sb.version = FS_VERSION;
+    c->sb.total_blocks = c->geo.total_blocks;
+    c->sb.block_size = c->geo.block_size;
+    c->sb.free_blocks = c->geo.total_blocks;
+    c->sb.total_inodes = c->geo.total_inodes;
+    c->sb.free_inodes = c->geo.total_inodes;
+    c->sb.journal_seq = 1;
+
+    // Initialize the inode table
+
+    for (int i = 0; i < c->geo.total_inodes; i++)
+    {
+        c->inode_table[i].used = 0;
+        c->inode_table[i].size = 0;
+        memset(c->inode_table[i].name, 0, MAX_FILENAME); // Clear the name
+        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+        {
+            c->inode_table[i].blocks[j] = -1; // Initialize all blocks to -1
+        }
+        c->inode_table[i].indirect_block = -1;
+        c->inode_table[i].double_indirect_block = -1;
+        c->inode_table[i].flags = 0;
+    }
+
+    name_index_build(c); // No files yet, so this just clears the index
+
+    memset(c->bitmap, 0, BITMAP_BYTES(c)); // Set all blocks to free (0)
+    c->bitmap[0] |= (1 << (0 % 8));     // Superblock
+    c->bitmap[1 / 8] |= (1 << (1 % 8)); // Block bitmap
+
+    for (int i = 2; i < DATA_START(c); i++)
+    {
+        c->bitmap[i / 8] |= (1 << (i % 8)); // Rest of the bitmap, inode table and journal
+    }
+
+    c->sb.free_blocks -= DATA_START(c); // Superblock, block bitmap, inode table and journal are not available for data
+
+    // Write the superblock to the disk
+    if (disk_write(c, 0, &c->sb, sizeof(superblock)) != sizeof(superblock))
+    {
+        return abandon_format(c); // Error: cannot write superblock
+    }
+
+    if (disk_write(c, c->geo.block_size, c->bitmap, BITMAP_BYTES(c)) != BITMAP_BYTES(c))
+    {
+        return abandon_format(c); // Error: cannot write block bitmap
+    }
+
+    // Write the inode table to the disk
+    if (disk_write(c, INODE_TABLE_OFFSET(c), c->inode_table, INODE_TABLE_BYTES(c)) != INODE_TABLE_BYTES(c))
+    {
+        return abandon_format(c); // Error: cannot write inode table
+    }
+
+    // Clear the journal so transactions from an image previously at this path are never replayed
+    char *empty_journal = calloc(1, JOURNAL_BYTES(c));
+    if (empty_journal == NULL || disk_write(c, JOURNAL_START(c) * c->geo.block_size, empty_journal, JOURNAL_BYTES(c)) != JOURNAL_BYTES(c))
+    {
+        free(empty_journal);
+        return abandon_format(c); // Error: cannot write journal
+    }
+    free(empty_journal);
+
+    // Give the image its full size up front (sparse) so it can be memory-mapped
+    struct stat st;
+    if (fstat(c->disk_fd, &st) != 0 || (st.st_size < IMAGE_BYTES(c) && ftruncate(c->disk_fd, IMAGE_BYTES(c)) != 0))
+    {
+        return abandon_format(c); // Error: cannot size the image
+    }
+
+    close(c->disk_fd);
+    c->disk_fd = -1;
+    return 0;
+}
+
+int fs_format_ex(const char *disk_path, int total_blocks, int block_size, int total_inodes)
+{
+    // Formats through a context of its own, so mounted contexts are never touched
+    // and formats of different images may run at the same time
+    fs_ctx scratch = CONTEXT_DEFAULTS;
+    int result = format_image(&scratch, disk_path, total_blocks, block_size, total_inodes);
+    free_metadata_arrays(&scratch);
+    return result;
+}
+
+int mount_image(fs_ctx *c, const char *disk_path, int use_mmap)
+{
+    if (disk_path == NULL)
+    {
+        return -1; // Error: null path
+    }
+
+    if (c->disk_fd >= 0)
+    {
+        return -1; // Error: already mounted
+    }
+
+    c->disk_fd = open(disk_path, O_RDWR, 0644);
+
+    if (c->disk_fd < 0)
+    {
+        return -1;
+    }
+
+    if (disk_read(c, 0, &c->sb, sizeof(superblock)) != sizeof(superblock))
+    {
+        release_image(c);
+        return -1; // Error: cannot read superblock
+    }
+
+    if (c->sb.magic != FS_MAGIC || c->sb.version != FS_VERSION)
+    {
+        release_image(c);
+        return -1; // Error: not an image of this layout
+    }
+
+    // The superblock decides the layout, so it is read before anything is mapped
+    if (geometry_init(c, c->sb.block_size, c->sb.total_blocks, c->sb.total_inodes) != 0 || c->sb.free_inodes < 0 ||
+        c->sb.free_blocks < 0 || c->sb.free_blocks > c->geo.total_blocks || c->sb.free_inodes > c->geo.total_inodes)
+    {
+        release_image(c);
+        return -1; // Error: invalid filesystem structure
+    }
+
+    if (use_mmap)
+    {
+        struct stat st;
+        if (fstat(c->disk_fd, &st) != 0 || st.st_size < IMAGE_BYTES(c))
+        {
+            release_image(c);
+            return -1; // Error: image too small to map
+        }
+
+        c->disk_map = mmap(NULL, IMAGE_BYTES(c), PROT_READ | PROT_WRITE, MAP_SHARED, c->disk_fd, 0);
+        if (c->disk_map == MAP_FAILED)
+        {
+            c->disk_map = NULL;
+            release_image(c);
+            return -1; // Error: cannot map the image
+        }
+    }
+
+    if (disk_read(c, c->geo.block_size, c->bitmap, BITMAP_BYTES(c)) != BITMAP_BYTES(c))
+    {
+        release_image(c);
+        return -1; // Error: cannot read block bitmap
+    }
+
+    if (disk_read(c, INODE_TABLE_OFFSET(c), c->inode_table, INODE_TABLE_BYTES(c)) != INODE_TABLE_BYTES(c))
+    {
+        release_image(c);
+        return -1; // Error: cannot read inode table
+    }
+
+    clear_metadata_dirty(c);
+    memset(&c->stats, 0, sizeof(c->stats));
+    reset_dirty_ranges(c, c->journal_bitmap_dirty);
+    memset(c->journal_inode_dirty, 0, c->geo.total_inodes);
+    memset(c->pending_free, 0, BITMAP_BYTES(c));
+    c->pending_free_count = 0;
+    memset(c->reserved_map, 0, BITMAP_BYTES(c));
+    c->reserved_blocks = 0;
+    c->journal_pending_bytes = 0;
+    c->commit_interval = 1;
+    c->ops_since_commit = 0;
+
+    // Bring the home copies up to date with anything committed before a crash
+    if (journal_replay(c) < 0)
+    {
+        release_image(c);
+        return -1; // Error: cannot read the journal or write back what it held
+    }
+
+    name_index_build(c);
+    c->alloc_cursor = 0;
+    if (summary_build(c) != 0)
+    {
+        release_image(c);
+        return -1; // Error: cannot allocate the free-space summary
+    }
+
+    // A mapped image is already memory, so it gets no data cache
+    if (cache_init(c, &c->indirect_cache, INDIRECT_CACHE_BLOCKS) != 0 ||
+        (!use_mmap && cache_init(c, &c->data_cache, c->data_cache_blocks) != 0))
+    {
+        release_image(c);
+        return -1; // Error: cannot allocate the block caches
+    }
+    struct stat st;
+    if (fstat(c->disk_fd, &st) != 0)
+    {
+        release_image(c);
+        return -1; // Error: cannot identify the image
+    }
+    c->image_dev = st.st_dev;
+    c->image_ino = st.st_ino;
+    track_mounted(c, 1);
+    start_flusher(c);
+    return 0; // Success: filesystem mounted
+}
+
+static async_pool async_workers = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER};
+static pthread_once_t async_fork_once = PTHREAD_ONCE_INIT;
+
+void forget_async_workers()
+{
+    // In a forked child the workers stayed behind in the parent, so the next
+    // request, or an unmount waiting for queued ones, starts new ones
+    async_workers.workers = 0;
+    pthread_mutex_init(&async_workers.lock, NULL);
+    pthread_cond_init(&async_workers.work, NULL);
+}
+
+void register_async_fork()
+{
+    pthread_atfork(NULL, NULL, forget_async_workers);
+}
+
+void *async_worker(void *arg)
+{
+    // Runs queued requests of any context, each on its own, for the life of the process
+    async_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->pending == NULL)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        async_request *request = pool->pending;
+        pool->pending = request->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        fs_ctx *c = request->ctx;
+        request->result = request->writing ? fs_write_ctx(c, request->filename, request->buffer, request->size)
+                                           : fs_read_ctx(c, request->filename, request->buffer, request->size);
+
+        // The context may be unmounted and freed once in_flight drops, so it is not touched after
+        pthread_mutex_lock(&c->async.lock);
+        request->next = NULL;
+        if (c->async.done == NULL)
+        {
+            c->async.done = request;
+        }
+        else
+        {
+            c->async.done_tail->next = request;
+        }
+        c->async.done_tail = request;
+        uint64_t one = 1;
+        if (write(c->async.event_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            perror("Error signalling completion");
+        }
+        if (--c->async.in_flight == 0)
+        {
+            pthread_cond_broadcast(&c->async.idle);
+        }
+        pthread_mutex_unlock(&c->async.lock);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    return NULL;
+}
+
+int open_completion_fd(async_completions *completions)
+{
+    // Caller holds completions->lock. Returns the eventfd, creating it on first use, or -1.
+    if (completions->event_fd < 0)
+    {
+        completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return completions->event_fd;
+}
+
+int start_async_workers(async_pool *pool)
+{
+    // Caller holds pool->lock. Starts the workers still missing; returns how many run.
+    pthread_once(&async_fork_once, register_async_fork);
+    pthread_attr_t attributes;
+    if (pool->workers < ASYNC_WORKERS && pthread_attr_init(&attributes) == 0)
+    {
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        while (pool->workers < ASYNC_WORKERS && pthread_create(&thread, &attributes, async_worker, pool) == 0)
+        {
+            pool->workers++;
+        }
+        pthread_attr_destroy(&attributes);
+    }
+    return pool->workers;
+}
+
+int submit_async(fs_ctx *c, int writing, const char *filename, void *buffer, int size, fs_completion callback, void *cookie)
+{
+    // Queues one request for the shared workers, starting them if needed
+    if (filename == NULL || strlen(filename) > MAX_FILENAME || buffer == NULL || size < 0 || callback == NULL ||
+        c->disk_fd < 0)
+    {
+        return -3;
+    }
+    async_request *request = malloc(sizeof(async_request));
+    if (request == NULL)
+    {
+        return -3;
+    }
+    request->ctx = c;
+    request->writing = writing;
+    strcpy(request->filename, filename);
+    request->buffer = buffer;
+    request->size = size;
+    request->callback = callback;
+    request->cookie = cookie;
+    request->next = NULL;
+
+    pthread_mutex_lock(&c->async.lock);
+    if (open_completion_fd(&c->async) < 0)
+    {
+        pthread_mutex_unlock(&c->async.lock);
+        free(request);
+        return -3;
+    }
+    c->async.in_flight++;
+    pthread_mutex_unlock(&c->async.lock);
+
+    async_pool *pool = &async_workers;
+    pthread_mutex_lock(&pool->lock);
+    if (start_async_workers(pool) == 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_lock(&c->async.lock);
+        c->async.in_flight--;
+        pthread_mutex_unlock(&c->async.lock);
+        free(request);
+        return -3;
+    }
+
+    if (pool->pending == NULL)
+    {
+        pool->pending = request;
+    }
+    else
+    {
+        pool->pending_tail->next = request;
+    }
+    pool->pending_tail = request;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+async_request *take_completions(fs_ctx *c, int max_completions, int *count)
+{
+    // Unlinks up to max_completions finished requests (all if negative), oldest
+    // first, and lowers the eventfd counter by as many
+    async_completions *pool = &c->async;
+    pthread_mutex_lock(&pool->lock);
+    async_request *first = pool->done;
+    async_request *last = NULL;
+    *count = 0;
+    for (async_request *r = first; r != NULL && (max_completions < 0 || *count < max_completions); r = r->next)
+    {
+        last = r;
+        (*count)++;
+    }
+    if (last == NULL)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    pool->done = last->next;
+    last->next = NULL;
+    uint64_t remaining = 0;
+    if (read(pool->event_fd, &remaining, sizeof(remaining)) == sizeof(remaining) && remaining > (uint64_t)*count)
+    {
+        // Keep the descriptor readable for the completions left behind
+        remaining -= *count;
+        if (write(pool->event_fd, &remaining, sizeof(remaining)) != sizeof(remaining))
+        {
+            perror("Error signalling completion");
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return first;
+}
+
+void run_completions(async_request *first)
+{
+    // Callbacks run on the polling thread with no lock held, so they may submit more requests
+    while (first != NULL)
+    {
+        async_request *next = first->next;
+        first->callback(first->cookie, first->result);
+        free(first);
+        first = next;
+    }
+}
+
+void stop_async_pool(fs_ctx *c)
+{
+    // Waits for the workers to finish every request queued for the context, then
+    // delivers the completions nobody collected and closes the eventfd
+    async_completions *pool = &c->async;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->in_flight > 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_lock(&async_workers.lock);
+        start_async_workers(&async_workers);
+        pthread_mutex_unlock(&async_workers.lock);
+        pthread_mutex_lock(&pool->lock);
+    }
+    while (pool->in_flight > 0)
+    {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    int count;
+    run_completions(take_completions(c, -1, &count));
+    if (pool->event_fd >= 0)
+    {
+        close(pool->event_fd);
+        pool->event_fd = -1;
+    }
+}
+
+int fs_mount(const char *disk_path)
+{
+    return mount_image(&default_context, disk_path, 0);
+}
+
+int fs_mount_mmap(const char *disk_path)
+{
+    return mount_image(&default_context, disk_path, 1);
+}
+
+void unmount_image(fs_ctx *c)
+{
+    // A transaction still open was never committed. Abort it first: it holds
+    // alloc_lock, which the workers and the flusher may be waiting for.
+    fs_txn_abort_ctx(c);
+    stop_async_pool(c);
+    stop_flusher(c);
+    if (c->disk_fd >= 0)
+    {
+        // Commit what is still grouped, then write everything home. The superblock
+        // goes last and retires the journal, so a crash part way replays it instead.
+        flush_data(c);
+        journal_commit(c);
+        c->sb.journal_seq = c->journal_sequence;
+
+        if (disk_write(c, c->geo.block_size, c->bitmap, BITMAP_BYTES(c)) != BITMAP_BYTES(c))
+        {
+            perror("Error writing block bitmap"); /// change to error message
+        }
+
+        if (disk_write(c, INODE_TABLE_OFFSET(c), c->inode_table, INODE_TABLE_BYTES(c)) != INODE_TABLE_BYTES(c))
+        {
+            perror("Error writing inode table"); /// change to error message
+        }
+
+        // Whatever the durability mode, the image is on stable storage once unmounted
+        flush_image(c);
+        if (disk_write(c, 0, &c->sb, sizeof(superblock)) != sizeof(superblock))
+        {
+            perror("Error writing superblock"); //// change to error message
+        }
+        flush_image(c);
+
+        release_image(c); // Unmap, close and reset the file descriptor
+    }
+}
+
+void fs_unmount()
+{
+    unmount_image(&default_context);
+}
+
+void reset_mapping(fs_ctx *c, inode *node)
+{
+    // Leaves 'node' mapping no blocks, in the format new contents use
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        node->blocks[i] = c->extent_mapping ? 0 : -1; // No extents, or all blocks unallocated
+    }
+    node->indirect_block = -1;
+    node->double_indirect_block = -1;
+    node->flags = c->extent_mapping ? INODE_EXTENTS : 0;
+}
+
+int create_file(fs_ctx *c, const char *filename)
+{
+
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || strlen(filename) == 0 || c->disk_fd == -1)
+    {
+        return -3; // Error: invalid filename
+    }
+
+    // Check if the file already exists
+    if (find_inode(c, filename) != -1)
+    {
+        return -1; // Error: file already exists
+    }
+
+    int inode_index = find_free_inode(c);
+    if (inode_index == -2)
+    {
+        return -2; // No free inodes available
+    }
+
+    inode new_inode;
+    new_inode.used = 1;                                 // Mark inode as used
+    new_inode.size = 0;                                 // Initialize size to 0
+    memset(new_inode.name, 0, MAX_FILENAME);            // Clear all 28 bytes
+    memcpy(new_inode.name, filename, strlen(filename)); // Copy filename
+    reset_mapping(c, &new_inode);
+
+    write_inode(c, inode_index, &new_inode); // Write the new inode to the inode table
+    name_index_insert(c, inode_index);
+
+    if (sync_metadata_to_disk(c) != 0)
+    {
+        return -3; // Error: created, but the change could not be committed
+    }
+    return 0; // Success: file created
+}
+
+int fs_create_ctx(fs_ctx *fs, const char *filename)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    int gated = enter_update(fs);
+    pthread_rwlock_wrlock(&fs->names_lock);
+    pthread_mutex_lock(&fs->alloc_lock);
+    begin_sequence_write(&fs->names_seq);
+    int result = create_file(fs, filename);
+    end_sequence_write(&fs->names_seq);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_rwlock_unlock(&fs->names_lock);
+    leave_update(fs, gated);
+    return result;
+}
+
+int fs_create(const char *filename)
+{
+    return fs_create_ctx(&default_context, filename);
+}
+
+int delete_file(fs_ctx *c, const char *filename)
+{
+    int inode_index = find_inode(c, filename);
+
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || inode_index == -1 || c->disk_fd == -1)
+    {
+        return -1;
+    }
+
+    // Drop the name from the index while the inode still holds it
+    name_index_remove(c, inode_index);
+
+    // Create a temporary copy of the inode before modifying it
+    inode temp_inode = c->inode_table[inode_index];
+
+    // Free all allocated blocks, including indirect blocks
+    free_file_blocks(c, &temp_inode, 0, calculate_blocks_needed(c, temp_inode.size));
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        temp_inode.blocks[i] = -1;
+    }
+    temp_inode.indirect_block = -1;
+    temp_inode.double_indirect_block = -1;
+    temp_inode.flags = 0;
+
+    // Mark the inode as free
+    temp_inode.used = 0;
+    temp_inode.size = 0;
+    memset(temp_inode.name, 0, MAX_FILENAME);
+
+    // Write the updated inode (this will properly update sb.free_inodes)
+    write_inode(c, inode_index, &temp_inode);
+
+    if (sync_metadata_to_disk(c) != 0)
+    {
+        return -3; // Error: deleted, but the change could not be committed
+    }
+    return 0;
+}
+
+int fs_delete_ctx(fs_ctx *fs, const char *filename)
+{
+    if (fs == NULL)
+    {
+        return -1; // Not mounted
+    }
+    int gated = enter_update(fs);
+    pthread_rwlock_wrlock(&fs->names_lock);
+    pthread_mutex_lock(&fs->alloc_lock);
+    begin_sequence_write(&fs->names_seq);
+    int result = delete_file(fs, filename);
+    end_sequence_write(&fs->names_seq);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_rwlock_unlock(&fs->names_lock);
+    leave_update(fs, gated);
+    return result;
+}
+
+int fs_delete(const char *filename)
+{
+    return fs_delete_ctx(&default_context, filename);
+}
+
+int list_files(fs_ctx *c, char filenames[][MAX_FILENAME], int max_files)
+{
+    if (max_files == 0)
+    {
+        return 0;
+    }
+
+    if (filenames == NULL || max_files < 0 || max_files > c->geo.total_inodes || c->disk_fd == -1)
+    {
+        return -1;
+    }
+
+    int count_files = 0; // Counter for the number of files found
+
+    for (int i = 0; i < c->geo.total_inodes && count_files < max_files; i++)
+    {
+        if (c->inode_table[i].used == 1)
+        { // If the inode is used
+            // Find the length of the name in the raw array
+            int name_len = 0;
+            for (int j = 0; j < MAX_FILENAME && c->inode_table[i].name[j] != 0; j++)
+            {
+                name_len++;
+            }
+
+            memcpy(filenames[count_files], c->inode_table[i].name, name_len);
+            filenames[count_files][name_len] = '\0'; // Add null terminator for the output
+            count_files++;                           // Increment the count of files found
+        }
+    }
+
+    return count_files; // Return the number of files found
+}
+
+int fs_list_ctx(fs_ctx *fs, char filenames[][MAX_FILENAME], int max_files)
+{
+    if (fs == NULL)
+    {
+        return -1; // Not mounted
+    }
+    pthread_rwlock_rdlock(&fs->names_lock);
+    int result = list_files(fs, filenames, max_files);
+    pthread_rwlock_unlock(&fs->names_lock);
+    return result;
+}
+
+int fs_list(char filenames[][MAX_FILENAME], int max_files)
+{
+    return fs_list_ctx(&default_context, filenames, max_files);
+}
+
+int write_file(fs_ctx *c, const char *filename, const void *data, int size)
+{
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || data == NULL || size < 0 || c->disk_fd < 0)
+    {
+        return -3;
+    }
+
+    int inode_index = find_inode(c, filename);
+    if (inode_index == -1)
+    {
+        return -1;
+    }
+
+    int blocks_needed = calculate_blocks_needed(c, size);
+    int total_needed = blocks_needed + pointer_blocks_needed(c, blocks_needed);
+
+    int *new_blocks = malloc((blocks_needed + 1) * sizeof(int));
+    if (new_blocks == NULL)
+    {
+        return -3;
+    }
+
+    // The new contents go to fresh blocks; the old ones stay intact until the inode is switched
+    pthread_mutex_lock(&c->alloc_lock);
+    int reserved = reserve_blocks(c, -1, blocks_needed, total_needed, new_blocks);
+    pthread_mutex_unlock(&c->alloc_lock);
+    if (reserved != 0)
+    {
+        free(new_blocks);
+        return -2; // Error: too many blocks needed
+    }
+
+    // Write the data, one request per contiguous run
+    inode target_inode;
+    read_inode(c, inode_index, &target_inode);
+    long long bytes_written = transfer_file_range(c, 1, &target_inode, 0, size, (char *)data, 1, new_blocks, 0);
+    int stored = (bytes_written == size);
+
+    pthread_mutex_lock(&c->alloc_lock);
+    end_reservation(c, new_blocks, blocks_needed, total_needed, stored);
+
+    // Then the pointer blocks
+    inode new_inode = target_inode;
+    reset_mapping(c, &new_inode);
+    new_inode.size = size;
+    inode empty_inode = new_inode;
+    int mapped = stored ? extend_file_blocks(c, &new_inode, 0, blocks_needed, new_blocks) : 0;
+
+    if (!stored || mapped < blocks_needed)
+    {
+        // ROLLBACK: free all newly allocated blocks, the original data is still intact
+        if (stored)
+        {
+            discard_extension(c, &empty_inode, &new_inode, 0, new_blocks, blocks_needed, mapped);
+        }
+        pthread_mutex_unlock(&c->alloc_lock);
+        free(new_blocks);
+
+        return (stored || bytes_written < 0) ? -3 : -2; // A short write means the disk is full
+    }
+    free(new_blocks);
+
+    // Write updated inode
+    write_inode(c, inode_index, &new_inode);
+
+    // free the original blocks
+    free_file_blocks(c, &target_inode, 0, calculate_blocks_needed(c, target_inode.size));
+
+    // Sync metadata to disk
+    int result = (sync_metadata_to_disk(c) == 0) ? 0 : -3; // -3: written, but the change could not be committed
+    pthread_mutex_unlock(&c->alloc_lock);
+    return result;
+}
+
+int fs_write_ctx(fs_ctx *fs, const char *filename, const void *data, int size)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    int gated = enter_update(fs);
+    pthread_rwlock_t *lock = lock_file(fs, filename, 1);
+    int result = write_file(fs, filename, data, size);
+    unlock_file(fs, lock, 1);
+    leave_update(fs, gated);
+    return result;
+}
+
+int fs_write(const char *filename, const void *data, int size)
+{
+    return fs_write_ctx(&default_context, filename, data, size);
+}
+
+int pwrite_file(fs_ctx *c, const char *filename, long long offset, const void *data, int size)
+{
+    static char zeros[MAX_BLOCK_SIZE]; // Source for the gap when writing past the end of the file
+
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || data == NULL || size < 0 || offset < 0 || c->disk_fd < 0)
+    {
+        return -3;
+    }
+
+    int inode_index = find_inode(c, filename);
+    if (inode_index == -1)
+    {
+        return -1;
+    }
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    if (offset > MAX_FILE_SIZE(c) - size)
+    {
+        return -3; // Would grow past the maximum file size
+    }
+
+    inode target_inode;
+    read_inode(c, inode_index, &target_inode);
+
+    long long old_size = target_inode.size;
+    long long new_size = (offset + size > old_size) ? offset + size : old_size;
+    int old_blocks = calculate_blocks_needed(c, old_size);
+    int blocks_needed = calculate_blocks_needed(c, new_size);
+    int new_block_count = blocks_needed - old_blocks;
+
+    // An extent-mapped file may have to switch to pointer blocks, so reserve for all of them
+    int total_needed = new_block_count + pointer_blocks_needed(c, blocks_needed);
+    if (!(target_inode.flags & INODE_EXTENTS))
+    {
+        total_needed -= pointer_blocks_needed(c, old_blocks);
+    }
+
+    int *new_blocks = malloc((new_block_count + 1) * sizeof(int));
+    if (new_blocks == NULL)
+    {
+        return -3;
+    }
+
+    // Only blocks past the current end of the file are allocated
+    // and they are searched for right after the last one, to continue its run.
+    // Overwriting within the file needs no allocation, so it never takes alloc_lock.
+    if (new_size != old_size)
+    {
+        int goal = (old_blocks > 0) ? bmap(c, &target_inode, old_blocks - 1) + 1 : -1;
+        pthread_mutex_lock(&c->alloc_lock);
+        int reserved = reserve_blocks(c, goal, new_block_count, total_needed, new_blocks);
+        pthread_mutex_unlock(&c->alloc_lock);
+        if (reserved != 0)
+        {
+            free(new_blocks);
+            return -2; // Error: too many blocks needed
+        }
+    }
+
+    // Bytes between the old end of file and the offset read back as zeros.
+    // Existing blocks are updated in place.
+    long long gap = (offset > old_size) ? offset - old_size : 0;
+    long long bytes_written = transfer_file_range(c, 1, &target_inode, old_size, gap, zeros, 0, new_blocks, old_blocks);
+    if (bytes_written == gap)
+    {
+        long long data_written =
+            transfer_file_range(c, 1, &target_inode, offset, size, (char *)data, 1, new_blocks, old_blocks);
+        bytes_written = (data_written < 0) ? -1 : gap + data_written;
+    }
+    int stored = (bytes_written == gap + size);
+
+    // Overwriting within the file leaves the metadata untouched
+    if (new_size == old_size)
+    {
+        free(new_blocks);
+        if (!stored)
+        {
+            return (bytes_written < 0) ? -3 : -2;
+        }
+        return (sync_data_to_disk(c) == 0) ? 0 : -3; // -3: written, but not flushed
+    }
+
+    pthread_mutex_lock(&c->alloc_lock);
+    end_reservation(c, new_blocks, new_block_count, total_needed, stored);
+    inode old_inode = target_inode;
+    int mapped = stored ? extend_file_blocks(c, &target_inode, old_blocks, new_block_count, new_blocks) : 0;
+
+    if (!stored || mapped < new_block_count)
+    {
+        // ROLLBACK: free the newly allocated blocks and keep the old size
+        if (stored)
+        {
+            discard_extension(c, &old_inode, &target_inode, old_blocks, new_blocks, new_block_count, mapped);
+        }
+        pthread_mutex_unlock(&c->alloc_lock);
+        free(new_blocks);
+
+        return (stored || bytes_written < 0) ? -3 : -2; // A short write means the disk is full
+    }
+    free(new_blocks);
+
+    target_inode.size = new_size;
+    write_inode(c, inode_index, &target_inode);
+    int result = (sync_metadata_to_disk(c) == 0) ? 0 : -3; // -3: written, but the change could not be committed
+    pthread_mutex_unlock(&c->alloc_lock);
+    return result;
+}
+
+int fs_pwrite_ctx(fs_ctx *fs, const char *filename, long long offset, const void *data, int size)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    int gated = enter_update(fs);
+    pthread_rwlock_t *lock = lock_file(fs, filename, 1);
+    int result = pwrite_file(fs, filename, offset, data, size);
+    unlock_file(fs, lock, 1);
+    leave_update(fs, gated);
+    return result;
+}
+
+int fs_pwrite(const char *filename, long long offset, const void *data, int size)
+{
+    return fs_pwrite_ctx(&default_context, filename, offset, data, size);
+}
+
+int append_file(fs_ctx *c, const char *filename, const void *data, int size)
+{
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || data == NULL || size < 0 || c->disk_fd < 0)
+    {
+        return -3;
+    }
+
+    int inode_index = find_inode(c, filename);
+    if (inode_index == -1)
+    {
+        return -1;
+    }
+
+    // Fills the partial last block, then allocates only the blocks past it
+    return pwrite_file(c, filename, c->inode_table[inode_index].size, data, size);
+}
+
+int fs_append_ctx(fs_ctx *fs, const char *filename, const void *data, int size)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    int gated = enter_update(fs);
+    pthread_rwlock_t *lock = lock_file(fs, filename, 1);
+    int result = append_file(fs, filename, data, size);
+    unlock_file(fs, lock, 1);
+    leave_update(fs, gated);
+    return result;
+}
+
+int fs_append(const char *filename, const void *data, int size)
+{
+    return fs_append_ctx(&default_context, filename, data, size);
+}
+
+int batch_name_exists(fs_ctx *c, const fs_op *ops, int before, const char *filename)
+{
+    // Whether 'filename' exists once ops[0..before-1] have run
+    for (int i = before - 1; i >= 0; i--)
+    {
+        if ((ops[i].type == FS_OP_CREATE || ops[i].type == FS_OP_DELETE) && strcmp(ops[i].filename, filename) == 0)
+        {
+            return ops[i].type == FS_OP_CREATE;
+        }
+    }
+    return find_inode(c, filename) != -1;
+}
+
+int batch_blocks_held(fs_ctx *c, const fs_op *ops, int before, const char *filename)
+{
+    // Blocks the existing file 'filename' holds once ops[0..before-1] have run, which
+    // deleting or rewriting it releases. A write in the batch counts its data blocks
+    // only, as its pointer blocks depend on the layout allocation finds.
+    for (int i = before - 1; i >= 0; i--)
+    {
+        if (strcmp(ops[i].filename, filename) == 0)
+        {
+            return (ops[i].type == FS_OP_WRITE) ? calculate_blocks_needed(c, ops[i].size) : 0;
+        }
+    }
+    return file_blocks_held(c, &c->inode_table[find_inode(c, filename)]);
+}
+
+int validate_batch(fs_ctx *c, fs_op *ops, int count, int *data_blocks, int *reuse)
+{
+    // Checks every operation against the state the ones before it leave, the way
+    // create_file, write_file and delete_file would, without changing anything.
+    // Sets the failing operation's result and returns it, or 0 with the data
+    // blocks all writes need in *data_blocks. Sets *reuse if the writes fit only
+    // in blocks that earlier deletes and rewrites of the batch release.
+    int free_inodes = c->sb.free_inodes;
+    int blocks_needed = 0;
+    int released = 0; // By the operations checked so far
+    *data_blocks = 0;
+    *reuse = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        const char *name = ops[i].filename;
+        int valid_name = (name != NULL && validate_string_manual(name) == 0 && strlen(name) <= MAX_FILENAME);
+        int result = 0;
+
+        if (ops[i].type == FS_OP_CREATE)
+        {
+            result = (!valid_name || strlen(name) == 0)       ? -3
+                     : batch_name_exists(c, ops, i, name)       ? -1
+                     : (free_inodes == 0)                     ? -2
+                                                              : 0;
+            free_inodes -= (result == 0);
+        }
+        else if (ops[i].type == FS_OP_DELETE)
+        {
+            result = (valid_name && batch_name_exists(c, ops, i, name)) ? 0 : -1;
+            free_inodes += (result == 0);
+            released += (result == 0) ? batch_blocks_held(c, ops, i, name) : 0;
+        }
+        else if (ops[i].type == FS_OP_WRITE)
+        {
+            result = (!valid_name || ops[i].data == NULL || ops[i].size < 0) ? -3
+                     : !batch_name_exists(c, ops, i, name)                      ? -1
+                                                                             : 0;
+            if (result == 0)
+            {
+                int blocks = calculate_blocks_needed(c, ops[i].size);
+                *data_blocks += blocks;
+                blocks_needed += blocks + pointer_blocks_needed(c, blocks);
+                make_blocks_allocatable(c, blocks_needed); // Commits only operations from before the batch
+
+                // As make_blocks_allocatable counts them. Blocks the batch itself frees are
+                // reusable only once they are committed, which an open transaction defers.
+                int available = c->sb.free_blocks - c->reserved_blocks - c->pending_free_count;
+                if (blocks_needed > available)
+                {
+                    *reuse = 1;
+                    result = (c->txn.active || blocks_needed > available + c->pending_free_count + released) ? -2 : 0;
+                }
+                released += (result == 0) ? batch_blocks_held(c, ops, i, name) : 0;
+            }
+        }
+        else
+        {
+            result = -3; // Unknown operation
+        }
+
+        if (result != 0)
+        {
+            ops[i].result = result;
+            return result;
+        }
+    }
+    return 0;
+}
+
+int write_batch_data(fs_ctx *c, const fs_op *ops, int count, const int *blocks)
+{
+    // Writes the data of every write in the batch to its blocks, which follow one
+    // another in 'blocks' in operation order, merging runs across files. Returns 0,
+    // or -3 on an I/O error.
+    block_segment segments[TRANSFER_BATCH];
+    int queued = 0;
+    int queued_bytes = 0;
+    int first = 0; // First block of the current write in 'blocks'
+    int result = 0;
+
+    for (int i = 0; i < count && result == 0; i++)
+    {
+        if (ops[i].type != FS_OP_WRITE)
+        {
+            continue;
+        }
+        int file_blocks = calculate_blocks_needed(c, ops[i].size);
+        for (int b = 0; b < file_blocks && result == 0; b++)
+        {
+            int offset = b * c->geo.block_size;
+            segments[queued].block = blocks[first + b];
+            segments[queued].offset = 0;
+            segments[queued].buffer = (char *)ops[i].data + offset;
+            segments[queued].length = (ops[i].size - offset < c->geo.block_size) ? ops[i].size - offset
+                                                                                  : c->geo.block_size;
+            queued_bytes += segments[queued].length;
+            queued++;
+            if (queued == TRANSFER_BATCH)
+            {
+                result = (disk_transfer(c, 1, segments, queued) == queued_bytes) ? 0 : -3;
+                queued = 0;
+                queued_bytes = 0;
+            }
+        }
+        first += file_blocks;
+    }
+    if (result == 0 && queued > 0)
+    {
+        result = (disk_transfer(c, 1, segments, queued) == queued_bytes) ? 0 : -3;
+    }
+    return result;
+}
+
+int map_batch_write(fs_ctx *c, const fs_op *op, inode *mapping, const int *blocks)
+{
+    // Maps the write's data blocks into a fresh 'mapping', taking its pointer blocks.
+    // Returns 0, or -2 with nothing kept if they do not fit.
+    int file_blocks = calculate_blocks_needed(c, op->size);
+    memset(mapping, 0, sizeof(*mapping));
+    reset_mapping(c, mapping);
+    mapping->size = op->size;
+    int mapped = extend_file_blocks(c, mapping, 0, file_blocks, blocks);
+    if (mapped < file_blocks)
+    {
+        free_pointer_blocks(c, mapping, 0, mapped);
+        return -2;
+    }
+    return 0;
+}
+
+int prepare_batch_writes(fs_ctx *c, fs_op *ops, int count, inode *mappings, int *blocks, int data_blocks)
+{
+    // Allocates the data blocks of every write in one pass, maps them into
+    // mappings[i] and writes all the data. Nothing in the inode table changes,
+    // so on failure freeing the blocks undoes it all. Returns 0, -2 if space ran
+    // out, or -3 on an I/O error.
+    if (allocate_blocks(c, -1, data_blocks, blocks, 0) != 0)
+    {
+        return -2;
+    }
+
+    int first = 0; // First block of the current write in 'blocks'
+    int prepared = 0;
+    int result = 0;
+    for (; prepared < count && result == 0; prepared++)
+    {
+        if (ops[prepared].type == FS_OP_WRITE)
+        {
+            result = map_batch_write(c, &ops[prepared], &mappings[prepared], blocks + first);
+            if (result != 0)
+            {
+                break; // The rollback below only covers the writes before this one
+            }
+            first += calculate_blocks_needed(c, ops[prepared].size);
+        }
+    }
+    if (result == 0)
+    {
+        result = write_batch_data(c, ops, count, blocks);
+    }
+
+    if (result != 0)
+    {
+        // ROLLBACK: release every data block and the pointer blocks of the writes mapped so far
+        for (int i = 0; i < prepared; i++)
+        {
+            if (ops[i].type == FS_OP_WRITE)
+            {
+                int file_blocks = calculate_blocks_needed(c, ops[i].size);
+                free_pointer_blocks(c, &mappings[i], 0, file_blocks);
+            }
+        }
+        for (int i = 0; i < data_blocks; i++)
+        {
+            mark_block_free(c, blocks[i]);
+        }
+    }
+    return result;
+}
+
+void install_mapping(fs_ctx *c, int inode_index, const inode *mapping)
+{
+    // Gives the file the contents in 'mapping' and frees the blocks it had
+    inode old_inode = c->inode_table[inode_index]; // In use: validate_batch found the file
+    inode new_inode = old_inode;
+    memcpy(new_inode.blocks, mapping->blocks, sizeof(new_inode.blocks));
+    new_inode.indirect_block = mapping->indirect_block;
+    new_inode.double_indirect_block = mapping->double_indirect_block;
+    new_inode.flags = mapping->flags;
+    new_inode.size = mapping->size;
+    write_inode(c, inode_index, &new_inode);
+    free_file_blocks(c, &old_inode, 0, calculate_blocks_needed(c, old_inode.size));
+}
+
+int apply_batch_reusing(fs_ctx *c, fs_op *ops, int count, inode *mappings, int *blocks)
+{
+    // For a batch whose writes fit only in blocks its own deletes and rewrites free.
+    // Those may be overwritten only once a commit has released them, so the batch
+    // applies its operations in order, each write taking blocks freed before it,
+    // commits them as one journal transaction, and writes the data after that
+    // commit rather than before it. Validation leaves nothing to fail before the
+    // commit. Returns 0, or -3 if the commit or a data write failed.
+    int first = 0; // First block of the current write in 'blocks'
+    int result = 0;
+    c->in_batch = 1;
+    for (int i = 0; i < count && result == 0; i++)
+    {
+        if (ops[i].type == FS_OP_CREATE)
+        {
+            create_file(c, ops[i].filename);
+        }
+        else if (ops[i].type == FS_OP_DELETE)
+        {
+            delete_file(c, ops[i].filename);
+        }
+        else
+        {
+            int file_blocks = calculate_blocks_needed(c, ops[i].size);
+            release_pending_frees(c); // The commit below lands before any of them is written
+            if (allocate_blocks(c, -1, file_blocks, blocks + first, 0) != 0 ||
+                map_batch_write(c, &ops[i], &mappings[i], blocks + first) != 0)
+            {
+                ops[i].result = result = -3; // Not reached: validation counted these blocks
+                break;
+            }
+            install_mapping(c, find_inode(c, ops[i].filename), &mappings[i]);
+            first += file_blocks;
+        }
+    }
+    c->in_batch = 0;
+
+    STAT_ADD(c, metadata_syncs, 1);
+    if (journal_commit(c) != 0 || write_batch_data(c, ops, count, blocks) != 0 || sync_data_to_disk(c) != 0)
+    {
+        return -3;
+    }
+    return result;
+}
+
+int batch_operations(fs_ctx *c, fs_op *ops, int count)
+{
+    if (ops == NULL || count < 0 || c->disk_fd < 0)
+    {
+        return -3;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        ops[i].result = 0;
+    }
+
+    int data_blocks;
+    int reuse;
+    int result = validate_batch(c, ops, count, &data_blocks, &reuse);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    inode *mappings = malloc((count + 1) * sizeof(inode));
+    int *blocks = malloc((data_blocks + 1) * sizeof(int));
+    if (mappings == NULL || blocks == NULL)
+    {
+        free(mappings);
+        free(blocks);
+        return -3;
+    }
+    if (reuse)
+    {
+        result = apply_batch_reusing(c, ops, count, mappings, blocks);
+        free(mappings);
+        free(blocks);
+        return result;
+    }
+    result = prepare_batch_writes(c, ops, count, mappings, blocks, data_blocks);
+    if (result != 0)
+    {
+        // Charge the failure to the first write; the batch as a whole could not be stored
+        for (int i = 0; i < count; i++)
+        {
+            if (ops[i].type == FS_OP_WRITE)
+            {
+                ops[i].result = result;
+                break;
+            }
+        }
+        free(mappings);
+        free(blocks);
+        return result;
+    }
+
+    // Validation leaves nothing below to fail. One sync covers every change, so a
+    // crash replays the whole batch or none of it.
+    c->in_batch = 1;
+    for (int i = 0; i < count; i++)
+    {
+        if (ops[i].type == FS_OP_CREATE)
+        {
+            create_file(c, ops[i].filename);
+        }
+        else if (ops[i].type == FS_OP_DELETE)
+        {
+            delete_file(c, ops[i].filename);
+        }
+        else
+        {
+            install_mapping(c, find_inode(c, ops[i].filename), &mappings[i]);
+        }
+    }
+    c->in_batch = 0;
+    result = (sync_metadata_to_disk(c) == 0) ? 0 : -3;
+
+    free(mappings);
+    free(blocks);
+    return result;
+}
+
+int fs_batch_ctx(fs_ctx *fs, fs_op *ops, int count)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    // Creates and deletes change names and writes may target files created in the
+    // same batch, so the whole batch runs with names_lock exclusive. That also
+    // keeps every reader out, as names_seq sends unlocked ones to the locks.
+    int gated = enter_update(fs);
+    pthread_rwlock_wrlock(&fs->names_lock);
+    pthread_mutex_lock(&fs->alloc_lock);
+    begin_sequence_write(&fs->names_seq);
+    int result = batch_operations(fs, ops, count);
+    end_sequence_write(&fs->names_seq);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_rwlock_unlock(&fs->names_lock);
+    leave_update(fs, gated);
+    return result;
+}
+
+int fs_batch(fs_op *ops, int count)
+{
+    return fs_batch_ctx(&default_context, ops, count);
+}
+
+void end_transaction(fs_ctx *c)
+{
+    transaction *txn = &c->txn;
+    free(txn->inodes);
+    free(txn->blocks);
+    txn->inodes = NULL;
+    txn->blocks = NULL;
+    txn->inode_count = txn->inode_capacity = 0;
+    txn->block_count = txn->block_capacity = 0;
+    txn->incomplete = 0;
+    __atomic_store_n(&txn->active, 0, __ATOMIC_RELEASE);
+}
+
+void undo_transaction(fs_ctx *c)
+{
+    // Replays the undo log backwards. Blocks the transaction freed are still
+    // pending, so nothing overwrote their contents; blocks it allocated become
+    // allocatable again.
+    transaction *txn = &c->txn;
+    for (int i = txn->block_count - 1; i >= 0; i--)
+    {
+        int block = txn->blocks[i].block;
+        if (txn->blocks[i].was_used)
+        {
+            c->bitmap[block / 8] |= (1 << (block % 8));
+            c->pending_free[block / 8] &= ~(1 << (block % 8));
+            c->pending_free_count--;
+        }
+        else
+        {
+            c->bitmap[block / 8] &= ~(1 << (block % 8));
+            summary_adjust(c, block, 1);
+            pthread_rwlock_wrlock(&c->cache_lock);
+            cache_invalidate(&c->data_cache, block);
+            cache_invalidate(&c->indirect_cache, block);
+            pthread_rwlock_unlock(&c->cache_lock);
+        }
+        mark_bitmap_dirty(c, block);
+    }
+
+    for (int i = txn->inode_count - 1; i >= 0; i--)
+    {
+        int index = txn->inodes[i].index;
+        const inode *before = &txn->inodes[i].before;
+        inode *current = &c->inode_table[index];
+        int renamed = (current->used != before->used || memcmp(current->name, before->name, MAX_FILENAME) != 0);
+        if (renamed && current->used)
+        {
+            name_index_remove(c, index);
+        }
+        *current = *before;
+        mark_inode_dirty(c, index);
+        if (renamed && before->used)
+        {
+            name_index_insert(c, index);
+        }
+    }
+
+    c->sb = txn->sb;
+    c->sb_dirty = 1;
+    c->alloc_cursor = txn->alloc_cursor;
+}
+
+int fs_txn_begin_ctx(fs_ctx *fs)
+{
+    // Fail at once rather than wait for another thread's transaction to end
+    if (fs == NULL || __atomic_load_n(&fs->txn.active, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+    // Exclusive on txn_gate waits for the changes under way in other threads,
+    // whose writes take alloc_lock again before they end
+    pthread_rwlock_wrlock(&fs->txn_gate);
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->disk_fd < 0 || fs->txn.active)
+    {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        pthread_rwlock_unlock(&fs->txn_gate);
+        return -1; // Not mounted, or one began while this thread waited for the lock
+    }
+    fs->txn.owner = pthread_self();
+    fs->txn.sb = fs->sb;
+    fs->txn.alloc_cursor = fs->alloc_cursor;
+    __atomic_store_n(&fs->txn.active, 1, __ATOMIC_RELEASE);
+    return 0; // txn_gate and alloc_lock stay held until the transaction ends
+}
+
+int fs_txn_begin()
+{
+    return fs_txn_begin_ctx(&default_context);
+}
+
+int fs_txn_commit_ctx(fs_ctx *fs)
+{
+    if (fs == NULL || !txn_owned(fs))
+    {
+        return -1; // Another thread's transaction is not this one's to end
+    }
+    pthread_mutex_lock(&fs->alloc_lock);
+    end_transaction(fs);
+    STAT_ADD(fs, metadata_syncs, 1);
+    int result = (journal_commit(fs) == 0) ? 0 : -3; // Everything the transaction changed, as one journal transaction
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_mutex_unlock(&fs->alloc_lock); // The holds taken by fs_txn_begin
+    pthread_rwlock_unlock(&fs->txn_gate);
+    return result;
+}
+
+int fs_txn_commit()
+{
+    return fs_txn_commit_ctx(&default_context);
+}
+
+int fs_txn_abort_ctx(fs_ctx *fs)
+{
+    if (fs == NULL || !txn_owned(fs))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    int result = 0;
+    if (fs->txn.incomplete)
+    {
+        // Out of memory for the log: keep the changes rather than restore half of them
+        result = -2;
+        STAT_ADD(fs, metadata_syncs, 1);
+        end_transaction(fs);
+        journal_commit(fs);
+    }
+    else
+    {
+        // Names change back, so readers are kept out as for fs_create and fs_delete
+        pthread_rwlock_wrlock(&fs->names_lock);
+        begin_sequence_write(&fs->names_seq);
+        undo_transaction(fs);
+        end_sequence_write(&fs->names_seq);
+        pthread_rwlock_unlock(&fs->names_lock);
+        end_transaction(fs);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_mutex_unlock(&fs->alloc_lock); // The holds taken by fs_txn_begin
+    pthread_rwlock_unlock(&fs->txn_gate);
+    return result;
+}
+
+int fs_txn_abort()
+{
+    return fs_txn_abort_ctx(&default_context);
+}
+
+int read_file(fs_ctx *c, const char *filename, void *buffer, int size)
+{
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || buffer == NULL || size < 0 || c->disk_fd == -1)
+    {
+        return -3; // Error: invalid parameters
+    }
+
+    int inode_index = find_inode(c, filename);
+    if (inode_index == -1)
+    {
+        return -1; // Error: file not found
+    }
+
+    // Use read_inode helper function to get the inode
+    inode target_inode;
+    read_inode(c, inode_index, &target_inode);
+
+    if (target_inode.used == 0)
+    {
+        return -1; // Error: inode not used
+    }
+
+    int bytes_to_read = (size > target_inode.size) ? (int)target_inode.size : size; // Read only up to the file size
+
+    // A short read means we reached the end of the image
+    int total_bytes_read = (int)transfer_file_range(c, 0, &target_inode, 0, bytes_to_read, buffer, 1, NULL, INT_MAX);
+    if (total_bytes_read < 0)
+    {
+        return -3; // Error: read failed or invalid block index
+    }
+
+    return total_bytes_read; // Return total bytes successfully read
+}
+
+int fs_read_ctx(fs_ctx *fs, const char *filename, void *buffer, int size)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    read_guard guard;
+    if (begin_unlocked_read(fs, filename, &guard))
+    {
+        int result = read_file(fs, filename, buffer, size);
+        if (end_unlocked_read(fs, &guard))
+        {
+            return result;
+        }
+    }
+
+    pthread_rwlock_t *lock = lock_file(fs, filename, 0);
+    int result = read_file(fs, filename, buffer, size);
+    unlock_file(fs, lock, 0);
+    return result;
+}
+
+int fs_read(const char *filename, void *buffer, int size)
+{
+    return fs_read_ctx(&default_context, filename, buffer, size);
+}
+
+int pread_file(fs_ctx *c, const char *filename, void *buffer, long long offset, int size)
+{
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || buffer == NULL || size < 0 || offset < 0 || c->disk_fd == -1)
+    {
+        return -3; // Error: invalid parameters
+    }
+
+    int inode_index = find_inode(c, filename);
+    if (inode_index == -1)
+    {
+        return -1; // Error: file not found
+    }
+
+    inode target_inode;
+    read_inode(c, inode_index, &target_inode);
+
+    if (offset >= target_inode.size)
+    {
+        return 0; // Nothing past the end of the file
+    }
+
+    // Only the blocks holding [offset, offset + size) are read
+    int bytes_to_read = (size > target_inode.size - offset) ? (int)(target_inode.size - offset) : size;
+    int total_bytes_read = (int)transfer_file_range(c, 0, &target_inode, offset, bytes_to_read, buffer, 1, NULL, INT_MAX);
+    if (total_bytes_read < 0)
+    {
+        return -3; // Error: read failed or invalid block index
+    }
+
+    return total_bytes_read;
+}
+
+int fs_pread_ctx(fs_ctx *fs, const char *filename, void *buffer, long long offset, int size)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    read_guard guard;
+    if (begin_unlocked_read(fs, filename, &guard))
+    {
+        int result = pread_file(fs, filename, buffer, offset, size);
+        if (end_unlocked_read(fs, &guard))
+        {
+            return result;
+        }
+    }
+
+    pthread_rwlock_t *lock = lock_file(fs, filename, 0);
+    int result = pread_file(fs, filename, buffer, offset, size);
+    unlock_file(fs, lock, 0);
+    return result;
+}
+
+int fs_pread(const char *filename, void *buffer, long long offset, int size)
+{
+    return fs_pread_ctx(&default_context, filename, buffer, offset, size);
+}
+
+void fs_get_stats_ctx(fs_ctx *fs, fs_stats *out)
+{
+    if (fs != NULL && out != NULL)
+    {
+        // Every field is a long long bumped with STAT_ADD; each is read on its own,
+        // so a call never waits behind a writer or an open transaction
+        const long long *counters = (const long long *)&fs->stats;
+        long long *copy = (long long *)out;
+        for (size_t i = 0; i < sizeof(fs_stats) / sizeof(long long); i++)
+        {
+            copy[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void fs_get_stats(fs_stats *out)
+{
+    fs_get_stats_ctx(&default_context, out);
+}
+
+int fs_set_commit_interval_ctx(fs_ctx *fs, int operations)
+{
+    if (fs == NULL || operations < 1 || fs->disk_fd < 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->commit_interval = operations;
+    if (fs->ops_since_commit >= fs->commit_interval && !fs->txn.active)
+    {
+        journal_commit(fs);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 0;
+}
+
+int fs_set_commit_interval(int operations)
+{
+    return fs_set_commit_interval_ctx(&default_context, operations);
+}
+
+int durability_valid(int mode, int operations, int milliseconds)
+{
+    return mode >= FS_DURABILITY_NONE && mode <= FS_DURABILITY_LAZY && operations >= 0 && milliseconds >= 0 &&
+           !(mode == FS_DURABILITY_PERIODIC && operations == 0 && milliseconds == 0);
+}
+
+int fs_set_durability_ctx(fs_ctx *fs, int mode, int operations, int milliseconds)
+{
+    if (fs == NULL || !durability_valid(mode, operations, milliseconds))
+    {
+        return -1;
+    }
+    // Fail at once, as fs_txn_begin does, while any thread's transaction is open:
+    // waiting for it would leave the flusher stopped until it ends. txn_gate held
+    // shared keeps a new one from starting until the mode is set.
+    if (pthread_rwlock_tryrdlock(&fs->txn_gate) != 0)
+    {
+        return -1;
+    }
+
+    stop_flusher(fs);
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->durability = mode;
+    fs->flush_operations = (mode == FS_DURABILITY_PERIODIC) ? operations : 0;
+    fs->flush_milliseconds = (mode == FS_DURABILITY_PERIODIC) ? milliseconds : 0;
+    if (fs->disk_fd >= 0 && fs->ops_since_commit >= commit_threshold(fs))
+    {
+        journal_commit(fs);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    start_flusher(fs);
+    pthread_rwlock_unlock(&fs->txn_gate);
+    return 0;
+}
+
+int fs_set_durability(int mode, int operations, int milliseconds)
+{
+    return fs_set_durability_ctx(&default_context, mode, operations, milliseconds);
+}
+
+int fs_sync_ctx(fs_ctx *fs)
+{
+    if (fs == NULL)
+    {
+        return -1; // Not mounted
+    }
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->disk_fd < 0)
+    {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+    // Data first, so the commit's records never reach the disk ahead of the blocks they name
+    int result = 0;
+    if (flush_data(fs) != 0)
+    {
+        result = -3; // Nothing is committed on top of data that may not be stable
+    }
+    else if (!fs->txn.active && journal_commit(fs) != 0)
+    {
+        result = -3; // An open transaction stays uncommitted; what was committed before it is flushed
+    }
+    if (flush_image(fs) != 0)
+    {
+        result = -3;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return result;
+}
+
+int fs_sync()
+{
+    return fs_sync_ctx(&default_context);
+}
+
+int read_file_zerocopy(fs_ctx *c, const char *filename, fs_segment *segments, int max_segments)
+{
+    if (filename == NULL || validate_string_manual(filename) != 0 || strlen(filename) > MAX_FILENAME || segments == NULL || max_segments < 0 || c->disk_fd == -1 || c->disk_map == NULL)
+    {
+        return -3; // Error: invalid parameters or image not memory-mapped
+    }
+
+    int inode_index = find_inode(c, filename);
+    if (inode_index == -1)
+    {
+        return -1; // Error: file not found
+    }
+
+    inode target_inode;
+    read_inode(c, inode_index, &target_inode);
+
+    int count = 0;
+    long long bytes_mapped = 0;
+
+    for (int i = 0; bytes_mapped < target_inode.size; i++)
+    {
+        int block_index = bmap(c, &target_inode, i);
+        if (block_index == -1)
+        {
+            break;
+        }
+        if (block_index < 0 || block_index >= c->geo.total_blocks)
+        {
+            return -3; // Error: invalid block index
+        }
+
+        const char *block_data = c->disk_map + (off_t)block_index * c->geo.block_size;
+        long long remaining_bytes = target_inode.size - bytes_mapped;
+        int length = (remaining_bytes > c->geo.block_size) ? c->geo.block_size : (int)remaining_bytes;
+
+        // Physically adjacent blocks extend the previous segment, up to the int length limit
+        if (count > 0 && (const char *)segments[count - 1].data + segments[count - 1].length == block_data &&
+            segments[count - 1].length <= INT_MAX - length)
+        {
+            segments[count - 1].length += length;
+        }
+        else
+        {
+            if (count == max_segments)
+            {
+                break; // Caller's array is full
+            }
+            segments[count].data = block_data;
+            segments[count].length = length;
+            count++;
+        }
+        bytes_mapped += length;
+    }
+
+    return count;
+}
+
+int fs_read_zerocopy_ctx(fs_ctx *fs, const char *filename, fs_segment *segments, int max_segments)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    pthread_rwlock_t *lock = lock_file(fs, filename, 0);
+    int result = read_file_zerocopy(fs, filename, segments, max_segments);
+    unlock_file(fs, lock, 0);
+    return result;
+}
+
+int fs_read_zerocopy(const char *filename, fs_segment *segments, int max_segments)
+{
+    return fs_read_zerocopy_ctx(&default_context, filename, segments, max_segments);
+}
+
+int fs_set_cache_size_ctx(fs_ctx *fs, int blocks)
+{
+    if (fs == NULL || blocks < 0)
+    {
+        return -1;
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    pthread_rwlock_wrlock(&fs->cache_lock);
+    fs->data_cache_blocks = blocks;
+    if (fs->disk_fd >= 0 && fs->disk_map == NULL)
+    {
+        result = cache_init(fs, &fs->data_cache, blocks);
+    }
+    pthread_rwlock_unlock(&fs->cache_lock);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return result;
+}
+
+int fs_set_cache_size(int blocks)
+{
+    return fs_set_cache_size_ctx(&default_context, blocks);
+}
+
+int fs_set_extent_mapping_ctx(fs_ctx *fs, int enabled)
+{
+    if (fs == NULL || (enabled != 0 && enabled != 1))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->extent_mapping = enabled;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 0;
+}
+
+int fs_set_extent_mapping(int enabled)
+{
+    return fs_set_extent_mapping_ctx(&default_context, enabled);
+}
+
+int fs_set_io_uring_ctx(fs_ctx *fs, int enabled)
+{
+    if (fs == NULL || (enabled != 0 && enabled != 1))
+    {
+        return -1;
+    }
+
+    // Readers test the flag without locks; a transfer already under way keeps its engine
+    __atomic_store_n(&fs->io_uring, enabled, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int fs_set_io_uring(int enabled)
+{
+    return fs_set_io_uring_ctx(&default_context, enabled);
+}
+
+int fs_read_async_ctx(fs_ctx *fs, const char *filename, void *buffer, int size, fs_completion callback, void *cookie)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    return submit_async(fs, 0, filename, buffer, size, callback, cookie);
+}
+
+int fs_read_async(const char *filename, void *buffer, int size, fs_completion callback, void *cookie)
+{
+    return fs_read_async_ctx(&default_context, filename, buffer, size, callback, cookie);
+}
+
+int fs_write_async_ctx(fs_ctx *fs, const char *filename, const void *data, int size, fs_completion callback, void *cookie)
+{
+    if (fs == NULL)
+    {
+        return -3; // Not mounted
+    }
+    return submit_async(fs, 1, filename, (void *)data, size, callback, cookie);
+}
+
+int fs_write_async(const char *filename, const void *data, int size, fs_completion callback, void *cookie)
+{
+    return fs_write_async_ctx(&default_context, filename, data, size, callback, cookie);
+}
+
+int fs_completion_fd_ctx(fs_ctx *fs)
+{
+    if (fs == NULL || fs->disk_fd < 0)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&fs->async.lock);
+    int fd = open_completion_fd(&fs->async);
+    pthread_mutex_unlock(&fs->async.lock);
+    return fd;
+}
+
+int fs_completion_fd()
+{
+    return fs_completion_fd_ctx(&default_context);
+}
+
+int fs_poll_completions_ctx(fs_ctx *fs, int max_completions)
+{
+    if (fs == NULL || max_completions < 0)
+    {
+        return -1;
+    }
+    int count;
+    run_completions(take_completions(fs, max_completions, &count));
+    return count;
+}
+
+int fs_poll_completions(int max_completions)
+{
+    return fs_poll_completions_ctx(&default_context, max_completions);
+}
+
+void free_context(fs_ctx *fs)
+{
+    // Frees a context mount_context allocated, once nothing uses it. The inode
+    // locks go with the metadata arrays; the rest are destroyed here.
+    free_metadata_arrays(fs);
+    pthread_rwlock_destroy(&fs->txn_gate);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_rwlock_destroy(&fs->names_lock);
+    pthread_rwlock_destroy(&fs->cache_lock);
+    pthread_mutex_destroy(&fs->async.lock);
+    pthread_cond_destroy(&fs->async.idle);
+    pthread_mutex_destroy(&fs->flusher.lock);
+    pthread_cond_destroy(&fs->flusher.wake);
+    free(fs);
+}
+
+fs_ctx *mount_context(const char *disk_path, int use_mmap, int mode, int operations, int milliseconds)
+{
+    if ((use_mmap != 0 && use_mmap != 1) || !durability_valid(mode, operations, milliseconds))
+    {
+        return NULL;
+    }
+    fs_ctx *fs = malloc(sizeof(fs_ctx));
+    if (fs == NULL)
+    {
+        return NULL;
+    }
+    *fs = (fs_ctx)CONTEXT_DEFAULTS;
+
+    // Set before mount_image, which starts the flusher the mode asks for
+    fs->durability = mode;
+    fs->flush_operations = (mode == FS_DURABILITY_PERIODIC) ? operations : 0;
+    fs->flush_milliseconds = (mode == FS_DURABILITY_PERIODIC) ? milliseconds : 0;
+
+    if (mount_image(fs, disk_path, use_mmap) != 0)
+    {
+        free_context(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+fs_ctx *fs_mount_ctx(const char *disk_path)
+{
+    return mount_context(disk_path, 0, FS_DURABILITY_NONE, 0, 0);
+}
+
+fs_ctx *fs_mount_mmap_ctx(const char *disk_path)
+{
+    return mount_context(disk_path, 1, FS_DURABILITY_NONE, 0, 0);
+}
+
+fs_ctx *fs_mount_ex_ctx(const char *disk_path, int use_mmap, int mode, int operations, int milliseconds)
+{
+    return mount_context(disk_path, use_mmap, mode, operations, milliseconds);
+}
+
+void fs_unmount_ctx(fs_ctx *fs)
+{
+    if (fs != NULL)
+    {
+        unmount_image(fs);
+        free_context(fs);
+    }
 }
@@ -8,7 +8,7 @@
  * features found in production filesystems.
  *
  * The filesystem is designed to be contained within a single disk image file,
- * with a fixed layout of metadata and data blocks.
+ * with a layout of metadata and data blocks fixed when the image is formatted.
  *
  * DO NOT MODIFY THIS HEADER FILE FOR YOUR IMPLEMENTATION.
  */
@@ -30,37 +30,51 @@
 #define MAX_FILENAME 28
 
 /**
- * @brief Maximum number of files supported by the filesystem
+ * @brief Number of files supported by a default filesystem
  * 
- * The filesystem can hold up to 256 files simultaneously. This value
- * determines the size of the inode table.
+ * fs_format() creates an inode table for 256 files. Images made with
+ * fs_format_ex() can hold a different number.
  */
 #define MAX_FILES 256
 
 /**
- * @brief Total number of blocks in the filesystem
+ * @brief Total number of blocks in a default filesystem
  * 
- * The filesystem contains 2560 blocks in total. With a block size of 4KB,
+ * fs_format() creates 2560 blocks in total. With a block size of 4KB,
  * this gives a total virtual disk size of 10MB (2560 * 4096 = 10,485,760 bytes).
  */
 #define MAX_BLOCKS 2560
 
 /**
- * @brief Size of each block in bytes
+ * @brief Size of each block in bytes in a default filesystem
  * 
- * Each block is 4KB (4096 bytes) in size. This value affects file I/O operations
- * and determines the granularity of storage allocation.
+ * fs_format() uses 4KB (4096 byte) blocks. The block size affects file I/O
+ * operations and determines the granularity of storage allocation.
  */
 #define BLOCK_SIZE 4096
 
 /**
  * @brief Maximum number of direct block pointers per file
  * 
- * Each file can reference up to 12 direct blocks, which means the maximum
- * file size is 12 * 4KB = 48KB. This filesystem does not support indirect blocks.
+ * The first 12 blocks of a file (48KB) are referenced directly from the
+ * inode. Larger files continue through a single indirect block (1024 more
+ * blocks, 4MB) and a double indirect block (1024 * 1024 blocks, 4TB), so a
+ * file is limited by the free space. Pointer blocks hold block_size / 4
+ * entries, so other block sizes scale these limits. Extent-mapped files
+ * are not bound by them.
  */
 #define MAX_DIRECT_BLOCKS 12
 
+/**
+ * @brief Identifies an image made by fs_format() or fs_format_ex()
+ * 
+ * The superblock starts with FS_MAGIC ("SFS1") and FS_VERSION, the on-image
+ * layout version. fs_mount() rejects images whose superblock lacks the magic
+ * or carries another version, such as images from older layouts.
+ */
+#define FS_MAGIC 0x31534653u
+#define FS_VERSION 1
+
 /**
  * @brief Superblock structure containing filesystem metadata
  * 
@@ -69,27 +83,97 @@
  * the first block of the filesystem (block 0).
  */
 typedef struct {
-    int total_blocks;  /**< Total number of blocks in the filesystem (2560) */
-    int block_size;    /**< Size of each block in bytes (4096) */
+    unsigned int magic; /**< FS_MAGIC */
+    int version;       /**< FS_VERSION of the layout the image was formatted with */
+    int total_blocks;  /**< Total number of blocks in the filesystem (2560 by default) */
+    int block_size;    /**< Size of each block in bytes (4096 by default) */
     int free_blocks;   /**< Number of blocks currently available for allocation */
-    int total_inodes;  /**< Total number of inodes/files the filesystem can hold (256) */
+    int total_inodes;  /**< Total number of inodes/files the filesystem can hold (256 by default) */
     int free_inodes;   /**< Number of inodes currently available for allocation */
+    int journal_seq;   /**< Sequence number of the first journal transaction not yet checkpointed */
 } superblock;
 
+/**
+ * @brief Inode flag: blocks[] holds extents instead of block pointers
+ * 
+ * An extent-mapped inode stores up to MAX_DIRECT_BLOCKS / 2 extents as
+ * (first block, block count) pairs in blocks[], with a count of 0 marking
+ * the unused pairs. A file that would need more extents is converted to
+ * direct and indirect block pointers.
+ */
+#define INODE_EXTENTS 0x1
+
 /**
  * @brief Inode structure representing a file
  * 
  * Each file in the filesystem is represented by an inode, which stores
  * metadata about the file and pointers to its data blocks. The inode table
- * starts at block 2 and occupies 8 blocks (blocks 2-9).
+ * starts at block 2 with 128 bytes reserved per inode (blocks 2-9 by default).
  */
 typedef struct {
     int used;                          /**< Flag indicating if this inode is in use (1) or free (0) */
     char name[MAX_FILENAME];           /**< Name of the file (up to 28 characters + null terminator) */
-    int size;                          /**< Size of the file in bytes */
+    long long size;                    /**< Size of the file in bytes */
     int blocks[MAX_DIRECT_BLOCKS];     /**< Array of block indices containing file data */
+    int indirect_block;                /**< Block of pointers to the next 1024 data blocks, or -1 */
+    int double_indirect_block;         /**< Block of pointers to blocks of data block pointers, or -1 */
+    int flags;                         /**< Mapping format flags (INODE_EXTENTS) */
 } inode;
 
+/**
+ * @brief I/O counters for the mounted filesystem
+ * 
+ * Counters start at zero on every successful fs_mount and can be read at any
+ * time with fs_get_stats().
+ */
+typedef struct {
+    long long metadata_syncs;         /**< Number of create, delete and write calls that changed metadata */
+    long long metadata_bytes_written; /**< Metadata bytes written, to the journal and to their home location */
+    long long journal_commits;        /**< Journal transactions written (one per group of operations) */
+    long long journal_bytes_written;  /**< Bytes of those transactions */
+    long long checkpoints;            /**< Times committed metadata was copied home and the journal reused */
+    long long data_io_calls;          /**< preadv/pwritev calls issued for file data (one per contiguous run) */
+    long long cache_hits;             /**< Data blocks fs_read served from the block cache */
+    long long cache_misses;           /**< Data blocks fs_read had to fetch from the image */
+    long long pointer_block_reads;    /**< Indirect blocks read from the image (misses in the indirect cache) */
+    long long ring_submissions;       /**< io_uring submissions, each carrying several transfers (see fs_set_io_uring) */
+    long long flushes;                /**< fdatasync/msync calls forcing the image to stable storage (see fs_set_durability) */
+} fs_stats;
+
+/**
+ * @brief A run of file bytes inside a memory-mapped image
+ * 
+ * Filled in by fs_read_zerocopy(). The bytes are read-only and stay valid
+ * until the file is next written or deleted, or the filesystem is unmounted.
+ */
+typedef struct {
+    const void* data; /**< First byte of the run */
+    int length;       /**< Number of bytes in the run */
+} fs_segment;
+
+/**
+ * @brief Completion callback of fs_read_async() and fs_write_async()
+ * 
+ * @param cookie The value passed when the request was submitted
+ * @param result What fs_read() or fs_write() would have returned
+ */
+typedef void (*fs_completion)(void* cookie, int result);
+
+#define FS_OP_CREATE 1 /**< fs_op type: create 'filename' as fs_create() does */
+#define FS_OP_WRITE 2  /**< fs_op type: replace its contents as fs_write() does */
+#define FS_OP_DELETE 3 /**< fs_op type: delete it as fs_delete() does */
+
+/**
+ * @brief One operation of an fs_batch() call
+ */
+typedef struct {
+    int type;             /**< FS_OP_CREATE, FS_OP_WRITE or FS_OP_DELETE */
+    const char* filename; /**< File the operation applies to */
+    const void* data;     /**< FS_OP_WRITE: the new contents */
+    int size;             /**< FS_OP_WRITE: bytes in data */
+    int result;           /**< Set by fs_batch(): 0, or the error of the operation that failed */
+} fs_op;
+
 /**
  * @brief Creates and formats a new filesystem
  * 
@@ -100,13 +184,34 @@ typedef struct {
  * - Block 0: Superblock (4KB)
  * - Block 1: Block bitmap (4KB)
  * - Blocks 2-9: Inode table (32KB = 256 inodes × 128B)
- * - Blocks 10-2559: Data blocks (~9.96MB)
+ * - Blocks 10-25: Metadata journal (64KB)
+ * - Blocks 26-2559: Data blocks (~9.9MB)
  * 
  * @param disk_path Path where the disk image file will be created
- * @return 0 on success, -1 on error (e.g., cannot create file)
+ * @return 0 on success, -1 on error (e.g., cannot create file, or the image
+ *         is mounted in some context; other images may stay mounted)
  */
 int fs_format(const char* disk_path);
 
+/**
+ * @brief Creates and formats a filesystem with a chosen geometry
+ * 
+ * Like fs_format(), which is fs_format_ex(disk_path, MAX_BLOCKS, BLOCK_SIZE,
+ * MAX_FILES). The geometry is stored in the superblock and fs_mount() sizes
+ * the bitmap and inode table from it. Block 0 holds the superblock and the
+ * bitmap starts at block 1, one bit per block over as many blocks as it
+ * needs. The inode table follows with 128 bytes per inode, then a journal
+ * of 64KB to 2MB, then the data blocks.
+ * 
+ * @param disk_path Path where the disk image file will be created
+ * @param total_blocks Number of blocks, at most 2^30 (e.g. 4TB of 4KB blocks)
+ * @param block_size Block size in bytes, a power of two from 512 to 65536
+ * @param total_inodes Number of files the image can hold, from 1 to 65536
+ * @return 0 on success, -1 on error (e.g., cannot create file, unsupported
+ *         geometry, no room left for data blocks, or the image is mounted)
+ */
+int fs_format_ex(const char* disk_path, int total_blocks, int block_size, int total_inodes);
+
 /**
  * @brief Mounts an existing filesystem
  * 
@@ -114,11 +219,28 @@ int fs_format(const char* disk_path);
  * preparing it for use. This function should verify that the disk image
  * contains a valid filesystem structure.
  * 
+ * Metadata transactions committed to the journal but not yet copied to
+ * their home location (e.g. after a crash) are replayed here.
+ * 
  * @param disk_path Path to the disk image file to mount
  * @return 0 on success, -1 on error (e.g., file not found or invalid filesystem)
  */
 int fs_mount(const char* disk_path);
 
+/**
+ * @brief Mounts an existing filesystem by memory-mapping the whole image
+ * 
+ * Behaves like fs_mount(), but maps the full image (total_blocks * block_size
+ * bytes) into memory. All metadata and data accesses then become memory
+ * copies instead of read/write syscalls, and fs_read_zerocopy() becomes
+ * available. Unmount with fs_unmount() as usual.
+ * 
+ * @param disk_path Path to the disk image file to mount
+ * @return 0 on success, -1 on error (e.g. file not found, image smaller than
+ *         the full filesystem size, or invalid filesystem)
+ */
+int fs_mount_mmap(const char* disk_path);
+
 /**
  * @brief Unmounts the filesystem
  * 
@@ -176,6 +298,39 @@ int fs_list(char filenames[][MAX_FILENAME], int max_files);
  */
 int fs_write(const char* filename, const void* data, int size);
 
+/**
+ * @brief Writes data at an offset within a file
+ * 
+ * Overwrites 'size' bytes starting at byte 'offset', updating only the
+ * blocks the range touches, in place. Blocks are allocated only when the
+ * write extends the file; writing past the end fills the gap with zeros.
+ * Unlike fs_write, a failed or interrupted write may leave some of the
+ * overwritten bytes updated, but the file size and blocks stay consistent.
+ * 
+ * @param filename Name of the file to write to
+ * @param offset Byte offset to start writing at; files can exceed 2GB
+ * @param data Pointer to the data to write
+ * @param size Number of bytes to write
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other
+ *         errors (including offset + size beyond the maximum file size of
+ *         2^30 blocks)
+ */
+int fs_pwrite(const char* filename, long long offset, const void* data, int size);
+
+/**
+ * @brief Appends data to the end of a file
+ * 
+ * Equivalent to fs_pwrite() at the current file size: the partial last
+ * block is filled in place and only the additional blocks are allocated.
+ * 
+ * @param filename Name of the file to append to
+ * @param data Pointer to the data to append
+ * @param size Number of bytes to append
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other
+ *         errors (including growing past the maximum file size)
+ */
+int fs_append(const char* filename, const void* data, int size);
+
 /**
  * @brief Reads data from a file
  * 
@@ -189,4 +344,405 @@ int fs_write(const char* filename, const void* data, int size);
  */
 int fs_read(const char* filename, void* buffer, int size);
 
+/**
+ * @brief Reads data from an offset within a file
+ * 
+ * Reads up to 'size' bytes starting at byte 'offset', touching only the
+ * blocks that hold the requested range. Reading at or past the end of the
+ * file returns 0.
+ * 
+ * @param filename Name of the file to read from
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param offset Byte offset to start reading at; files can exceed 2GB
+ * @param size Size of the buffer in bytes
+ * @return Number of bytes read on success, -1 if file not found, -3 for other errors
+ */
+int fs_pread(const char* filename, void* buffer, long long offset, int size);
+
+/**
+ * @brief Returns a file's contents without copying them
+ * 
+ * Only available when mounted with fs_mount_mmap(). Fills 'segments' with
+ * pointers into the mapped image covering the file from byte 0, merging
+ * physically adjacent blocks into one segment. If the file needs more than
+ * max_segments segments, only the first max_segments are returned.
+ * 
+ * @param filename Name of the file to read
+ * @param segments Pre-allocated array to receive the segments
+ * @param max_segments Capacity of the array
+ * @return Number of segments filled (0 for an empty file), -1 if file not
+ *         found, -3 if not memory-mapped or for other errors
+ */
+int fs_read_zerocopy(const char* filename, fs_segment* segments, int max_segments);
+
+/**
+ * @brief Applies many creates, writes and deletes all together or not at all
+ * 
+ * Runs the operations in array order as if by fs_create(), fs_write() and
+ * fs_delete(), so later ones see the files earlier ones create or delete.
+ * All of them are checked before anything changes; the blocks of every
+ * write are then allocated together, their data is written in as few
+ * requests as the layout allows, and the metadata of the whole batch is
+ * synced once, as one journal transaction. If any operation would fail,
+ * none is applied: the function returns that operation's error, which is
+ * also stored in its result field. Other threads see the batch either not
+ * started or complete.
+ *
+ * Writes that fit only in blocks the batch's own deletes and rewrites free
+ * are allowed outside a transaction: the batch then commits its metadata
+ * first and writes the data right after, so a crash in between can leave
+ * those files with stale contents.
+ *
+ * @param ops Operations to apply
+ * @param count Number of operations
+ * @return 0 if all were applied, otherwise -1, -2 or -3 as the failing
+ *         operation's own call would return, or -3 if not mounted, ops is
+ *         NULL or an operation has an unknown type
+ */
+int fs_batch(fs_op* ops, int count);
+
+/**
+ * @brief Starts a transaction grouping the calls that follow
+ * 
+ * Until fs_txn_commit() or fs_txn_abort(), the calling thread's fs_create(),
+ * fs_write(), fs_pwrite(), fs_append(), fs_delete() and fs_batch() calls
+ * change metadata in memory only; none of them writes or journals it. Each
+ * change is logged so that it can be undone. Calls that change metadata from
+ * other threads wait until the transaction ends, while reads carry on and
+ * see its uncommitted files. Blocks freed inside the transaction can be
+ * reused only after it commits. One transaction can be open per context.
+ * 
+ * @return 0 on success, -1 if not mounted or a transaction is already open,
+ *         on this thread or another (returned without waiting for it to end)
+ */
+int fs_txn_begin();
+
+/**
+ * @brief Ends the open transaction, keeping its changes
+ * 
+ * Writes all metadata the transaction changed as one journal transaction,
+ * so after a crash either all of its calls took effect or none did. One
+ * too big for the journal is written to free data blocks, which are
+ * reused once it has been copied home.
+ * 
+ * @return 0 on success, -1 at once if the calling thread has no open
+ *         transaction (another thread's is left alone), -3 if
+ *         the commit could not be written or flushed (the transaction is
+ *         ended and its changes kept in memory)
+ */
+int fs_txn_commit();
+
+/**
+ * @brief Ends the open transaction, undoing its changes
+ * 
+ * Restores every file's name, size and blocks as they were at
+ * fs_txn_begin(), and the space the transaction allocated becomes free
+ * again. fs_write() puts data in new blocks, so the old contents come back;
+ * bytes fs_pwrite() and fs_append() wrote into a file's existing blocks stay
+ * overwritten. fs_unmount() aborts a transaction left open.
+ * 
+ * @return 0 on success, -1 at once if the calling thread has no open
+ *         transaction (another thread's is left alone), -2 if memory ran out
+ *         while logging the changes: they are then committed as by
+ *         fs_txn_commit() instead
+ */
+int fs_txn_abort();
+
+/**
+ * @brief Queues an fs_read() and returns without waiting for it
+ * 
+ * The read runs on one of a few worker threads that every context shares,
+ * started on the first asynchronous request in the process, so contexts
+ * that make none cost no threads. When it finishes, the completion is queued
+ * and the descriptor from fs_completion_fd() becomes readable; the callback
+ * runs when the application calls fs_poll_completions(). 'buffer' must stay
+ * valid until then. Requests may complete in any order.
+ * 
+ * @param filename Name of the file to read from
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Size of the buffer in bytes
+ * @param callback Called with 'cookie' and fs_read()'s return value
+ * @param cookie Passed to the callback unchanged
+ * @return 0 if queued, -3 if not mounted, for invalid parameters or if no
+ *         worker could be started (the callback is then never called)
+ */
+int fs_read_async(const char* filename, void* buffer, int size, fs_completion callback, void* cookie);
+
+/**
+ * @brief Queues an fs_write() and returns without waiting for it
+ * 
+ * Like fs_read_async(). 'data' is not copied and must stay unchanged until
+ * the callback runs. Writes to the same file queued one after another may
+ * run in either order; wait for the first completion to order them.
+ * 
+ * @param filename Name of the file to write to
+ * @param data Data to write
+ * @param size Size of the data in bytes
+ * @param callback Called with 'cookie' and fs_write()'s return value
+ * @param cookie Passed to the callback unchanged
+ * @return 0 if queued, -3 if not mounted, for invalid parameters or if no
+ *         worker could be started (the callback is then never called)
+ */
+int fs_write_async(const char* filename, const void* data, int size, fs_completion callback, void* cookie);
+
+/**
+ * @brief Returns a descriptor that is readable while completions wait
+ * 
+ * A non-blocking eventfd to register with epoll, poll or select. Do not
+ * read it directly; call fs_poll_completions() when it becomes readable.
+ * It stays open until fs_unmount(), which closes it.
+ * 
+ * @return The descriptor, or -1 if not mounted or it cannot be created
+ */
+int fs_completion_fd();
+
+/**
+ * @brief Runs the callbacks of finished asynchronous requests
+ * 
+ * Calls the callbacks of up to max_completions finished requests on the
+ * calling thread, oldest first, and never blocks. Callbacks may submit new
+ * requests. fs_unmount() waits for all queued requests and runs the
+ * callbacks not collected yet itself; those must not call into the
+ * filesystem.
+ * 
+ * @param max_completions Most callbacks to run
+ * @return Number of callbacks run, -1 if max_completions is negative
+ */
+int fs_poll_completions(int max_completions);
+
+/**
+ * @brief Retrieves the I/O counters
+ * 
+ * Copies the counters accumulated since the last fs_mount. Only the
+ * superblock, bitmap bytes and inode-table blocks changed by an operation
+ * are written back, so metadata_bytes_written / metadata_syncs gives the
+ * average metadata write cost per operation.
+ * 
+ * @param stats Structure to receive the counters (ignored if NULL)
+ */
+void fs_get_stats(fs_stats* stats);
+
+/**
+ * @brief Sets how many operations share one journal commit
+ * 
+ * Metadata changes made by create, delete and write are recorded in the
+ * on-image journal. With an interval of N, the changes of N consecutive
+ * operations are committed together as one sequential journal write (group
+ * commit). A crash loses at most the last N - 1 operations but never leaves
+ * the metadata half-updated. fs_unmount commits whatever is still pending,
+ * and a group whose changes outgrow the journal commits early.
+ * The interval resets to 1 on every fs_mount. It applies in the default
+ * FS_DURABILITY_NONE mode; the other modes of fs_set_durability() decide
+ * themselves when to commit.
+ * 
+ * @param operations Number of operations per commit (at least 1)
+ * @return 0 on success, -1 if not mounted or operations < 1
+ */
+int fs_set_commit_interval(int operations);
+
+#define FS_DURABILITY_NONE 0     /**< Commit per fs_set_commit_interval(), leave flushing to the kernel (default) */
+#define FS_DURABILITY_STRICT 1   /**< Commit and flush before every changing call returns */
+#define FS_DURABILITY_PERIODIC 2 /**< Commit and flush every N operations and/or every N milliseconds */
+#define FS_DURABILITY_LAZY 3     /**< Commit and flush only in fs_sync() and fs_unmount() */
+
+/**
+ * @brief Chooses when changes reach stable storage
+ * 
+ * Journal commits are written to the image, but a write only survives a
+ * power failure once it has been flushed with fdatasync (msync for images
+ * mounted with fs_mount_mmap()). In FS_DURABILITY_NONE, the default, commits
+ * follow fs_set_commit_interval() and are never flushed: a crash of the
+ * process loses nothing committed, a crash of the machine may. STRICT
+ * commits and flushes every call that changes a file, including in-place
+ * fs_pwrite() data, before it returns. PERIODIC commits and flushes after
+ * 'operations' changing calls and every 'milliseconds' (from a background
+ * thread) if anything is waiting, so at most that much work is lost. LAZY
+ * keeps metadata changes in memory until fs_sync() (or until space freed
+ * since the last commit is needed), so a crash loses everything since the
+ * last fs_sync(). In every mode, changes waiting for a commit are committed
+ * early once their journal records fill half of the largest journal
+ * transaction, so that one commit always fits the journal. In LAZY that
+ * commit is written but not flushed: it survives a crash of the process,
+ * not of the machine. Whatever the mode, a commit is
+ * never half applied, and fs_unmount() returns with everything flushed.
+ * Whenever a commit is flushed, the file data it refers to is flushed
+ * before the commit is written, so no crash leaves a file pointing at
+ * blocks whose new contents never reached the disk.
+ * A call whose commit or flush fails returns -3: its change is made in
+ * memory but may not survive a crash.
+ * The mode applies immediately and to later mounts; transactions and
+ * fs_batch() calls still commit once, at their end. fs_mount_ex_ctx()
+ * mounts a new context already in a mode.
+ * 
+ * @param mode FS_DURABILITY_NONE, _STRICT, _PERIODIC or _LAZY
+ * @param operations PERIODIC only: changing calls per commit, 0 for no limit
+ * @param milliseconds PERIODIC only: time between commits, 0 for no timer
+ * @return 0 on success, -1 for an unknown mode, negative values, PERIODIC
+ *         with both limits 0, or at once, without waiting, while a
+ *         transaction is open on any thread
+ */
+int fs_set_durability(int mode, int operations, int milliseconds);
+
+/**
+ * @brief Commits every pending change and flushes the image to stable storage
+ * 
+ * After it returns, a crash loses nothing done before the call. Inside a
+ * transaction, only the changes committed before fs_txn_begin() are flushed.
+ * 
+ * @return 0 on success, -1 if not mounted, -3 if the flush failed
+ */
+int fs_sync();
+
+/**
+ * @brief Sets the size of the in-memory data block cache
+ * 
+ * fs_read serves blocks from the cache when it can and adds the blocks it
+ * fetches, evicting with the CLOCK algorithm when full. Blocks are dropped
+ * from the cache when they are written or freed (fs_write, fs_delete).
+ * The cache holds 256 blocks (1MB of 4KB blocks) by default; 0 disables it. The size
+ * applies immediately (emptying the cache) and to later mounts. Images
+ * mounted with fs_mount_mmap() are never cached.
+ * 
+ * @param blocks Number of blocks to cache
+ * @return 0 on success, -1 if blocks is negative or memory is exhausted
+ */
+int fs_set_cache_size(int blocks);
+
+/**
+ * @brief Chooses the block mapping format for new file contents
+ * 
+ * With extent mapping on (the default), files created and fully rewritten
+ * with fs_write store their blocks as a few (start, length) extents, so a
+ * contiguous file of any size needs no pointer blocks and reads back in
+ * large sequential requests. Off, they use direct and indirect block
+ * pointers. Existing files keep their format until rewritten.
+ * 
+ * @param enabled 1 to use extents, 0 for block pointers
+ * @return 0 on success, -1 if enabled is not 0 or 1
+ */
+int fs_set_extent_mapping(int enabled);
+
+/**
+ * @brief Chooses whether independent transfers go through io_uring
+ * 
+ * Off by default: every contiguous run of a file transfer, and every
+ * range written home at a checkpoint, is its own preadv/pwritev. On, the
+ * runs of one fs_read or fs_write and the ranges of one checkpoint are
+ * submitted together to an io_uring owned by the calling thread and reaped
+ * in one wait, so the device sees them all at once. Single transfers and
+ * images mounted with fs_mount_mmap() are unaffected, and if the kernel
+ * does not offer io_uring the calls keep using preadv/pwritev. Reads gain
+ * most; buffered writes to an image in the page cache can be slower, as
+ * the kernel hands them to its worker threads.
+ * 
+ * @param enabled 1 to batch through io_uring, 0 for one syscall per transfer
+ * @return 0 on success, -1 if enabled is not 0 or 1
+ */
+int fs_set_io_uring(int enabled);
+
+/**
+ * @brief Handle to one mounted filesystem image
+ *
+ * The fs_* calls above all work on a single default context, so a process
+ * using only them mounts one image at a time. fs_mount_ctx() returns an
+ * independent context, and each operation has a *_ctx variant taking it,
+ * so one process can keep many images mounted. The fields are private to
+ * fs.c.
+ *
+ * Any thread may call into any context, and calls on one context may run
+ * at the same time: reads of the same or different files proceed in
+ * parallel, a write excludes readers of its own file only, and writes to
+ * different files move their data in parallel, taking turns only to
+ * allocate blocks and change metadata, as do fs_create() and fs_delete().
+ * fs_read() and fs_pread() take no lock
+ * unless a write, create or delete overlaps them, in which case they are
+ * retried under the locks, so they never return a mix of two versions.
+ * Mounting, unmounting and formatting must not overlap other calls on the
+ * same context.
+ */
+typedef struct fs_ctx fs_ctx;
+
+/**
+ * @brief Mounts an image into a new context
+ *
+ * Like fs_mount(), but the image gets its own context instead of the
+ * default one, independent of any other mounted image.
+ *
+ * @param disk_path Path to the disk image file to mount
+ * @return The new context, or NULL on the same errors as fs_mount() or if
+ *         memory is exhausted
+ */
+fs_ctx* fs_mount_ctx(const char* disk_path);
+
+/**
+ * @brief Memory-maps an image into a new context
+ *
+ * Like fs_mount_mmap(), but the image gets its own context.
+ *
+ * @param disk_path Path to the disk image file to mount
+ * @return The new context, or NULL on error
+ */
+fs_ctx* fs_mount_mmap_ctx(const char* disk_path);
+
+/**
+ * @brief Mounts an image into a new context in a chosen durability mode
+ *
+ * Like fs_mount_ctx(), or fs_mount_mmap_ctx() with use_mmap, followed by
+ * fs_set_durability_ctx(), except that the mode is in force from the
+ * start: no call on the context ever runs under the default mode.
+ *
+ * @param disk_path Path to the disk image file to mount
+ * @param use_mmap 1 to map the image as fs_mount_mmap_ctx() does, 0 otherwise
+ * @param mode FS_DURABILITY_NONE, _STRICT, _PERIODIC or _LAZY
+ * @param operations As for fs_set_durability()
+ * @param milliseconds As for fs_set_durability()
+ * @return The new context, or NULL on the errors of fs_mount_ctx() or if
+ *         fs_set_durability() would reject the settings
+ */
+fs_ctx* fs_mount_ex_ctx(const char* disk_path, int use_mmap, int mode, int operations, int milliseconds);
+
+/**
+ * @brief Unmounts the image of a context and frees the context
+ *
+ * Writes everything back as fs_unmount() does. The handle must not be used
+ * afterwards. NULL is ignored.
+ *
+ * @param fs Context returned by fs_mount_ctx() or fs_mount_mmap_ctx()
+ */
+void fs_unmount_ctx(fs_ctx* fs);
+
+/**
+ * @brief Per-context variants of the file operations
+ *
+ * Each behaves exactly like the function of the same name without the
+ * suffix, on the image mounted in 'fs' instead of the default context.
+ * Settings (commit interval, durability, cache size, extent mapping)
+ * belong to the context. A NULL context is treated as not mounted.
+ */
+int fs_create_ctx(fs_ctx* fs, const char* filename);
+int fs_delete_ctx(fs_ctx* fs, const char* filename);
+int fs_list_ctx(fs_ctx* fs, char filenames[][MAX_FILENAME], int max_files);
+int fs_write_ctx(fs_ctx* fs, const char* filename, const void* data, int size);
+int fs_pwrite_ctx(fs_ctx* fs, const char* filename, long long offset, const void* data, int size);
+int fs_append_ctx(fs_ctx* fs, const char* filename, const void* data, int size);
+int fs_read_ctx(fs_ctx* fs, const char* filename, void* buffer, int size);
+int fs_pread_ctx(fs_ctx* fs, const char* filename, void* buffer, long long offset, int size);
+int fs_read_zerocopy_ctx(fs_ctx* fs, const char* filename, fs_segment* segments, int max_segments);
+int fs_batch_ctx(fs_ctx* fs, fs_op* ops, int count);
+int fs_txn_begin_ctx(fs_ctx* fs);
+int fs_txn_commit_ctx(fs_ctx* fs);
+int fs_txn_abort_ctx(fs_ctx* fs);
+int fs_read_async_ctx(fs_ctx* fs, const char* filename, void* buffer, int size, fs_completion callback, void* cookie);
+int fs_write_async_ctx(fs_ctx* fs, const char* filename, const void* data, int size, fs_completion callback,
+                       void* cookie);
+int fs_completion_fd_ctx(fs_ctx* fs);
+int fs_poll_completions_ctx(fs_ctx* fs, int max_completions);
+void fs_get_stats_ctx(fs_ctx* fs, fs_stats* stats);
+int fs_set_commit_interval_ctx(fs_ctx* fs, int operations);
+int fs_set_durability_ctx(fs_ctx* fs, int mode, int operations, int milliseconds);
+int fs_sync_ctx(fs_ctx* fs);
+int fs_set_cache_size_ctx(fs_ctx* fs, int blocks);
+int fs_set_extent_mapping_ctx(fs_ctx* fs, int enabled);
+int fs_set_io_uring_ctx(fs_ctx* fs, int enabled);
+
 #endif /* FS_H */
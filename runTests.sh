@@ -14,13 +14,13 @@ gcc generate_invalid_images.c -o gen_images.o
 
 ./gen_images.o
 
-gcc Test1.c fs.c -o Test1.o 
+gcc Test1.c fs.c -o Test1.o -pthread
 
 sleep 2
 
 ./Test1.o
 
-gcc Test2.c fs.c -o Test2.o 
+gcc Test2.c fs.c -o Test2.o -pthread
 
 sleep 2
 